@@ -0,0 +1,246 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "include/modern-coapp.hpp"
+#include "include/modern-coapp/lazy_pdu.hpp"
+
+// Allocations are counted through the global operator new
+static std::atomic<uint64_t> allocations { 0 };
+
+void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// GCC can't tell that operator new above is malloc based
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+// ns/op, bytes/s and allocations/op of each operation, printed below the
+// statistics of Catch's own BENCHMARKs once a corpus is done
+std::vector<std::string> results;
+
+template <typename F>
+void report(const char* name, size_t bytes, F&& op)
+{
+    constexpr uint64_t iterations = 100000;
+
+    for (uint64_t i = 0; i < iterations / 10; i++)
+        op();
+
+    auto before = allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++)
+        op();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto allocated = allocations.load(std::memory_order_relaxed) - before;
+
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-26s %9.1f ns/op %9.1f MB/s %6.2f allocs/op",
+                  name, ns, bytes / ns * 1e3, double(allocated) / iterations);
+    results.emplace_back(line);
+}
+
+struct corpus
+{
+    const char* name;
+    std::vector<uint8_t> bytes;
+};
+
+// Adapted from libcoap, see test.cpp
+corpus libcoap()
+{
+    const char* path = "coap://example.com/12345/%3Fxyz/3048234234/23402348234/239084234-23/%AB%30%af/+123/hfksdh/23480-234-98235/1204/243546345345243/0198sdn3-a-3///aff0934/97u2141/0002/3932423532/56234023/----/=1234=/098141-9564643/21970-----/82364923472wererewr0-921-39123-34/";
+
+    coapp::pdu pdu;
+    pdu.set_type(coapp::Type::Acknowledgement);
+    pdu.set_code(coapp::Code::RESPONSE_CHANGED);
+    pdu.set_message_id(0x1234);
+    pdu.set_token({ 0x00, 0x00 });
+    pdu.set<coapp::Option::LocationPath>(path);
+    pdu.add<coapp::Option::LocationPath>("//492403--098/");
+    pdu.set<coapp::Option::LocationQuery>("*");
+    pdu.set_payload("data");
+    return { "libcoap", pdu.to_bytes() };
+}
+
+corpus tiny_get()
+{
+    coapp::pdu pdu;
+    pdu.set_code(coapp::Code::REQUEST_GET);
+    pdu.set_message_id(0x0102);
+    pdu.set_token({ 0xde, 0xad, 0xbe, 0xef });
+    pdu.set<coapp::Option::UriPath>("temp");
+    return { "tiny GET", pdu.to_bytes() };
+}
+
+corpus observe_notification()
+{
+    coapp::pdu pdu;
+    pdu.set_type(coapp::Type::NonConfirmable);
+    pdu.set_code(coapp::Code::RESPONSE_CONTENT);
+    pdu.set_message_id(0x2233);
+    pdu.set_token({ 1, 2, 3, 4, 5, 6, 7, 8 });
+    pdu.set<coapp::Option::Observe>(0x123456);
+    pdu.set<coapp::Option::ContentFormat>(50);
+    pdu.set<coapp::Option::MaxAge>(60);
+    pdu.set_payload("{\"temperature\":21.5}");
+    return { "Observe", pdu.to_bytes() };
+}
+
+corpus block()
+{
+    coapp::pdu pdu;
+    pdu.set_type(coapp::Type::Acknowledgement);
+    pdu.set_code(coapp::Code::RESPONSE_CONTENT);
+    pdu.set_message_id(0x3344);
+    pdu.set_token({ 9, 9 });
+    pdu.set<coapp::Option::ContentFormat>(42);
+    pdu.set<coapp::Option::Block2>((17 << 4) | 0x08 | 6);
+    pdu.set<coapp::Option::Size2>(1 << 20);
+    pdu.set_payload(std::string(1024, 'x'));
+    return { "1 KB block", pdu.to_bytes() };
+}
+
+corpus many_options()
+{
+    coapp::pdu pdu;
+    pdu.set_code(coapp::Code::REQUEST_POST);
+    pdu.set_message_id(0x4455);
+    pdu.set_token({ 1, 2, 3 });
+    pdu.set<coapp::Option::UriHost>("sensors.example.com");
+    pdu.set<coapp::Option::UriPort>(5683);
+    for (auto segment : { "api", "v2", "buildings", "17", "floors", "3", "rooms", "301", "sensors", "temperature" })
+        pdu.add<coapp::Option::UriPath>(segment);
+    pdu.set<coapp::Option::ContentFormat>(60);
+    for (auto query : { "unit=celsius", "precision=2", "window=60", "aggregate=mean" })
+        pdu.add<coapp::Option::UriQuery>(query);
+    pdu.set<coapp::Option::Accept>(60);
+    pdu.set<coapp::Option::Size1>(32);
+    pdu.set_payload(std::string(32, 'p'));
+    return { "many options", pdu.to_bytes() };
+}
+
+template <typename Pdu>
+void bench_pdu(const corpus& c, const char* name)
+{
+    const auto& bytes = c.bytes;
+
+    std::string parse = std::string(name) + "::from";
+    std::string encode = std::string(name) + "::to_bytes";
+    std::string serialize = std::string(name) + "::serialize_into";
+
+    BENCHMARK(parse.c_str()) {
+        return Pdu::from(bytes);
+    };
+    report(parse.c_str(), bytes.size(), [&] {
+        auto pdu = Pdu::from(bytes);
+        asm volatile("" : : "g"(&pdu) : "memory");
+    });
+
+    const auto pdu = Pdu::from(bytes);
+    BENCHMARK(encode.c_str()) {
+        return pdu.to_bytes();
+    };
+    report(encode.c_str(), bytes.size(), [&] {
+        auto encoded = pdu.to_bytes();
+        asm volatile("" : : "g"(encoded.data()) : "memory");
+    });
+
+    std::vector<uint8_t> out(bytes.size());
+    BENCHMARK(serialize.c_str()) {
+        return pdu.serialize_into(out.data(), out.size());
+    };
+    report(serialize.c_str(), bytes.size(), [&] {
+        auto size = pdu.serialize_into(out.data(), out.size());
+        asm volatile("" : : "g"(size), "g"(out.data()) : "memory");
+    });
+}
+
+void bench_view(const corpus& c)
+{
+    const auto& bytes = c.bytes;
+
+    // Validation plus a full walk over options and payload
+    auto walk = [&] {
+        auto view = coapp::pdu_view::from(bytes);
+        size_t sum = view.payload().size();
+        for (const auto& option : view.options())
+            sum += option.first + option.second.size();
+        return sum;
+    };
+
+    BENCHMARK("pdu_view::from") {
+        return walk();
+    };
+    report("pdu_view::from", bytes.size(), [&] {
+        auto sum = walk();
+        asm volatile("" : : "g"(sum) : "memory");
+    });
+
+    // Response matching only looks at the code and token
+    auto match = [&] {
+        auto pdu = coapp::lazy_pdu::from(bytes);
+        return pdu.code() + pdu.token().size();
+    };
+
+    BENCHMARK("lazy_pdu::from") {
+        return match();
+    };
+    report("lazy_pdu::from", bytes.size(), [&] {
+        auto sum = match();
+        asm volatile("" : : "g"(sum) : "memory");
+    });
+}
+
+void bench(const corpus& c)
+{
+    bench_view(c);
+    bench_pdu<coapp::pdu>(c, "pdu");
+    bench_pdu<coapp::flat_pdu>(c, "flat_pdu");
+
+    std::printf("\n%s, %zu bytes\n", c.name, c.bytes.size());
+    for (const auto& line : results)
+        std::printf("  %s\n", line.c_str());
+    std::printf("\n");
+    results.clear();
+}
+
+}
+
+TEST_CASE( "libcoap long Location-Path", "[bench]" ) {
+    bench(libcoap());
+}
+
+TEST_CASE( "Tiny CON GET", "[bench]" ) {
+    bench(tiny_get());
+}
+
+TEST_CASE( "Observe notification", "[bench]" ) {
+    bench(observe_notification());
+}
+
+TEST_CASE( "1 KB block payload", "[bench]" ) {
+    bench(block());
+}
+
+TEST_CASE( "Many options", "[bench]" ) {
+    bench(many_options());
+}
@@ -0,0 +1,27 @@
+// libFuzzer entry point for the PDU parser.
+// Build with -DMODERN_COAPP_BUILD_FUZZER=ON using Clang.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "../include/modern-coapp.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    auto view = coapp::pdu_view::try_from(data, size);
+    if (!view)
+        return 0;
+
+    size_t total = 0;
+    for (const auto& [number, value]: view->options())
+        total += number + value.size();
+    (void) total;
+
+    // Every valid PDU has a single canonical encoding
+    auto pdu = view->to_pdu<coapp::flat_pdu>();
+    auto bytes = pdu.to_bytes();
+    if (bytes.size() != size || !std::equal(bytes.begin(), bytes.end(), data))
+        __builtin_trap();
+
+    return 0;
+}
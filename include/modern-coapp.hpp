@@ -1,6 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <optional>
+#include <memory_resource>
+#include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #define RESPONSE_CODE(Code)  ((((Code) / 100) << 5) | ((Code) % 100))
@@ -43,6 +58,7 @@ enum Code: uint8_t {
     RESPONSE_NOT_FOUND                  = RESPONSE_CODE(404),
     RESPONSE_NOT_ALLOWED                = RESPONSE_CODE(405),
     RESPONSE_NOT_ACCEPTABLE             = RESPONSE_CODE(406),
+    RESPONSE_REQUEST_ENTITY_INCOMPLETE  = RESPONSE_CODE(408),
     RESPONSE_PRECONDITION_FAILED        = RESPONSE_CODE(412),
     RESPONSE_REQUEST_TOO_LARGE          = RESPONSE_CODE(413),
     RESPONSE_UNSUPPORTED_CONTENT_FORMAT = RESPONSE_CODE(415),
@@ -74,198 +90,1972 @@ enum Option {
     Size1 =         60
 };
 
-class invalid_pdu : public std::exception {};
+// Why a PDU failed to parse
+enum class parse_error: uint8_t {
+    none = 0,
+    truncated_header,     // Less than 4 bytes
+    bad_version,          // Version other than 1
+    invalid_token_length, // TKL larger than 8
+    truncated_token,      // TKL runs past the end of the PDU
+    reserved_nibble,      // Option delta or length nibble of 15
+    option_overrun,       // Option header or value runs past the end of the PDU
+    empty_payload,        // Payload marker without payload
+};
+
+constexpr const char* to_string(parse_error error)
+{
+    switch (error) {
+    case parse_error::none:                 return "none";
+    case parse_error::truncated_header:     return "truncated header";
+    case parse_error::bad_version:          return "bad version";
+    case parse_error::invalid_token_length: return "invalid token length";
+    case parse_error::truncated_token:      return "truncated token";
+    case parse_error::reserved_nibble:      return "reserved option nibble";
+    case parse_error::option_overrun:       return "option overrun";
+    case parse_error::empty_payload:        return "empty payload";
+    }
+    return "unknown";
+}
+
+class invalid_pdu : public std::exception
+{
+public:
+    invalid_pdu() = default;
+
+    explicit invalid_pdu(parse_error reason)
+        : _reason(reason)
+    {}
+
+    // parse_error::none when not raised by parsing
+    parse_error reason() const noexcept
+    {
+        return _reason;
+    }
+
+    const char* what() const noexcept override
+    {
+        return _reason == parse_error::none ? "invalid pdu" : to_string(_reason);
+    }
+
+private:
+    parse_error _reason { parse_error::none };
+};
+
+// Outcome of a non-throwing parse: either a value or the reason it failed
+template <typename T>
+class parse_result
+{
+public:
+    parse_result(T value)
+        : _value(std::move(value))
+    {}
+
+    parse_result(parse_error error)
+        : _error(error)
+    {}
+
+    bool has_value() const noexcept { return _error == parse_error::none; }
+    explicit operator bool() const noexcept { return has_value(); }
+
+    parse_error error() const noexcept { return _error; }
+
+    T& value() &
+    {
+        if (!has_value())
+            throw invalid_pdu(_error);
+        return _value;
+    }
+
+    const T& value() const &
+    {
+        if (!has_value())
+            throw invalid_pdu(_error);
+        return _value;
+    }
+
+    T&& value() &&
+    {
+        if (!has_value())
+            throw invalid_pdu(_error);
+        return std::move(_value);
+    }
+
+    T& operator*() & { return _value; }
+    const T& operator*() const & { return _value; }
+    T* operator->() { return &_value; }
+    const T* operator->() const { return &_value; }
+
+private:
+    T _value {};
+    parse_error _error { parse_error::none };
+};
+
+// Hot path counters, compiled in with MODERN_COAPP_ENABLE_STATS and free
+// otherwise. They are per thread and not atomic: scrape them on the owning
+// thread, e.g. from a task posted to each shard, and add the copies up.
+//
+// Allocations inside pdu::from and to_bytes() are only counted when one
+// translation unit defines MODERN_COAPP_STATS_OPERATOR_NEW before
+// including this header, which replaces the global operator new.
+#ifdef MODERN_COAPP_ENABLE_STATS
+constexpr bool stats_enabled = true;
+#else
+constexpr bool stats_enabled = false;
+#endif
+
+struct pdu_stats
+{
+    static constexpr size_t parse_errors = static_cast<size_t>(parse_error::empty_payload) + 1;
+
+    // Upper bounds of the option count histogram, plus a last +Inf bucket
+    static constexpr uint32_t option_buckets[] = { 0, 1, 2, 4, 8, 16, 32 };
+    static constexpr size_t histogram_size = std::size(option_buckets) + 1;
+
+    uint64_t parsed { 0 };
+    uint64_t parse_failures[parse_errors] {}; // Indexed by parse_error
+    uint64_t bytes_in { 0 };
+
+    uint64_t encoded { 0 };
+    uint64_t bytes_out { 0 };
+
+    uint64_t options[histogram_size] {}; // Parsed PDUs per bucket, not cumulative
+    uint64_t allocations { 0 };
+
+    pdu_stats& operator+=(const pdu_stats& other)
+    {
+        parsed += other.parsed;
+        for (size_t i = 0; i < parse_errors; i++)
+            parse_failures[i] += other.parse_failures[i];
+        bytes_in += other.bytes_in;
+        encoded += other.encoded;
+        bytes_out += other.bytes_out;
+        for (size_t i = 0; i < histogram_size; i++)
+            options[i] += other.options[i];
+        allocations += other.allocations;
+        return *this;
+    }
+
+    // Prometheus text exposition format
+    std::string to_prometheus(std::string_view prefix = "coapp") const
+    {
+        std::string out;
+        auto line = [&] (std::string_view name, std::string_view labels, uint64_t value) {
+            out.append(prefix).append("_").append(name);
+            if (!labels.empty())
+                out.append("{").append(labels).append("}");
+            out.append(" ").append(std::to_string(value)).append("\n");
+        };
+
+        line("pdus_parsed_total", {}, parsed);
+        for (size_t i = 1; i < parse_errors; i++) {
+            // Label values in snake case, e.g. "truncated_header"
+            std::string reason = "reason=\"";
+            for (auto c = to_string(static_cast<parse_error>(i)); *c; c++)
+                reason += *c == ' ' ? '_' : *c;
+            reason += '"';
+            line("parse_failures_total", reason, parse_failures[i]);
+        }
+        line("bytes_in_total", {}, bytes_in);
+        line("pdus_encoded_total", {}, encoded);
+        line("bytes_out_total", {}, bytes_out);
+
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < histogram_size; i++) {
+            cumulative += options[i];
+            std::string le = "le=\"";
+            le.append(i < std::size(option_buckets) ? std::to_string(option_buckets[i]) : "+Inf").append("\"");
+            line("options_bucket", le, cumulative);
+        }
+        line("options_count", {}, cumulative);
+        line("allocations_total", {}, allocations);
+        return out;
+    }
+};
+
+// Counters of the calling thread
+inline pdu_stats& thread_stats()
+{
+    thread_local pdu_stats stats;
+    return stats;
+}
+
+namespace detail {
+
+inline void count_parsed(size_t bytes, size_t options)
+{
+    if constexpr (stats_enabled) {
+        auto& stats = thread_stats();
+        stats.parsed++;
+        stats.bytes_in += bytes;
+
+        size_t bucket = 0;
+        while (bucket < std::size(pdu_stats::option_buckets) && options > pdu_stats::option_buckets[bucket])
+            bucket++;
+        stats.options[bucket]++;
+    }
+}
+
+inline void count_parse_failure(parse_error error)
+{
+    if constexpr (stats_enabled)
+        thread_stats().parse_failures[static_cast<size_t>(error)]++;
+}
+
+inline void count_encoded(size_t bytes)
+{
+    if constexpr (stats_enabled) {
+        auto& stats = thread_stats();
+        stats.encoded++;
+        stats.bytes_out += bytes;
+    }
+}
+
+inline bool& counting_allocations()
+{
+    thread_local bool counting = false;
+    return counting;
+}
+
+// Attributes allocations of the calling thread to the library while alive
+class allocation_scope
+{
+public:
+    allocation_scope()
+    {
+        if constexpr (stats_enabled) {
+            _outer = counting_allocations();
+            counting_allocations() = true;
+        }
+    }
+
+    ~allocation_scope()
+    {
+        if constexpr (stats_enabled)
+            counting_allocations() = _outer;
+    }
+
+    allocation_scope(const allocation_scope&) = delete;
+    allocation_scope& operator=(const allocation_scope&) = delete;
+
+private:
+    bool _outer { false };
+};
+
+}
+
+namespace detail {
+
+// https://datatracker.ietf.org/doc/html/rfc7252#section-3.1
+constexpr uint8_t option_nibble(uint32_t val)
+{
+    if (val < 13)
+        return val;
+    if (val < 269)
+        return 13;
+    return 14;
+}
+
+// Number of bytes a nibble needs after the first option header byte
+constexpr size_t option_extension_size(uint8_t nibble)
+{
+    return nibble < 13 ? 0 : nibble - 12;
+}
+
+constexpr size_t option_header_size(uint32_t delta, size_t length)
+{
+    return 1
+        + option_extension_size(option_nibble(delta))
+        + option_extension_size(option_nibble(length));
+}
+
+// Writes an option header at `out` and returns the position of the value
+constexpr uint8_t* encode_option_header(uint8_t* out, uint32_t delta, size_t length)
+{
+    uint8_t delta_nibble = option_nibble(delta);
+    uint8_t length_nibble = option_nibble(length);
+    *out++ = (delta_nibble << 4) | length_nibble;
+
+    auto encode_val = [&] (const uint8_t nibble, const uint32_t& val) {
+        if (nibble == 13) {
+            *out++ = val - 13;
+        } else if (nibble == 14) {
+            auto encoded_val = val - 269;
+            assert(encoded_val <= std::numeric_limits<uint16_t>::max());
+            *out++ = encoded_val >> 8;
+            *out++ = encoded_val;
+        }
+    };
+    encode_val(delta_nibble, delta);
+    encode_val(length_nibble, length);
+
+    return out;
+}
+
+// Length of the minimal uint option encoding of `val` (RFC 7252 section 3.2)
+constexpr size_t uint_size(uint32_t val)
+{
+    size_t size = 0;
+    while (val) {
+        size++;
+        val >>= 8;
+    }
+    return size;
+}
+
+// Writes `val` as a minimal big-endian uint option value, returns the end
+constexpr uint8_t* encode_uint(uint8_t* out, uint32_t val)
+{
+    for (auto size = uint_size(val); size > 0; size--)
+        *out++ = val >> ((size - 1) * 8);
+    return out;
+}
+
+struct option_nibble_info
+{
+    uint8_t extension_size; // 3 marks the reserved nibble
+    uint16_t base;
+};
+
+constexpr option_nibble_info option_nibbles[16] = {
+    { 0, 0 }, { 0, 1 }, { 0, 2 },  { 0, 3 },  { 0, 4 },  { 0, 5 },   { 0, 6 }, { 0, 7 },
+    { 0, 8 }, { 0, 9 }, { 0, 10 }, { 0, 11 }, { 0, 12 }, { 1, 13 }, { 2, 269 }, { 3, 0 },
+};
+
+constexpr uint32_t decode_option_extension(const uint8_t* ext, uint8_t extension_size)
+{
+    uint32_t val = 0;
+    if (extension_size >= 1)
+        val = ext[0];
+    if (extension_size == 2)
+        val = (val << 8) | ext[1];
+    return val;
+}
+
+// Decodes the option header at `it`, which must be before `end`, and leaves
+// `it` at the option value. The whole header (at most 5 bytes) is bounds
+// checked once before any extension byte is read; nothing past `end` is
+// ever read. The value itself is not checked against `end`.
+constexpr parse_error decode_option_header(const uint8_t*& it, const uint8_t* end,
+                                           uint32_t& delta, uint32_t& length) noexcept
+{
+    // https://datatracker.ietf.org/doc/html/rfc7252#section-3.1
+    const auto d = option_nibbles[*it >> 4];
+    const auto l = option_nibbles[*it & 0b00001111];
+
+    if (d.extension_size == 3 || l.extension_size == 3)
+        return parse_error::reserved_nibble;
+
+    const size_t header_size = 1 + d.extension_size + l.extension_size;
+    if (header_size > static_cast<size_t>(end - it))
+        return parse_error::option_overrun;
+
+    const auto ext = it + 1;
+    delta = d.base + decode_option_extension(ext, d.extension_size);
+    length = l.base + decode_option_extension(ext + d.extension_size, l.extension_size);
+
+    it += header_size;
+    return parse_error::none;
+}
+
+// Same for an option region that was already validated: no bounds checks
+constexpr void decode_option_header_unchecked(const uint8_t*& it, uint32_t& delta, uint32_t& length) noexcept
+{
+    const auto d = option_nibbles[*it >> 4];
+    const auto l = option_nibbles[*it & 0b00001111];
+
+    const auto ext = it + 1;
+    delta = d.base + decode_option_extension(ext, d.extension_size);
+    length = l.base + decode_option_extension(ext + d.extension_size, l.extension_size);
+
+    it += 1 + d.extension_size + l.extension_size;
+}
+
+}
+
+// Non-owning view over a contiguous range of bytes
+class bytes_view
+{
+public:
+    using value_type = uint8_t;
+    using const_iterator = const value_type*;
+
+    constexpr bytes_view() = default;
+
+    constexpr bytes_view(const value_type* data, size_t size)
+        : _data(data), _size(size)
+    {}
+
+    bytes_view(const std::vector<value_type>& bytes)
+        : _data(bytes.data()), _size(bytes.size())
+    {}
+
+    constexpr const value_type* data() const { return _data; }
+    constexpr size_t size() const { return _size; }
+    constexpr bool empty() const { return _size == 0; }
+
+    constexpr const_iterator begin() const { return _data; }
+    constexpr const_iterator end() const { return _data + _size; }
+
+    constexpr value_type operator[](size_t i) const { return _data[i]; }
+
+    friend bool operator==(bytes_view lhs, bytes_view rhs)
+    {
+        return lhs._size == rhs._size
+            && (lhs._size == 0 || std::memcmp(lhs._data, rhs._data, lhs._size) == 0);
+    }
+
+    friend bool operator!=(bytes_view lhs, bytes_view rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+private:
+    const value_type* _data { nullptr };
+    size_t _size { 0 };
+};
+
+namespace detail {
+
+template <typename Bytes, typename = void>
+struct is_byte_range : std::false_type {};
+
+template <typename Bytes>
+struct is_byte_range<Bytes, std::void_t<
+    decltype(std::declval<const Bytes&>().data()),
+    decltype(std::declval<const Bytes&>().size())>>
+    : std::bool_constant<sizeof(*std::declval<const Bytes&>().data()) == 1> {};
+
+}
+
+// Token stored inline. RFC 7252 limits tokens to 8 bytes, so the token never
+// allocates and compares and hashes as a single 64-bit word plus a length.
+class inline_token
+{
+public:
+    using value_type = uint8_t;
+    using const_iterator = const value_type*;
+
+    static constexpr size_t max_size = 8;
+
+    constexpr inline_token() = default;
+
+    inline_token(const value_type* data, size_t size)
+    {
+        assign(data, data + size);
+    }
+
+    inline_token(std::initializer_list<value_type> bytes)
+    {
+        assign(bytes.begin(), bytes.end());
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<
+        detail::is_byte_range<Bytes>::value && !std::is_same_v<Bytes, inline_token>>>
+    inline_token(const Bytes& bytes)
+    {
+        auto data = reinterpret_cast<const value_type*>(bytes.data());
+        assign(data, data + bytes.size());
+    }
+
+    template <typename It>
+    void assign(It first, It last)
+    {
+        auto size = std::distance(first, last);
+        if (size < 0 || static_cast<size_t>(size) > max_size)
+            throw invalid_pdu();
+
+        std::fill(std::copy(first, last, _bytes), std::end(_bytes), 0);
+        _size = size;
+    }
+
+    const value_type* data() const { return _bytes; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    const_iterator begin() const { return _bytes; }
+    const_iterator end() const { return _bytes + _size; }
+
+    value_type operator[](size_t i) const { return _bytes[i]; }
+
+    // The token bytes zero-padded to 64 bits, in memory order
+    uint64_t word() const
+    {
+        uint64_t word;
+        std::memcpy(&word, _bytes, sizeof(word));
+        return word;
+    }
+
+    operator bytes_view() const
+    {
+        return { _bytes, _size };
+    }
+
+    friend bool operator==(const inline_token& lhs, const inline_token& rhs)
+    {
+        return lhs.word() == rhs.word() && lhs._size == rhs._size;
+    }
+
+    friend bool operator!=(const inline_token& lhs, const inline_token& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<detail::is_byte_range<Bytes>::value>>
+    friend bool operator==(const inline_token& lhs, const Bytes& rhs)
+    {
+        return bytes_view(lhs) == bytes_view(reinterpret_cast<const value_type*>(rhs.data()), rhs.size());
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<detail::is_byte_range<Bytes>::value>>
+    friend bool operator==(const Bytes& lhs, const inline_token& rhs)
+    {
+        return rhs == lhs;
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<detail::is_byte_range<Bytes>::value>>
+    friend bool operator!=(const inline_token& lhs, const Bytes& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<detail::is_byte_range<Bytes>::value>>
+    friend bool operator!=(const Bytes& lhs, const inline_token& rhs)
+    {
+        return !(rhs == lhs);
+    }
+
+private:
+    value_type _bytes[max_size] {};
+    uint8_t _size { 0 };
+};
+
+namespace detail {
+
+// Vector of trivially copyable elements that keeps up to N of them inline
+template <typename T, size_t N>
+class small_vector
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    small_vector() = default;
+
+    small_vector(const small_vector& other)
+    {
+        append(other.data(), other.size());
+    }
+
+    small_vector(small_vector&& other) noexcept
+    {
+        steal(other);
+    }
+
+    small_vector& operator=(const small_vector& other)
+    {
+        if (this != &other) {
+            clear();
+            append(other.data(), other.size());
+        }
+        return *this;
+    }
+
+    small_vector& operator=(small_vector&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    ~small_vector()
+    {
+        release();
+    }
+
+    T* data() { return _data; }
+    const T* data() const { return _data; }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    bool empty() const { return _size == 0; }
+    bool is_inline() const { return _data == inline_data(); }
+
+    T* begin() { return _data; }
+    T* end() { return _data + _size; }
+    const T* begin() const { return _data; }
+    const T* end() const { return _data + _size; }
+
+    T& operator[](size_t i) { return _data[i]; }
+    const T& operator[](size_t i) const { return _data[i]; }
+
+    void reserve(size_t capacity)
+    {
+        if (capacity <= _capacity)
+            return;
+
+        auto data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+        if (_size)
+            std::memcpy(data, _data, _size * sizeof(T));
+
+        auto size = _size;
+        release();
+        _data = data;
+        _size = size;
+        _capacity = capacity;
+    }
+
+    void clear()
+    {
+        _size = 0;
+    }
+
+    void push_back(const T& value)
+    {
+        insert(_size, value);
+    }
+
+    // Appends `count` elements, which must not alias this vector
+    void append(const T* values, size_t count)
+    {
+        grow(_size + count);
+        if (count)
+            std::memcpy(_data + _size, values, count * sizeof(T));
+        _size += count;
+    }
+
+    void insert(size_t pos, const T& value)
+    {
+        T copy = value; // `value` may live in this vector
+        grow(_size + 1);
+        std::memmove(_data + pos + 1, _data + pos, (_size - pos) * sizeof(T));
+        _data[pos] = copy;
+        _size++;
+    }
+
+    void erase(size_t pos)
+    {
+        std::memmove(_data + pos, _data + pos + 1, (_size - pos - 1) * sizeof(T));
+        _size--;
+    }
+
+private:
+    static constexpr size_t inline_capacity = N ? N : 1;
+
+    T* inline_data() { return reinterpret_cast<T*>(_inline); }
+    const T* inline_data() const { return reinterpret_cast<const T*>(_inline); }
+
+    void grow(size_t required)
+    {
+        if (required > _capacity)
+            reserve(std::max(required, _capacity * 2));
+    }
+
+    void release()
+    {
+        if (!is_inline())
+            ::operator delete(_data);
+
+        _data = inline_data();
+        _capacity = inline_capacity;
+        _size = 0;
+    }
+
+    void steal(small_vector& other)
+    {
+        if (other.is_inline()) {
+            append(other.data(), other.size());
+            other.clear();
+            return;
+        }
+
+        _data = other._data;
+        _size = other._size;
+        _capacity = other._capacity;
+
+        other._data = other.inline_data();
+        other._size = 0;
+        other._capacity = inline_capacity;
+    }
+
+    alignas(T) unsigned char _inline[inline_capacity * sizeof(T)];
+
+    T* _data { inline_data() };
+    size_t _size { 0 };
+    size_t _capacity { inline_capacity };
+};
+
+}
+
+// Contiguous option container: a sorted vector of (number, offset, length)
+// entries referencing the values in a single byte arena. Both keep their
+// first elements inline, so typical PDUs store their options without any
+// heap allocation. Iterators are invalidated by insertion and removal.
+template <size_t InlineOptions, size_t InlineBytes>
+class basic_flat_options
+{
+    struct entry
+    {
+        uint32_t number;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+public:
+    using key_type = uint32_t;
+    using value_type = std::pair<key_type, bytes_view>;
+    using size_type = size_t;
+
+    // Yields (number, value) pairs by value, built from the entry, so it's
+    // only bidirectional: a random access iterator must return references
+    // that outlive it. Offsets and differences are still constant time.
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = basic_flat_options::value_type;
+        using difference_type = std::ptrdiff_t;
+        using reference = value_type;
+
+        struct pointer
+        {
+            value_type value;
+            const value_type* operator->() const { return &value; }
+        };
+
+        const_iterator() = default;
+
+        reference operator*() const
+        {
+            return { _entry->number, { _arena + _entry->offset, _entry->length } };
+        }
+
+        pointer operator->() const
+        {
+            return { **this };
+        }
+
+        const_iterator& operator++() { ++_entry; return *this; }
+        const_iterator& operator--() { --_entry; return *this; }
+        const_iterator operator++(int) { auto tmp = *this; ++_entry; return tmp; }
+        const_iterator operator--(int) { auto tmp = *this; --_entry; return tmp; }
+
+        const_iterator& operator+=(difference_type n) { _entry += n; return *this; }
+        const_iterator& operator-=(difference_type n) { _entry -= n; return *this; }
+
+        friend const_iterator operator+(const_iterator it, difference_type n) { return it += n; }
+        friend const_iterator operator-(const_iterator it, difference_type n) { return it -= n; }
+
+        friend difference_type operator-(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs._entry - rhs._entry;
+        }
+
+        friend bool operator==(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs._entry == rhs._entry;
+        }
+
+        friend bool operator!=(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs._entry != rhs._entry;
+        }
+
+        friend bool operator<(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs._entry < rhs._entry;
+        }
+
+    private:
+        friend class basic_flat_options;
+
+        const_iterator(const entry* e, const uint8_t* arena)
+            : _entry(e), _arena(arena)
+        {}
+
+        const entry* _entry { nullptr };
+        const uint8_t* _arena { nullptr };
+    };
+
+    using iterator = const_iterator;
+
+    const_iterator begin() const { return { _entries.begin(), _arena.data() }; }
+    const_iterator end() const { return { _entries.end(), _arena.data() }; }
+
+    size_t size() const { return _entries.size(); }
+    bool empty() const { return _entries.empty(); }
+
+    void clear()
+    {
+        _entries.clear();
+        _arena.clear();
+    }
+
+    const_iterator lower_bound(key_type number) const
+    {
+        return { std::lower_bound(_entries.begin(), _entries.end(), number,
+                     [] (const entry& e, key_type n) { return e.number < n; }),
+                 _arena.data() };
+    }
+
+    const_iterator upper_bound(key_type number) const
+    {
+        return { std::upper_bound(_entries.begin(), _entries.end(), number,
+                     [] (key_type n, const entry& e) { return n < e.number; }),
+                 _arena.data() };
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(key_type number) const
+    {
+        return { lower_bound(number), upper_bound(number) };
+    }
+
+    const_iterator find(key_type number) const
+    {
+        auto it = lower_bound(number);
+        if (it != end() && it->first == number)
+            return it;
+        return end();
+    }
+
+    size_t count(key_type number) const
+    {
+        auto [first, last] = equal_range(number);
+        return last - first;
+    }
+
+    // Inserts after any options with the same number, like std::multimap
+    const_iterator emplace(key_type number, const uint8_t* data, size_t length)
+    {
+        uint32_t offset = _arena.size();
+
+        // The value may already live in the arena, which moves when it grows
+        if (length && data >= _arena.begin() && data < _arena.end()) {
+            auto source = data - _arena.data();
+            _arena.reserve(_arena.size() + length);
+            data = _arena.data() + source;
+        }
+        _arena.append(data, length);
+
+        auto pos = upper_bound(number)._entry - _entries.begin();
+        _entries.insert(pos, entry { number, offset, static_cast<uint32_t>(length) });
+
+        return { _entries.begin() + pos, _arena.data() };
+    }
+
+    const_iterator emplace(key_type number, bytes_view value)
+    {
+        return emplace(number, value.data(), value.size());
+    }
+
+    // Removes an option. Its value bytes stay in the arena until clear().
+    const_iterator erase(const_iterator pos)
+    {
+        auto index = pos._entry - _entries.begin();
+        _entries.erase(index);
+        return { _entries.begin() + index, _arena.data() };
+    }
+
+    size_t erase(key_type number)
+    {
+        auto [first, last] = equal_range(number);
+        size_t n = last - first;
+        for (size_t i = 0; i < n; i++)
+            first = erase(first);
+        return n;
+    }
+
+private:
+    detail::small_vector<entry, InlineOptions> _entries;
+    detail::small_vector<uint8_t, InlineBytes> _arena;
+};
+
+using flat_options = basic_flat_options<8, 64>;
+
+// Byte string keeping up to N bytes inline, for option values that are
+// almost always short (uints, Content-Format, short Uri-Path segments)
+template <size_t N>
+class small_bytes
+{
+public:
+    using value_type = uint8_t;
+    using const_iterator = const value_type*;
+
+    small_bytes() = default;
+
+    small_bytes(const value_type* first, const value_type* last)
+    {
+        assign(first, last);
+    }
+
+    small_bytes(std::initializer_list<value_type> bytes)
+    {
+        assign(bytes.begin(), bytes.end());
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<
+        detail::is_byte_range<Bytes>::value && !std::is_same_v<Bytes, small_bytes>>>
+    small_bytes(const Bytes& bytes)
+    {
+        auto data = reinterpret_cast<const value_type*>(bytes.data());
+        assign(data, data + bytes.size());
+    }
+
+    void assign(const value_type* first, const value_type* last)
+    {
+        _bytes.clear();
+        _bytes.append(first, last - first);
+    }
+
+    const value_type* data() const { return _bytes.data(); }
+    size_t size() const { return _bytes.size(); }
+    bool empty() const { return _bytes.empty(); }
+    bool is_inline() const { return _bytes.is_inline(); }
+
+    const_iterator begin() const { return _bytes.begin(); }
+    const_iterator end() const { return _bytes.end(); }
+
+    value_type operator[](size_t i) const { return _bytes[i]; }
+
+    operator bytes_view() const
+    {
+        return { data(), size() };
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<detail::is_byte_range<Bytes>::value>>
+    friend bool operator==(const small_bytes& lhs, const Bytes& rhs)
+    {
+        return bytes_view(lhs) == bytes_view(reinterpret_cast<const value_type*>(rhs.data()), rhs.size());
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<
+        detail::is_byte_range<Bytes>::value && !std::is_same_v<Bytes, small_bytes>>>
+    friend bool operator==(const Bytes& lhs, const small_bytes& rhs)
+    {
+        return rhs == lhs;
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<detail::is_byte_range<Bytes>::value>>
+    friend bool operator!=(const small_bytes& lhs, const Bytes& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    template <typename Bytes, typename = std::enable_if_t<
+        detail::is_byte_range<Bytes>::value && !std::is_same_v<Bytes, small_bytes>>>
+    friend bool operator!=(const Bytes& lhs, const small_bytes& rhs)
+    {
+        return !(rhs == lhs);
+    }
+
+private:
+    detail::small_vector<value_type, N> _bytes;
+};
+
+using option_value = small_bytes<16>;
+
+namespace detail {
+
+// Option storage either maps numbers to owning values (std::multimap),
+// or copies values into its own storage through emplace(number, data, size).
+template <typename Storage, typename = void>
+struct is_mapped_option_storage : std::false_type {};
+
+template <typename Storage>
+struct is_mapped_option_storage<Storage, std::void_t<typename Storage::mapped_type>>
+    : std::true_type {};
+
+template <typename Storage, typename = void>
+struct option_value_type
+{
+    using type = option_value;
+};
+
+template <typename Storage>
+struct option_value_type<Storage, std::void_t<typename Storage::mapped_type>>
+{
+    using type = typename Storage::mapped_type;
+};
+
+// Payload storage either owns a copy (std::string) or borrows from the
+// source buffer (std::string_view)
+template <typename Payload>
+void assign_payload(Payload& payload, const char* data, size_t size)
+{
+    if constexpr (std::is_same_v<Payload, std::string_view>)
+        payload = { data, size };
+    else
+        payload.assign(data, size);
+}
+
+template <typename Storage>
+void emplace_option(Storage& options, uint32_t number, const uint8_t* data, size_t size)
+{
+    // Constructed in place, so allocator-aware storage allocates the value
+    // from its own allocator
+    if constexpr (is_mapped_option_storage<Storage>::value)
+        options.emplace(std::piecewise_construct,
+                        std::forward_as_tuple(number),
+                        std::forward_as_tuple(data, data + size));
+    else
+        options.emplace(number, data, size);
+}
+
+}
+
+namespace detail {
+
+constexpr uint64_t fnv1a_basis = 0xcbf29ce484222325ull;
+
+template <typename Char>
+constexpr uint64_t fnv1a(uint64_t hash, const Char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Hashes URI segments prefixed by a separator, so that hashing Uri-Path
+// options gives the same result as hashing the path "/a/b"
+template <char Separator>
+class uri_hasher
+{
+public:
+    template <typename Char>
+    constexpr void add(const Char* segment, size_t size)
+    {
+        constexpr char separator[] = { Separator };
+        _hash = fnv1a(_hash, separator, 1);
+        _hash = fnv1a(_hash, segment, size);
+    }
+
+    constexpr uint64_t value() const
+    {
+        return _hash;
+    }
+
+private:
+    uint64_t _hash { fnv1a_basis };
+};
+
+template <char Separator>
+constexpr uint64_t hash_uri_segments(std::string_view str)
+{
+    uri_hasher<Separator> hasher;
+    if (str.empty())
+        return hasher.value();
+
+    size_t begin = 0;
+    for (;;) {
+        auto end = str.find(Separator, begin);
+        if (end == std::string_view::npos) {
+            hasher.add(str.data() + begin, str.size() - begin);
+            return hasher.value();
+        }
+        hasher.add(str.data() + begin, end - begin);
+        begin = end + 1;
+    }
+}
+
+}
+
+// Hash of a request path as its Uri-Path options would be hashed, e.g.
+// uri_path_hash("/sensors/temp"). "" and "/" both mean no Uri-Path options.
+// Segments are compared as-is, without percent-decoding.
+constexpr uint64_t uri_path_hash(std::string_view path)
+{
+    if (!path.empty() && path.front() == '/')
+        path.remove_prefix(1);
+    return detail::hash_uri_segments<'/'>(path);
+}
+
+// Hash of a query as its Uri-Query options would be hashed, e.g.
+// uri_query_hash("a=1&b=2") or uri_query_hash("?a=1&b=2")
+constexpr uint64_t uri_query_hash(std::string_view query)
+{
+    if (!query.empty() && query.front() == '?')
+        query.remove_prefix(1);
+    return detail::hash_uri_segments<'&'>(query);
+}
+
+enum class parse_flags: uint8_t {
+    none = 0,
+    hash_uri_path = 1 << 0,  // Precompute uri_path_hash() during parsing
+    hash_uri_query = 1 << 1, // Precompute uri_query_hash() during parsing
+};
+
+constexpr parse_flags operator|(parse_flags lhs, parse_flags rhs)
+{
+    return static_cast<parse_flags>(static_cast<uint8_t>(lhs) | static_cast<uint8_t>(rhs));
+}
+
+constexpr bool operator&(parse_flags lhs, parse_flags rhs)
+{
+    return static_cast<uint8_t>(lhs) & static_cast<uint8_t>(rhs);
+}
+
+// https://datatracker.ietf.org/doc/html/rfc7252#section-3.2
+enum class option_format {
+    empty,
+    opaque,
+    uint,
+    string,
+};
+
+constexpr bool is_critical(uint32_t number) { return number & 1; }
+constexpr bool is_unsafe(uint32_t number) { return number & 2; }
+constexpr bool is_no_cache_key(uint32_t number) { return (number & 0x1e) == 0x1c; }
+
+template <option_format Format>
+struct option_codec;
+
+template <>
+struct option_codec<option_format::empty>
+{
+    using value_type = bool;
+
+    static constexpr value_type decode(bytes_view) { return true; }
+};
+
+template <>
+struct option_codec<option_format::opaque>
+{
+    using value_type = bytes_view;
+
+    static constexpr value_type decode(bytes_view value) { return value; }
+};
+
+template <>
+struct option_codec<option_format::uint>
+{
+    using value_type = uint32_t;
+
+    static constexpr value_type decode(bytes_view value)
+    {
+        uint32_t val = 0;
+        for (auto byte: value)
+            val = (val << 8) | byte;
+        return val;
+    }
+};
+
+template <>
+struct option_codec<option_format::string>
+{
+    using value_type = std::string_view;
+
+    static value_type decode(bytes_view value)
+    {
+        return { reinterpret_cast<const char*>(value.data()), value.size() };
+    }
+};
+
+namespace detail {
+
+template <option_format Format, size_t MinLength, size_t MaxLength, bool Repeatable>
+struct option_definition
+{
+    static constexpr option_format format = Format;
+    static constexpr size_t min_length = MinLength;
+    static constexpr size_t max_length = MaxLength;
+    static constexpr bool repeatable = Repeatable;
+
+    using codec = option_codec<Format>;
+    using value_type = typename codec::value_type;
+};
+
+}
+
+// Format, length bounds and repeatability of each option (RFC 7252
+// section 5.10, RFC 7641 and RFC 7959)
+template <Option O>
+struct option_traits;
+
+#define COAPP_OPTION(Name, Format, Min, Max, Repeatable)                             \
+    template <>                                                                      \
+    struct option_traits<Option::Name>                                               \
+        : detail::option_definition<option_format::Format, Min, Max, Repeatable>     \
+    {                                                                                \
+        static constexpr uint32_t number = Option::Name;                             \
+        static constexpr bool critical = is_critical(Option::Name);                  \
+    };
+
+COAPP_OPTION(IfMatch,       opaque, 0, 8,   true)
+COAPP_OPTION(UriHost,       string, 1, 255, false)
+COAPP_OPTION(ETag,          opaque, 1, 8,   true)
+COAPP_OPTION(IfNoneMatch,   empty,  0, 0,   false)
+COAPP_OPTION(Observe,       uint,   0, 3,   false)
+COAPP_OPTION(UriPort,       uint,   0, 2,   false)
+COAPP_OPTION(LocationPath,  string, 0, 255, true)
+COAPP_OPTION(UriPath,       string, 0, 255, true)
+COAPP_OPTION(ContentFormat, uint,   0, 2,   false)
+COAPP_OPTION(MaxAge,        uint,   0, 4,   false)
+COAPP_OPTION(UriQuery,      string, 0, 255, true)
+COAPP_OPTION(Accept,        uint,   0, 2,   false)
+COAPP_OPTION(LocationQuery, string, 0, 255, true)
+COAPP_OPTION(Block2,        uint,   0, 3,   false)
+COAPP_OPTION(Block1,        uint,   0, 3,   false)
+COAPP_OPTION(Size2,         uint,   0, 4,   false)
+COAPP_OPTION(Size1,         uint,   0, 4,   false)
+
+#undef COAPP_OPTION
+
+namespace detail {
+
+template <typename Bytes>
+bytes_view as_bytes_view(const Bytes& bytes)
+{
+    return { reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size() };
+}
+
+template <Option O>
+constexpr bool has_valid_length(bytes_view value)
+{
+    return value.size() >= option_traits<O>::min_length
+        && value.size() <= option_traits<O>::max_length;
+}
+
+}
+
+// Decoded values of every occurrence of option O, skipping values with an
+// invalid length
+template <Option O, typename It>
+class option_values
+{
+public:
+    using value_type = typename option_traits<O>::value_type;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = option_values::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = value_type;
+
+        iterator() = default;
+
+        iterator(It it, It end)
+            : _it(it), _end(end)
+        {
+            skip_invalid();
+        }
+
+        value_type operator*() const
+        {
+            return option_traits<O>::codec::decode(detail::as_bytes_view(_it->second));
+        }
+
+        iterator& operator++()
+        {
+            ++_it;
+            skip_invalid();
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            auto tmp = *this;
+            ++(*this);
+            return tmp;
+        }
 
-class pdu
+        friend bool operator==(const iterator& lhs, const iterator& rhs) { return lhs._it == rhs._it; }
+        friend bool operator!=(const iterator& lhs, const iterator& rhs) { return lhs._it != rhs._it; }
+
+    private:
+        void skip_invalid()
+        {
+            while (_it != _end && !detail::has_valid_length<O>(detail::as_bytes_view(_it->second)))
+                ++_it;
+        }
+
+        It _it {};
+        It _end {};
+    };
+
+    option_values(It first, It last)
+        : _first(first), _last(last)
+    {}
+
+    iterator begin() const { return { _first, _last }; }
+    iterator end() const { return { _last, _last }; }
+
+    bool empty() const { return begin() == end(); }
+
+    size_t size() const
+    {
+        return std::distance(begin(), end());
+    }
+
+private:
+    It _first;
+    It _last;
+};
+
+// Typed option access for anything with an ordered options() range
+template <typename Derived>
+class option_accessors
 {
 public:
-    using byte_t = uint8_t;
-    using bytes_t = std::vector<byte_t>;
+    template <Option O>
+    bool has() const
+    {
+        return !get_all<O>().empty();
+    }
 
-    using token_t = bytes_t;
+    // First valid occurrence of option O. Later occurrences of
+    // non-repeatable options are ignored, as RFC 7252 section 5.4.5 requires.
+    template <Option O>
+    std::optional<typename option_traits<O>::value_type> get() const
+    {
+        auto values = get_all<O>();
+        if (values.empty())
+            return std::nullopt;
+        return *values.begin();
+    }
 
-    using option_number_t = uint32_t;
-    using option_value_t = bytes_t;
-    using options_t = std::multimap<option_number_t, option_value_t>;
+    template <Option O>
+    auto get_all() const
+    {
+        const auto& options = static_cast<const Derived&>(*this).options();
+        auto [first, last] = options.equal_range(O);
+        return option_values<O, decltype(first)>(first, last);
+    }
 
-    using payload_t = std::string;
+    // See coapp::uri_path_hash
+    uint64_t uri_path_hash() const
+    {
+        return hash_options<Option::UriPath, '/'>();
+    }
 
-    pdu() = default;
+    // See coapp::uri_query_hash
+    uint64_t uri_query_hash() const
+    {
+        return hash_options<Option::UriQuery, '&'>();
+    }
 
-    static pdu from(bytes_t bytes)
+private:
+    template <Option O, char Separator>
+    uint64_t hash_options() const
     {
-        /*
+        const auto& options = static_cast<const Derived&>(*this).options();
+        auto [first, last] = options.equal_range(O);
 
-        PDU contains at least 4 bytes:
+        detail::uri_hasher<Separator> hasher;
+        for (; first != last; ++first) {
+            auto value = detail::as_bytes_view(first->second);
+            hasher.add(value.data(), value.size());
+        }
+        return hasher.value();
+    }
+};
 
-        0                   1                   2                   3
-        0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-        +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-        |Ver| T |  TKL  |      Code     |          Message ID           |
-        +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+template <typename OptionStorage,
+          typename Payload = std::string,
+          typename Token = inline_token>
+class basic_pdu;
 
-        */
-        if (bytes.size() < 4)
-            throw invalid_pdu();
+using pdu = basic_pdu<std::multimap<uint32_t, std::vector<uint8_t>>>;
+using flat_pdu = basic_pdu<flat_options>;
 
-        pdu result;
+// Payload borrowed from the parsed buffer, which must outlive the PDU.
+// Created through pdu_view::to_pdu or try_from; options stay owned.
+using borrowed_pdu = basic_pdu<flat_options, std::string_view>;
 
-        const auto& header = bytes[0];
+namespace pmr {
 
-        result._version = header >> 6;
-        if (result._version != 1)
-            throw invalid_pdu();
+// PDU allocating its options and payload from a memory resource, e.g. a
+// std::pmr::monotonic_buffer_resource per request/response cycle
+using pdu = basic_pdu<std::pmr::multimap<uint32_t, std::pmr::vector<uint8_t>>,
+                      std::pmr::string>;
 
-        result._type = static_cast<Type>((header & 0b00110000) >> 4);
-        auto token_length = (header & 0b00001111);
-        if (token_length > 8)
-            throw invalid_pdu();
+}
+
+// Where the parts of a well-formed PDU start, see validate_pdu()
+struct pdu_layout
+{
+    const uint8_t* options_begin { nullptr };
+    const uint8_t* options_end { nullptr };
+    const uint8_t* payload { nullptr }; // End of the PDU without payload
+    size_t options { 0 };
+};
+
+namespace detail {
 
-        result._code = static_cast<Code>(bytes[1]);
-        result._message_id = (bytes[2] << 8) | (bytes[3]);
+// Checks the fixed header and that the token fits
+constexpr parse_error scan_header(const uint8_t* data, size_t size) noexcept
+{
+    /*
 
-        // Parse token
-        auto token_offset = bytes.begin() + 4;
-        auto it = token_offset + token_length;
+    PDU contains at least 4 bytes:
 
-        if (it > bytes.end())
-            throw invalid_pdu();
+    0                   1                   2                   3
+    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+    |Ver| T |  TKL  |      Code     |          Message ID           |
+    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+    */
+    if (size < 4)
+        return parse_error::truncated_header;
+
+    if ((data[0] >> 6) != 1)
+        return parse_error::bad_version;
+
+    auto token_length = data[0] & 0b00001111;
+    if (token_length > 8)
+        return parse_error::invalid_token_length;
+
+    // Token directly follows the header
+    if (static_cast<size_t>(token_length) > size - 4)
+        return parse_error::truncated_token;
+
+    return parse_error::none;
+}
+
+// Checks the header, token, every option header and value length and the
+// payload marker, calling on_option(number, value, length) for each option.
+// The walk jumps from option to option, it never scans values, which may
+// contain 0xFF bytes themselves.
+template <typename F>
+constexpr parse_error scan_pdu(const uint8_t* data, size_t size, pdu_layout& layout, F&& on_option) noexcept
+{
+    if (auto error = scan_header(data, size); error != parse_error::none)
+        return error;
+
+    const auto end = data + size;
+    auto it = data + 4 + (data[0] & 0b00001111);
+
+    // Validate options, options and payload are separated by a FF byte
+    layout.options_begin = it;
+    size_t count = 0;
+    uint32_t option_number = 0;
+    while (it < end && (*it) != 0xff) {
+        uint32_t delta = 0;
+        uint32_t length = 0;
+        if (auto error = decode_option_header(it, end, delta, length); error != parse_error::none)
+            return error;
+
+        if (length > static_cast<size_t>(end - it))
+            return parse_error::option_overrun;
+
+        option_number += delta;
+        on_option(option_number, it, length);
+
+        it += length;
+        count++;
+    }
+    layout.options_end = it;
+    layout.options = count;
+
+    if (it < end) {
+        it++; // Skip the payload separator
+
+        if (it == end)
+            return parse_error::empty_payload;
+    }
+
+    // Rest of the PDU is payload
+    layout.payload = it;
+    return parse_error::none;
+}
+
+}
+
+// Checks that `data` is a well-formed PDU without decoding it, e.g. for
+// gateways that forward datagrams as they are
+constexpr parse_error validate_pdu(const uint8_t* data, size_t size) noexcept
+{
+    pdu_layout layout;
+    return detail::scan_pdu(data, size, layout, [] (uint32_t, const uint8_t*, uint32_t) {});
+}
+
+inline parse_error validate_pdu(bytes_view bytes) noexcept
+{
+    return validate_pdu(bytes.data(), bytes.size());
+}
+
+// Read-only PDU that parses over a caller-owned buffer.
+// The buffer must outlive the view and every value obtained from it.
+class pdu_view : public option_accessors<pdu_view>
+{
+public:
+    using byte_t = uint8_t;
+    using bytes_t = std::vector<byte_t>;
+
+    using option_number_t = uint32_t;
+    using option_t = std::pair<option_number_t, bytes_view>;
+
+    // Iterates the options in the order they appear on the wire, which is
+    // ascending option number. Options are decoded on the fly.
+    class option_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = option_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        option_iterator() = default;
+
+        reference operator*() const { return _current; }
+        pointer operator->() const { return &_current; }
+
+        option_iterator& operator++()
+        {
+            _pos = _next;
+            decode();
+            return *this;
+        }
 
-        result._token = { token_offset, it };
+        option_iterator operator++(int)
+        {
+            auto tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        friend bool operator==(const option_iterator& lhs, const option_iterator& rhs)
+        {
+            return lhs._pos == rhs._pos;
+        }
+
+        friend bool operator!=(const option_iterator& lhs, const option_iterator& rhs)
+        {
+            return lhs._pos != rhs._pos;
+        }
+
+    private:
+        friend class pdu_view;
+
+        option_iterator(const byte_t* pos, const byte_t* end)
+            : _pos(pos), _end(end)
+        {
+            decode();
+        }
 
-        if (it >= bytes.end())
-            return result; // No options or payload
+        void decode()
+        {
+            if (_pos == _end)
+                return;
 
-        // Parse options
-        // Options and payload are separated by a FF byte
-        option_number_t option_number = 0;
-        while (it < bytes.end() && (*it) != 0xff) {
-            // https://datatracker.ietf.org/doc/html/rfc7252#section-3.1
+            // The options region was validated by pdu_view::from
+            uint32_t delta = 0;
+            uint32_t length = 0;
+            auto it = _pos;
+            detail::decode_option_header_unchecked(it, delta, length);
 
-            uint32_t option_delta = *it >> 4;
-            uint32_t option_length = *it & 0b00001111;
+            _current.first += delta;
+            _current.second = { it, length };
+            _next = it + length;
+        }
 
-            auto parse_value = [&] (uint32_t& val) {
-                if (val == 13)
-                    val = 13 + *(++it);
-                else if (val == 14)
-                    val = 269 + ((*(++it) << 8) | (*(++it)));
-                else if (val == 15)
-                    throw invalid_pdu();
-            };
+        const byte_t* _pos { nullptr };
+        const byte_t* _next { nullptr };
+        const byte_t* _end { nullptr };
+        option_t _current { 0, {} };
+    };
 
-            parse_value(option_delta);
-            parse_value(option_length);
+    class options_range
+    {
+    public:
+        using value_type = option_t;
+        using const_iterator = option_iterator;
+
+        option_iterator begin() const { return { _begin, _end }; }
+        option_iterator end() const { return { _end, _end }; }
+
+        size_t size() const { return _count; }
+        bool empty() const { return _count == 0; }
+
+        // Options are ordered by number, so lookups stop early
+        option_iterator lower_bound(option_number_t number) const
+        {
+            auto it = begin();
+            while (it != end() && it->first < number)
+                ++it;
+            return it;
+        }
 
-            it++;
-            auto option_end = it + option_length;
-            if (option_end > bytes.end())
-                throw invalid_pdu();
+        std::pair<option_iterator, option_iterator> equal_range(option_number_t number) const
+        {
+            auto first = lower_bound(number);
+            auto last = first;
+            while (last != end() && last->first == number)
+                ++last;
+            return { first, last };
+        }
 
-            option_number += option_delta;
-            result._options.emplace(std::make_pair(
-                option_number,
-                option_value_t { it, option_end }
-            ));
+        option_iterator find(option_number_t number) const
+        {
+            auto it = lower_bound(number);
+            return it != end() && it->first == number ? it : end();
+        }
 
-            it = option_end;
+        size_t count(option_number_t number) const
+        {
+            auto [first, last] = equal_range(number);
+            return std::distance(first, last);
         }
 
-        if (it >= bytes.end())
-            return result; // No payload
+    private:
+        friend class pdu_view;
+
+        const byte_t* _begin { nullptr };
+        const byte_t* _end { nullptr };
+        size_t _count { 0 };
+    };
 
-        // Skip the payload separator
-        it++;
+    pdu_view() = default;
 
-        // Rest of the PDU is payload
-        result._payload = { it, bytes.end() };
+    static pdu_view from(const byte_t* data, size_t size,
+                         parse_flags flags = parse_flags::none)
+    {
+        pdu_view result;
+        if (auto error = parse(data, size, result, flags); error != parse_error::none)
+            throw invalid_pdu(error);
 
         return result;
     }
 
-    bytes_t to_bytes() const
+    static pdu_view from(const bytes_t& bytes, parse_flags flags = parse_flags::none)
+    {
+        return from(bytes.data(), bytes.size(), flags);
+    }
+
+    // Parses without throwing, for untrusted input on hot paths
+    static parse_result<pdu_view> try_from(const byte_t* data, size_t size,
+                                           parse_flags flags = parse_flags::none) noexcept
     {
-        auto required_size = 4; // header length
-        required_size += _token.size();
+        pdu_view result;
+        if (auto error = parse(data, size, result, flags); error != parse_error::none)
+            return error;
 
-        if (auto pl_size = _payload.size())
-            required_size += 1 /* separator */ + pl_size;
-
-        // Encode Options
-        bytes_t options_buf;
-        if (_options.size()) {
-            // Try to minimize allocations, options will typically fit in 1024 bytes
-            // (does not increase vector size)
-            options_buf.reserve(1024);
-
-            auto prev_delta = 0;
-            for (const auto& [number, value]: _options) {
-                auto option_delta = number - prev_delta;
-                prev_delta = number;
-
-                auto get_nibble = [&] (const uint32_t& val) -> uint8_t {
-                    if (val < 13)
-                        return val;
-                    if (val < 269)
-                        return 13;
-                    return 14;
-                };
-
-                byte_t delta_nibble = get_nibble(option_delta);
-                byte_t length_nibble = get_nibble(value.size());
-                options_buf.push_back((delta_nibble << 4) | length_nibble);
-
-                auto encode_val = [&] (const byte_t nibble, const uint32_t& val) {
-                    if (nibble < 13)
-                        return; // already encoded in nibble
-
-                    if (nibble == 13) {
-                        options_buf.push_back(val - 13);
-                    } else if (nibble == 14) {
-                        auto encoded_val = val - 269;
-                        assert(encoded_val <= std::numeric_limits<uint16_t>::max());
-                        options_buf.push_back(encoded_val >> 8);
-                        options_buf.push_back(encoded_val);
-                    }
-                };
-                encode_val(delta_nibble, option_delta);
-                encode_val(length_nibble, value.size());
-
-                std::copy(value.begin(), value.end(),
-                          std::back_inserter(options_buf));
-            }
+        return result;
+    }
 
-            required_size += options_buf.size();
-        }
+    static parse_result<pdu_view> try_from(const bytes_t& bytes,
+                                           parse_flags flags = parse_flags::none) noexcept
+    {
+        return try_from(bytes.data(), bytes.size(), flags);
+    }
 
-        bytes_t bytes(required_size);
+    static parse_result<pdu_view> try_from(bytes_t&& bytes,
+                                           parse_flags flags = parse_flags::none) = delete;
 
-        // Header
-        bytes[0] = (_version << 6) | (_type << 4) | _token.size();
-        bytes[1] = _code;
-        bytes[2] = _message_id >> 8;
-        bytes[3] = _message_id;
+    // Parses `data` into `result`, which is left untouched on failure
+    static parse_error parse(const byte_t* data, size_t size, pdu_view& result,
+                             parse_flags flags = parse_flags::none) noexcept
+    {
+        auto error = validate(data, size, result, flags);
+        if (error == parse_error::none)
+            detail::count_parsed(size, result._options._count);
+        else
+            detail::count_parse_failure(error);
+        return error;
+    }
 
-        // Token
-        auto it = bytes.begin() + 4;
-        std::copy(_token.begin(), _token.end(), it);
-        it += _token.size();
+    // The view would outlive the buffer
+    static pdu_view from(bytes_t&& bytes, parse_flags flags = parse_flags::none) = delete;
 
-        // Options
-        if (auto s = options_buf.size()) {
-            std::move(options_buf.begin(), options_buf.end(), it);
-            it += s;
-        }
+    uint8_t version() const
+    {
+        return _data[0] >> 6;
+    }
 
-        // Payload
-        if (_payload.size()) {
-            *it = 0xff;
-            std::copy(_payload.begin(), _payload.end(), ++it);
+    Type type() const
+    {
+        return static_cast<Type>((_data[0] & 0b00110000) >> 4);
+    }
+
+    Code code() const
+    {
+        return static_cast<Code>(_data[1]);
+    }
+
+    uint16_t message_id() const
+    {
+        return (_data[2] << 8) | (_data[3]);
+    }
+
+    bytes_view token() const
+    {
+        return { _data + 4, static_cast<size_t>(_data[0] & 0b00001111) };
+    }
+
+    const options_range& options() const
+    {
+        return _options;
+    }
+
+    std::string_view payload() const
+    {
+        return {
+            reinterpret_cast<const char*>(_payload),
+            static_cast<size_t>(_data + _size - _payload)
+        };
+    }
+
+    // Precomputed when parsed with parse_flags::hash_uri_path
+    uint64_t uri_path_hash() const
+    {
+        if (_flags & parse_flags::hash_uri_path)
+            return _uri_path_hash;
+        return option_accessors::uri_path_hash();
+    }
+
+    // Precomputed when parsed with parse_flags::hash_uri_query
+    uint64_t uri_query_hash() const
+    {
+        if (_flags & parse_flags::hash_uri_query)
+            return _uri_query_hash;
+        return option_accessors::uri_query_hash();
+    }
+
+    // The complete encoded PDU
+    bytes_view bytes() const
+    {
+        return { _data, _size };
+    }
+
+    // Copies the contents of the view into an owning PDU. `args` are passed
+    // to its constructor, e.g. a memory resource for coapp::pmr::pdu.
+    template <typename Pdu = pdu, typename... Args>
+    Pdu to_pdu(Args&&... args) const;
+
+private:
+    static parse_error validate(const byte_t* data, size_t size, pdu_view& result,
+                                parse_flags flags) noexcept
+    {
+        pdu_layout layout;
+        detail::uri_hasher<'/'> path_hasher;
+        detail::uri_hasher<'&'> query_hasher;
+
+        auto error = detail::scan_pdu(data, size, layout, [&] (uint32_t number, const byte_t* value, uint32_t length) {
+            if (number == Option::UriPath && (flags & parse_flags::hash_uri_path))
+                path_hasher.add(value, length);
+            else if (number == Option::UriQuery && (flags & parse_flags::hash_uri_query))
+                query_hasher.add(value, length);
+        });
+        if (error != parse_error::none)
+            return error;
+
+        result._data = data;
+        result._size = size;
+        result._options._begin = layout.options_begin;
+        result._options._end = layout.options_end;
+        result._options._count = layout.options;
+        result._payload = layout.payload;
+
+        result._flags = flags;
+        result._uri_path_hash = path_hasher.value();
+        result._uri_query_hash = query_hasher.value();
+
+        return parse_error::none;
+    }
+
+    const byte_t* _data { nullptr };
+    size_t _size { 0 };
+
+    options_range _options;
+
+    const byte_t* _payload { nullptr };
+
+    parse_flags _flags { parse_flags::none };
+    uint64_t _uri_path_hash { 0 };
+    uint64_t _uri_query_hash { 0 };
+};
+
+namespace detail {
+
+inline void prefetch(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void) address;
+#endif
+}
+
+}
+
+// Parses a batch of datagrams, e.g. as received by recvmmsg, in one pass.
+// `views` and `errors` must hold `count` elements; views[i] is only valid
+// when errors[i] is parse_error::none. Nothing is allocated and the header
+// of the next datagram is prefetched while the current one is parsed.
+// Returns the number of datagrams that parsed successfully.
+inline size_t decode_batch(const bytes_view* datagrams, size_t count,
+                           pdu_view* views, parse_error* errors,
+                           parse_flags flags = parse_flags::none) noexcept
+{
+    size_t valid = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i + 1 < count)
+            detail::prefetch(datagrams[i + 1].data());
+
+        errors[i] = pdu_view::parse(datagrams[i].data(), datagrams[i].size(), views[i], flags);
+        valid += errors[i] == parse_error::none;
+    }
+    return valid;
+}
+
+// Owning PDU. OptionStorage is either a std::multimap from option number to
+// value (see coapp::pdu) or a flat container such as coapp::flat_options.
+// When the storage types are allocator-aware (see coapp::pmr::pdu), the PDU
+// can be constructed with an allocator that all of them then share.
+template <typename OptionStorage, typename Payload, typename Token>
+class basic_pdu : public option_accessors<basic_pdu<OptionStorage, Payload, Token>>
+{
+public:
+    using byte_t = uint8_t;
+    using bytes_t = std::vector<byte_t>;
+
+    using token_t = Token;
+
+    using option_number_t = uint32_t;
+    using option_value_t = typename detail::option_value_type<OptionStorage>::type;
+    using options_t = OptionStorage;
+
+    using payload_t = Payload;
+
+    basic_pdu() = default;
+
+    template <typename Alloc,
+              typename = std::enable_if_t<std::uses_allocator_v<options_t, Alloc>>>
+    explicit basic_pdu(const Alloc& alloc)
+        : _token(construct_with<token_t>(alloc)),
+          _options(alloc),
+          _payload(construct_with<payload_t>(alloc))
+    {}
+
+    // Values are copied out of `bytes`, which the PDU doesn't keep
+    static basic_pdu from(const bytes_t& bytes)
+    {
+        return from(bytes.data(), bytes.size());
+    }
+
+    static basic_pdu from(const byte_t* data, size_t size)
+    {
+        static_assert(!std::is_same_v<payload_t, std::string_view>,
+                      "the payload would borrow from a destroyed buffer");
+        detail::allocation_scope scope;
+        return pdu_view::from(data, size).to_pdu<basic_pdu>();
+    }
+
+    template <typename Alloc,
+              typename = std::enable_if_t<std::uses_allocator_v<options_t, Alloc>>>
+    static basic_pdu from(const bytes_t& bytes, const Alloc& alloc)
+    {
+        detail::allocation_scope scope;
+        return pdu_view::from(bytes.data(), bytes.size()).to_pdu<basic_pdu>(alloc);
+    }
+
+    // Reports malformed input through the result instead of throwing.
+    // Only allocation failure can still throw.
+    static parse_result<basic_pdu> try_from(const bytes_t& bytes)
+    {
+        return try_from(bytes.data(), bytes.size());
+    }
+
+    static parse_result<basic_pdu> try_from(const byte_t* data, size_t size)
+    {
+        detail::allocation_scope scope;
+        auto view = pdu_view::try_from(data, size);
+        if (!view)
+            return view.error();
+
+        return view->to_pdu<basic_pdu>();
+    }
+
+    // Exact number of bytes to_bytes() and serialize_into() produce
+    size_t encoded_size() const
+    {
+        size_t size = 4; // header length
+        size += _token.size();
+
+        option_number_t prev_number = 0;
+        for (const auto& [number, value]: _options) {
+            size += detail::option_header_size(number - prev_number, value.size());
+            size += value.size();
+            prev_number = number;
         }
 
+        if (auto pl_size = _payload.size())
+            size += 1 /* separator */ + pl_size;
+
+        return size;
+    }
+
+    // Encodes the PDU into a caller-provided buffer without allocating.
+    // Returns the number of bytes written, or 0 if `capacity` is too small.
+    size_t serialize_into(byte_t* out, size_t capacity) const
+    {
+        auto size = encoded_size();
+        if (size > capacity)
+            return 0;
+
+        encode(out, nullptr, 0);
+        detail::count_encoded(size);
+        return size;
+    }
+
+    bytes_t to_bytes() const &
+    {
+        detail::allocation_scope scope;
+        bytes_t bytes(encoded_size());
+        serialize_into(bytes.data(), bytes.size());
         return bytes;
     }
 
+    // Encodes into the largest option value buffer when it can hold the
+    // whole PDU, moving that value into place instead of copying it
+    bytes_t to_bytes() &&
+    {
+        if constexpr (std::is_same_v<option_value_t, bytes_t>) {
+            auto size = encoded_size();
+
+            auto reused = _options.end();
+            size_t offset = 4 + _token.size();
+            size_t reused_offset = 0;
+            option_number_t prev_number = 0;
+            for (auto it = _options.begin(); it != _options.end(); ++it) {
+                offset += detail::option_header_size(it->first - prev_number, it->second.size());
+                if (it->second.capacity() >= size
+                    && (reused == _options.end() || it->second.capacity() > reused->second.capacity())) {
+                    reused = it;
+                    reused_offset = offset;
+                }
+                offset += it->second.size();
+                prev_number = it->first;
+            }
+
+            if (reused != _options.end()) {
+                bytes_t bytes = std::move(reused->second);
+                auto length = bytes.size();
+
+                bytes.resize(size);
+                if (length)
+                    std::memmove(bytes.data() + reused_offset, bytes.data(), length);
+
+                encode(bytes.data(), &reused->second, length);
+                detail::count_encoded(size);
+                return bytes;
+            }
+        }
+        return std::as_const(*this).to_bytes();
+    }
+
+    // Inserts an option, constructing its value from `data` in the storage
+    void emplace_option(option_number_t number, const byte_t* data, size_t size)
+    {
+        detail::emplace_option(_options, number, data, size);
+    }
+
     uint8_t version() const
     {
         return _version;
@@ -319,7 +2109,7 @@ public:
         _message_id = mid;
     }
 
-    void set_token(bytes_t token)
+    void set_token(token_t token)
     {
         if (token.size() > 8)
             throw invalid_pdu();
@@ -329,7 +2119,42 @@ public:
 
     void add_option(option_number_t number, option_value_t value)
     {
-        _options.emplace(std::make_pair(number, std::move(value)));
+        if constexpr (detail::is_mapped_option_storage<options_t>::value)
+            _options.emplace(std::make_pair(number, std::move(value)));
+        else
+            _options.emplace(number, value.data(), value.size());
+    }
+
+    // Replaces all occurrences of option O
+    template <Option O>
+    void set(typename option_traits<O>::value_type value)
+    {
+        _options.erase(O);
+        add<O>(value);
+    }
+
+    template <Option O>
+    void add(typename option_traits<O>::value_type value)
+    {
+        constexpr auto format = option_traits<O>::format;
+
+        if constexpr (format == option_format::empty) {
+            if (value)
+                detail::emplace_option(_options, O, nullptr, 0);
+        } else if constexpr (format == option_format::uint) {
+            byte_t buf[4];
+            auto end = detail::encode_uint(buf, value);
+            detail::emplace_option(_options, O, buf, end - buf);
+        } else {
+            auto bytes = detail::as_bytes_view(value);
+            detail::emplace_option(_options, O, bytes.data(), bytes.size());
+        }
+    }
+
+    template <Option O>
+    void remove()
+    {
+        _options.erase(O);
     }
 
     void set_payload(payload_t payload)
@@ -338,20 +2163,123 @@ public:
     }
 
 private:
+    friend class pdu_view;
+
+    // Writes the encoded_size() bytes of the PDU to `out`. The value of
+    // option `in_place` is already at its position and `length` long.
+    void encode(byte_t* out, const void* in_place, size_t length) const
+    {
+        // Header
+        out[0] = (_version << 6) | (_type << 4) | _token.size();
+        out[1] = _code;
+        out[2] = _message_id >> 8;
+        out[3] = _message_id;
+
+        // Token
+        auto it = std::copy(_token.begin(), _token.end(), out + 4);
+
+        // Options
+        option_number_t prev_number = 0;
+        for (const auto& [number, value]: _options) {
+            if (static_cast<const void*>(&value) == in_place) {
+                it = detail::encode_option_header(it, number - prev_number, length) + length;
+            } else {
+                it = detail::encode_option_header(it, number - prev_number, value.size());
+                it = std::copy(value.begin(), value.end(), it);
+            }
+            prev_number = number;
+        }
+
+        // Payload
+        if (_payload.size()) {
+            *it++ = 0xff;
+            std::memcpy(it, _payload.data(), _payload.size());
+        }
+    }
+
+    template <typename T, typename Alloc>
+    static T construct_with(const Alloc& alloc)
+    {
+        if constexpr (std::uses_allocator_v<T, Alloc>)
+            return T(alloc);
+        else
+            return T();
+    }
+
     uint8_t _version { 1 };
     Type _type { 0 };
 
     Code _code { 0 };
     uint16_t _message_id { 0 };
 
-    bytes_t _token;
+    token_t _token;
 
     options_t _options;
 
     payload_t _payload;
 };
 
+template <typename Pdu, typename... Args>
+Pdu pdu_view::to_pdu(Args&&... args) const
+{
+    Pdu result(std::forward<Args>(args)...);
+
+    result.set_type(type());
+    result.set_code(code());
+    result.set_message_id(message_id());
+
+    // Assigned in place, so the members keep their allocators
+    auto t = token();
+    result._token.assign(t.begin(), t.end());
+
+    for (const auto& [number, value]: _options)
+        detail::emplace_option(result._options, number, value.data(), value.size());
+
+    auto pl = payload();
+    detail::assign_payload(result._payload, pl.data(), pl.size());
+
+    return result;
+}
+
+}
+
+template <>
+struct std::hash<coapp::inline_token>
+{
+    size_t operator()(const coapp::inline_token& token) const noexcept
+    {
+        // splitmix64 finalizer over the padded token and its length
+        uint64_t x = token.word() ^ (uint64_t(token.size()) << 59);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+#ifdef MODERN_COAPP_STATS_OPERATOR_NEW
+#include <cstdlib>
+#include <new>
+
+// Counts allocations made inside coapp::detail::allocation_scope
+void* operator new(std::size_t size)
+{
+    if (coapp::stats_enabled && coapp::detail::counting_allocations())
+        coapp::thread_stats().allocations++;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
 }
 
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
 #undef RESPONSE_CODE
 #undef RESPONSE_CLASS
\ No newline at end of file
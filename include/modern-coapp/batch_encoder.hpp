@@ -0,0 +1,181 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../modern-coapp.hpp"
+
+namespace coapp {
+
+// Serializes a template PDU once and describes per-recipient copies of it as
+// scatter-gather vectors, e.g. for Observe fan-out through sendmmsg.
+//
+// The copies only differ in message ID, token and, when the template carries
+// an Observe option, the Observe value. Those bytes are written to a small
+// per-recipient patch; the remaining options and the payload are referenced
+// from the encoder and never copied. The encoder must outlive the iovecs.
+class batch_encoder
+{
+public:
+    using byte_t = uint8_t;
+    using bytes_t = std::vector<byte_t>;
+
+    static constexpr size_t max_iovecs = 4;
+
+    struct recipient
+    {
+        uint16_t message_id;
+        bytes_view token;
+        uint32_t observe; // Ignored when the template has no Observe option
+    };
+
+    // Header, token and Observe option of a single recipient
+    struct patch
+    {
+        byte_t bytes[16];
+    };
+
+    template <typename Pdu>
+    explicit batch_encoder(const Pdu& tmpl)
+        : _bytes(tmpl.to_bytes())
+    {
+        auto view = pdu_view::from(_bytes);
+        auto options = view.options();
+
+        // Locate the Observe option, later options are encoded relative to it
+        size_t options_begin = 4 + view.token().size();
+        _before = { options_begin, options_begin };
+        _after = { options_begin, _bytes.size() };
+
+        option_number_t prev_number = 0;
+        for (auto it = options.begin(); it != options.end(); prev_number = it->first, ++it) {
+            size_t value_end = it->second.end() - _bytes.data();
+            if (it->first < Option::Observe) {
+                _before.second = value_end;
+                _after.first = value_end;
+            } else if (it->first == Option::Observe) {
+                _observe = true;
+                _observe_delta = Option::Observe - prev_number;
+                _after.first = value_end;
+                break;
+            } else {
+                break;
+            }
+        }
+    }
+
+    bool has_observe() const
+    {
+        return _observe;
+    }
+
+    // Number of iovecs encode() emits for every recipient
+    size_t iovecs_per_message() const
+    {
+        size_t count = 1; // Header, token (and Observe without earlier options)
+        if (before_size())
+            count += _observe ? 2 : 1;
+        if (after_size())
+            count++;
+        return count;
+    }
+
+    // Encoded size of each copy with a token of `token_size` bytes. Like
+    // encode(), only the low 24 bits of `observe` count.
+    size_t message_size(size_t token_size, uint32_t observe) const
+    {
+        size_t size = 4 + token_size + before_size() + after_size();
+        if (_observe)
+            size += 1 + detail::uint_size(observe & 0xffffff);
+        return size;
+    }
+
+    // Fills in the patch and up to max_iovecs iovecs for one recipient.
+    // Returns the number of iovecs used.
+    size_t encode(const recipient& r, patch& p, iovec* iov) const
+    {
+        if (r.token.size() > 8)
+            throw invalid_pdu();
+
+        auto out = p.bytes;
+        *out++ = (_bytes[0] & 0b11110000) | r.token.size();
+        *out++ = _bytes[1];
+        *out++ = r.message_id >> 8;
+        *out++ = r.message_id;
+        out = std::copy(r.token.begin(), r.token.end(), out);
+        auto head_end = out;
+
+        byte_t* observe_begin = out;
+        if (_observe) {
+            // Observe values are at most 3 bytes, the header is a single byte
+            auto length = detail::uint_size(r.observe & 0xffffff);
+            *out++ = (_observe_delta << 4) | length;
+            out = detail::encode_uint(out, r.observe & 0xffffff);
+        }
+
+        size_t count = 0;
+        auto add = [&] (const byte_t* data, size_t size) {
+            iov[count].iov_base = const_cast<byte_t*>(data);
+            iov[count].iov_len = size;
+            count++;
+        };
+
+        if (before_size()) {
+            add(p.bytes, head_end - p.bytes);
+            add(_bytes.data() + _before.first, before_size());
+            if (_observe)
+                add(observe_begin, out - observe_begin);
+        } else {
+            add(p.bytes, out - p.bytes);
+        }
+
+        if (after_size())
+            add(_bytes.data() + _after.first, after_size());
+
+        return count;
+    }
+
+    // Encodes `count` recipients for sendmmsg. `patches` holds `count`
+    // elements and `iovecs` count * iovecs_per_message() elements. Only
+    // msg_iov and msg_iovlen are set, so the caller fills in msg_name.
+    template <typename MsgHdr>
+    void encode(const recipient* recipients, size_t count,
+                patch* patches, iovec* iovecs, MsgHdr* messages) const
+    {
+        const auto stride = iovecs_per_message();
+        for (size_t i = 0; i < count; i++) {
+            auto iov = iovecs + i * stride;
+            auto used = encode(recipients[i], patches[i], iov);
+
+            msghdr& hdr = header_of(messages[i]);
+            hdr.msg_iov = iov;
+            hdr.msg_iovlen = used;
+        }
+    }
+
+private:
+    using option_number_t = uint32_t;
+
+    static msghdr& header_of(msghdr& hdr) { return hdr; }
+
+    // struct mmsghdr, only declared with _GNU_SOURCE on Linux
+    template <typename MMsgHdr>
+    static auto header_of(MMsgHdr& hdr) -> decltype((hdr.msg_hdr))
+    {
+        return hdr.msg_hdr;
+    }
+
+    size_t before_size() const { return _before.second - _before.first; }
+    size_t after_size() const { return _after.second - _after.first; }
+
+    bytes_t _bytes;
+
+    // Shared byte ranges before and after the Observe option
+    std::pair<size_t, size_t> _before;
+    std::pair<size_t, size_t> _after;
+
+    bool _observe { false };
+    uint8_t _observe_delta { 0 };
+};
+
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <optional>
+
+#include "../modern-coapp.hpp"
+
+namespace coapp {
+
+// Value of a Block1 or Block2 option (RFC 7959 section 2.2): block number,
+// more flag and size exponent, blocks being 2^(SZX + 4) bytes long.
+struct block_option
+{
+    static constexpr uint8_t max_szx = 6;     // 1024 bytes, 7 is reserved
+    static constexpr uint32_t max_num = 0xfffff;
+
+    uint32_t num { 0 };
+    bool more { false };
+    uint8_t szx { max_szx };
+
+    constexpr size_t size() const
+    {
+        return size_t(1) << (szx + 4);
+    }
+
+    constexpr size_t offset() const
+    {
+        return size_t(num) * size();
+    }
+
+    constexpr uint32_t encode() const
+    {
+        return (num << 4) | (more ? 0x08 : 0) | szx;
+    }
+
+    // Fails on the reserved SZX and on values that need more than 3 bytes
+    static constexpr std::optional<block_option> decode(uint32_t value)
+    {
+        if (value > 0xffffff || (value & 0x07) == 7)
+            return std::nullopt;
+        return block_option { value >> 4, (value & 0x08) != 0, uint8_t(value & 0x07) };
+    }
+
+    // Largest SZX whose blocks fit in `size` bytes, at least 16
+    static constexpr uint8_t szx_for(size_t size)
+    {
+        uint8_t szx = 0;
+        while (szx < max_szx && (size_t(32) << szx) <= size)
+            szx++;
+        return szx;
+    }
+
+    // Same offset expressed in blocks of a smaller size
+    constexpr block_option resized(uint8_t new_szx) const
+    {
+        if (new_szx >= szx)
+            return *this;
+        return { uint32_t(offset() >> (new_szx + 4)), more, new_szx };
+    }
+};
+
+// Block option O of a PDU, if present and well formed
+template <Option O, typename Pdu>
+std::optional<block_option> get_block(const Pdu& pdu)
+{
+    static_assert(O == Option::Block1 || O == Option::Block2, "not a block option");
+
+    auto value = pdu.template get<O>();
+    if (!value)
+        return std::nullopt;
+    return block_option::decode(*value);
+}
+
+// Serves a body block by block, e.g. as Block2 responses to a GET or as
+// Block1 requests of an upload.
+//
+// The body is either a memory region, typically a mapped file, whose blocks
+// are referenced in place, or a file descriptor whose blocks are read with
+// pread into a caller buffer. Only a single block is ever copied.
+class block_sender
+{
+public:
+    using byte_t = uint8_t;
+
+    explicit block_sender(bytes_view body, uint8_t szx = block_option::max_szx)
+        : _body(body),
+          _size(body.size()),
+          _szx(std::min(szx, block_option::max_szx))
+    {}
+
+    // `fd` must stay open while the sender is in use
+    block_sender(int fd, size_t size, uint8_t szx = block_option::max_szx)
+        : _fd(fd),
+          _size(size),
+          _szx(std::min(szx, block_option::max_szx))
+    {}
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    uint8_t szx() const
+    {
+        return _szx;
+    }
+
+    // Number of blocks of our preferred size, an empty body is one empty block
+    uint32_t block_count() const
+    {
+        auto block_size = size_t(1) << (_szx + 4);
+        return std::max<size_t>(1, (_size + block_size - 1) / block_size);
+    }
+
+    // Block at the offset of `requested`, in the smaller of its size and
+    // ours. Fails when the offset lies past the end of the body, which is
+    // answered with 4.02 Bad Option.
+    std::optional<block_option> block(block_option requested) const
+    {
+        auto block = requested.resized(_szx);
+        if (block.offset() > 0 && block.offset() >= _size)
+            return std::nullopt;
+        if (block.num > block_option::max_num)
+            return std::nullopt;
+
+        block.more = block.offset() + block.size() < _size;
+        return block;
+    }
+
+    std::optional<block_option> block(uint32_t num) const
+    {
+        return block(block_option { num, false, _szx });
+    }
+
+    // Payload of `block`. Memory backed bodies are referenced in place, file
+    // backed ones are read into `scratch`, which must hold block.size()
+    // bytes. Returns an empty view if reading fails.
+    bytes_view payload(const block_option& block, byte_t* scratch) const
+    {
+        const auto offset = block.offset();
+        if (offset >= _size)
+            return {};
+
+        const auto length = std::min(block.size(), _size - offset);
+        if (_fd < 0)
+            return { _body.data() + offset, length };
+
+        size_t done = 0;
+        while (done < length) {
+            auto n = ::pread(_fd, scratch + done, length - done, off_t(offset + done));
+            if (n <= 0)
+                return {};
+            done += size_t(n);
+        }
+        return { scratch, length };
+    }
+
+    // Fills in Block2, Size2 and the payload of `response` for `request`,
+    // which may carry a Block2 option asking for a block and size. Returns
+    // false when the requested block does not exist.
+    template <typename Request, typename Response>
+    bool respond(const Request& request, Response& response, byte_t* scratch) const
+    {
+        auto requested = get_block<Option::Block2>(request).value_or(block_option { 0, false, _szx });
+        auto served = block(requested);
+        if (!served)
+            return false;
+
+        auto data = payload(*served, scratch);
+        if (data.size() == 0 && _size > 0)
+            return false;
+
+        response.template set<Option::Block2>(served->encode());
+        if (served->num == 0)
+            response.template set<Option::Size2>(uint32_t(_size));
+        response.set_payload(typename Response::payload_t(
+            reinterpret_cast<const char*>(data.data()), data.size()));
+        return true;
+    }
+
+private:
+    bytes_view _body;
+    int _fd { -1 };
+    size_t _size;
+    uint8_t _szx;
+};
+
+// Reassembles a block-wise body by handing each block to a sink as it
+// arrives, without buffering it. The sink is called as sink(offset, data)
+// and returns false to abort the transfer, data is only valid for the call.
+//
+// Blocks must arrive in order. Retransmitted blocks are recognized and not
+// delivered twice, gaps are reported so that the request can be answered
+// with 4.08 Request Entity Incomplete.
+template <typename Sink>
+class block_receiver
+{
+public:
+    enum class status {
+        next,         // Block delivered, more to come
+        complete,     // Last block delivered
+        duplicate,    // Already delivered, acknowledge again
+        incomplete,   // Gap before this block, 4.08
+        too_large,    // Exceeds max_size, 4.13
+        invalid,      // Malformed block or aborted by the sink, 4.00
+    };
+
+    explicit block_receiver(Sink sink,
+                            uint8_t szx = block_option::max_szx,
+                            size_t max_size = std::numeric_limits<size_t>::max())
+        : _sink(std::move(sink)),
+          _szx(std::min(szx, block_option::max_szx)),
+          _max_size(max_size)
+    {}
+
+    size_t received() const
+    {
+        return _received;
+    }
+
+    bool complete() const
+    {
+        return _complete;
+    }
+
+    // Announced total size from Size1/Size2, checked before any block
+    bool expect(size_t size)
+    {
+        if (size > _max_size)
+            return false;
+        _expected = size;
+        return true;
+    }
+
+    template <typename Payload>
+    status receive(const block_option& block, const Payload& payload)
+    {
+        const auto data = reinterpret_cast<const uint8_t*>(payload.data());
+        const auto length = payload.size();
+
+        if (block.szx > block_option::max_szx)
+            return status::invalid;
+        if (_complete)
+            return block.offset() <= _last.offset() ? status::duplicate : status::invalid;
+
+        // Every block but the last has exactly its nominal size
+        if (block.more ? length != block.size() : length > block.size())
+            return status::invalid;
+
+        const auto offset = block.offset();
+        if (offset < _received)
+            return status::duplicate;
+        if (offset != _received)
+            return status::incomplete;
+        if (offset + length > _max_size || offset + length > _expected)
+            return status::too_large;
+
+        if (length > 0 && !_sink(offset, bytes_view(data, length)))
+            return status::invalid;
+
+        _received += length;
+        _last = block;
+        _complete = !block.more;
+        return _complete ? status::complete : status::next;
+    }
+
+    template <typename Pdu>
+    status receive(const Pdu& request)
+    {
+        if (auto size = request.template get<Option::Size1>(); size && _received == 0 && !expect(*size))
+            return status::too_large;
+
+        auto block = get_block<Option::Block1>(request);
+        if (block)
+            return receive(*block, request.payload());
+
+        // Without Block1 the payload is the whole body, of any size
+        const auto payload = request.payload();
+        const auto data = reinterpret_cast<const uint8_t*>(payload.data());
+        if (_complete)
+            return status::duplicate;
+        if (_received > 0)
+            return status::invalid;
+        if (payload.size() > _max_size || payload.size() > _expected)
+            return status::too_large;
+        if (payload.size() > 0 && !_sink(0, bytes_view(data, payload.size())))
+            return status::invalid;
+
+        _received = payload.size();
+        _complete = true;
+        return status::complete;
+    }
+
+    // Block1 option acknowledging the last block in a 2.31 Continue or
+    // final response, asking for our preferred size if it is smaller
+    block_option acknowledgement() const
+    {
+        return _last.more ? _last.resized(_szx) : _last;
+    }
+
+private:
+    Sink _sink;
+    uint8_t _szx;
+    size_t _max_size;
+    size_t _expected { std::numeric_limits<size_t>::max() };
+
+    size_t _received { 0 };
+    block_option _last {};
+    bool _complete { false };
+};
+
+}
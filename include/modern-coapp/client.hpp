@@ -0,0 +1,585 @@
+#pragma once
+
+#if !defined(__cpp_impl_coroutine) || __cpp_impl_coroutine < 201902L
+#error "modern-coapp/client.hpp needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "endpoint.hpp"
+#include "exchange_table.hpp"
+#include "lazy_pdu.hpp"
+#include "pdu_template.hpp"
+#include "retransmission.hpp"
+
+namespace coapp {
+
+// Free lists of coroutine frames, one per 64-byte size class up to 1 KB.
+// Frames are cut from slabs that are kept until the pool is destroyed, so
+// once warmed up, starting a coroutine pops a list instead of calling
+// malloc. Frames must be freed on the thread that allocated them.
+class frame_pool
+{
+public:
+    static constexpr size_t granularity = 64;
+    static constexpr size_t size_classes = 16;
+    static constexpr size_t slab_frames = 256;
+
+    frame_pool() = default;
+
+    frame_pool(const frame_pool&) = delete;
+    frame_pool& operator=(const frame_pool&) = delete;
+
+    // Pool of the calling thread, used for every task
+    static frame_pool& this_thread()
+    {
+        thread_local frame_pool pool;
+        return pool;
+    }
+
+    void* allocate(size_t size)
+    {
+        auto c = size_class(size);
+        if (c >= size_classes)
+            return ::operator new(size);
+
+        if (!_free[c])
+            refill(c);
+
+        auto frame = _free[c];
+        _free[c] = frame->next;
+        _in_use++;
+        return frame;
+    }
+
+    void deallocate(void* p, size_t size) noexcept
+    {
+        auto c = size_class(size);
+        if (c >= size_classes)
+            return ::operator delete(p);
+
+        auto frame = static_cast<free_frame*>(p);
+        frame->next = _free[c];
+        _free[c] = frame;
+        _in_use--;
+    }
+
+    // Pooled frames currently allocated
+    size_t in_use() const { return _in_use; }
+
+    // Bytes held in slabs, allocated or not
+    size_t reserved() const { return _reserved; }
+
+private:
+    struct free_frame
+    {
+        free_frame* next;
+    };
+
+    static size_t size_class(size_t size)
+    {
+        return size ? (size - 1) / granularity : 0;
+    }
+
+    void refill(size_t c)
+    {
+        const auto size = (c + 1) * granularity;
+        _slabs.emplace_back(new std::byte[size * slab_frames]);
+        _reserved += size * slab_frames;
+
+        auto slab = _slabs.back().get();
+        for (size_t i = slab_frames; i-- > 0;) {
+            auto frame = reinterpret_cast<free_frame*>(slab + i * size);
+            frame->next = _free[c];
+            _free[c] = frame;
+        }
+    }
+
+    free_frame* _free[size_classes] {};
+    std::vector<std::unique_ptr<std::byte[]>> _slabs;
+    size_t _in_use { 0 };
+    size_t _reserved { 0 };
+};
+
+namespace detail {
+
+// Coroutine frames of promises deriving from this come from frame_pool
+struct pooled_promise
+{
+    static void* operator new(size_t size)
+    {
+        return frame_pool::this_thread().allocate(size);
+    }
+
+    static void operator delete(void* p, size_t size) noexcept
+    {
+        frame_pool::this_thread().deallocate(p, size);
+    }
+};
+
+template <typename T>
+struct task_result
+{
+    std::optional<T> value;
+
+    template <typename U>
+    void return_value(U&& v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T take()
+    {
+        return std::move(*value);
+    }
+};
+
+template <>
+struct task_result<void>
+{
+    void return_void() {}
+    void take() {}
+};
+
+}
+
+// Lazily started coroutine returning T. Awaiting it starts it and resumes
+// the awaiting coroutine when it finishes, without growing the stack.
+template <typename T = void>
+class task
+{
+public:
+    struct promise_type : detail::pooled_promise, detail::task_result<T>
+    {
+        std::coroutine_handle<> continuation { std::noop_coroutine() };
+        std::exception_ptr exception;
+
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                {
+                    return h.promise().continuation;
+                }
+
+                void await_resume() noexcept {}
+            };
+            return awaiter {};
+        }
+
+        void unhandled_exception()
+        {
+            exception = std::current_exception();
+        }
+    };
+
+    task(task&& other) noexcept
+        : _handle(std::exchange(other._handle, {}))
+    {}
+
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other) {
+            if (_handle)
+                _handle.destroy();
+            _handle = std::exchange(other._handle, {});
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        if (_handle)
+            _handle.destroy();
+    }
+
+    bool await_ready() const noexcept
+    {
+        return !_handle || _handle.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        _handle.promise().continuation = awaiting;
+        return _handle;
+    }
+
+    T await_resume()
+    {
+        auto& promise = _handle.promise();
+        if (promise.exception)
+            std::rethrow_exception(promise.exception);
+        return promise.take();
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle)
+        : _handle(handle)
+    {}
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+namespace detail {
+
+struct detached_task
+{
+    struct promise_type : pooled_promise
+    {
+        detached_task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+inline detached_task run_detached(task<void> t)
+{
+    co_await std::move(t);
+}
+
+}
+
+// Runs `t` until its first suspension and lets it finish on its own, its
+// frame is freed when it does. Exceptions escaping `t` terminate.
+inline void spawn(task<void> t)
+{
+    detail::run_detached(std::move(t));
+}
+
+enum class response_status: uint8_t {
+    ok,
+    timeout,    // No response before the client timeout or after the last retransmission
+    reset,      // The server rejected the request with a RST
+    overloaded  // Too many outstanding requests, or the request didn't fit a datagram
+};
+
+struct response
+{
+    response_status status { response_status::timeout };
+    lazy_pdu pdu; // Only with status ok
+
+    explicit operator bool() const
+    {
+        return status == response_status::ok;
+    }
+};
+
+struct client_options
+{
+    std::chrono::steady_clock::duration timeout { transmission::max_transmit_wait };
+    size_t capacity { 1024 };     // Outstanding requests
+    size_t token_length { 8 };
+    bool confirmable { true };    // CONs are retransmitted until acknowledged
+    retransmission_parameters retransmission {};
+};
+
+// Client whose requests are awaited from coroutines:
+//
+//     coapp::task<> read(coapp::client& client)
+//     {
+//         auto response = co_await client.get("/sensors/temp");
+//         if (response)
+//             use(response.pdu.payload());
+//     }
+//
+//     coapp::spawn(read(client));
+//     client.run();
+//
+// The awaiting coroutine is suspended until the response matching its
+// token arrives, the request times out or is reset, all from poll(). The
+// request state lives in the coroutine frame and exchanges in a table
+// allocated up front, so the cost of a request is its encoded bytes and a
+// pooled frame. Message IDs are 16 bits, so a client shouldn't have more
+// than 65536 CONs outstanding to one server.
+//
+// Not thread safe, the client must outlive the requests it made.
+class client
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using bytes_t = std::vector<uint8_t>;
+    using options = client_options;
+
+    class request_awaiter
+    {
+    public:
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            _handle = handle;
+            return _client->start(*this);
+        }
+
+        response await_resume()
+        {
+            return std::move(_result);
+        }
+
+    private:
+        friend class client;
+
+        request_awaiter(client& c, const peer& to, bytes_t bytes, uint16_t message_id, const inline_token& token)
+            : _client(&c), _to(to), _bytes(std::move(bytes)), _message_id(message_id), _token(token)
+        {}
+
+        client* _client;
+        peer _to;
+        bytes_t _bytes;
+        uint16_t _message_id;
+        inline_token _token;
+
+        response _result;
+        std::coroutine_handle<> _handle;
+    };
+
+    client(udp_endpoint& endpoint, const peer& server, options opts = {})
+        : _endpoint(endpoint),
+          _server(server),
+          _options(opts),
+          _exchanges(opts.capacity, std::chrono::milliseconds(10)),
+          _retransmissions(opts.capacity, opts.retransmission),
+          _message_id(std::random_device{}())
+    {
+        _ready.reserve(opts.capacity);
+        _resuming.reserve(opts.capacity);
+    }
+
+    client(const client&) = delete;
+    client& operator=(const client&) = delete;
+
+    // `uri` is a path with an optional query, e.g. "/sensors/temp?unit=C"
+    request_awaiter get(std::string_view uri)
+    {
+        return request(Code::REQUEST_GET, uri);
+    }
+
+    request_awaiter post(std::string_view uri, std::string_view payload)
+    {
+        return request(Code::REQUEST_POST, uri, payload);
+    }
+
+    request_awaiter put(std::string_view uri, std::string_view payload)
+    {
+        return request(Code::REQUEST_PUT, uri, payload);
+    }
+
+    request_awaiter request(Code method, std::string_view uri, std::string_view payload = {})
+    {
+        flat_pdu pdu;
+        pdu.set_code(method);
+        set_uri(pdu, uri);
+        pdu.set_payload(std::string(payload));
+        return request(_server, pdu);
+    }
+
+    // Sends `pdu` to `to` when awaited, with its own type, message ID and
+    // token. Its code, options and payload are kept.
+    template <typename Pdu>
+    request_awaiter request(const peer& to, Pdu pdu)
+    {
+        auto message_id = _message_id++;
+        auto token = token_generator::this_thread().next(_options.token_length);
+
+        pdu.set_type(_options.confirmable ? Type::Confirmable : Type::NonConfirmable);
+        pdu.set_message_id(message_id);
+        pdu.set_token(token);
+        return { *this, to, std::move(pdu).to_bytes(), message_id, token };
+    }
+
+    size_t outstanding() const
+    {
+        return _exchanges.size();
+    }
+
+    // Waits up to `timeout_ms` for responses, retransmits due CONs and
+    // expires requests, then resumes the coroutines whose requests
+    // finished. Returns how many were resumed.
+    size_t poll(int timeout_ms)
+    {
+        _endpoint.flush();
+        _endpoint.poll(timeout_ms, [this] (const peer& from, const pdu_view& message) {
+            receive(from, message);
+        });
+
+        auto now = clock::now();
+        _retransmissions.poll(now,
+            [this] (endpoint_id endpoint, bytes_view bytes) {
+                if (auto a = _exchanges.find(endpoint, token_of(bytes)))
+                    _endpoint.send((*a)->_to, bytes);
+            },
+            [this] (endpoint_id endpoint, uint16_t, bytes_t&& bytes) {
+                complete(endpoint, token_of(bytes), response_status::timeout, nullptr);
+            });
+
+        _exchanges.expire(now, [this] (endpoint_id endpoint, const inline_token&, request_awaiter*& a) {
+            if (_options.confirmable)
+                _retransmissions.acknowledge(endpoint, a->_message_id);
+            a->_result.status = response_status::timeout;
+            _ready.push_back(a->_handle);
+        });
+        _endpoint.flush();
+
+        // Resumed coroutines may make requests and finish others
+        _resuming.swap(_ready);
+        for (auto handle : _resuming)
+            handle.resume();
+        auto resumed = _resuming.size();
+        _resuming.clear();
+        return resumed;
+    }
+
+    // Polls until no request is outstanding
+    void run(int poll_timeout_ms = 10)
+    {
+        while (outstanding() || !_ready.empty())
+            poll(poll_timeout_ms);
+        _endpoint.flush();
+    }
+
+private:
+    template <typename Pdu>
+    static void set_uri(Pdu& pdu, std::string_view uri)
+    {
+        auto query = uri.find('?');
+        auto path = uri.substr(0, query);
+        if (!path.empty() && path.front() == '/')
+            path.remove_prefix(1);
+
+        // Every separator starts a segment, so "/a/" ends with an empty
+        // Uri-Path (RFC 7252 6.4). Only "/" and "" have none.
+        auto add_all = [&] (std::string_view s, char separator, auto add) {
+            if (s.empty())
+                return;
+            for (;;) {
+                auto end = s.find(separator);
+                add(s.substr(0, end));
+                if (end == s.npos)
+                    break;
+                s = s.substr(end + 1);
+            }
+        };
+        add_all(path, '/', [&] (std::string_view segment) { pdu.template add<Option::UriPath>(segment); });
+        if (query != uri.npos)
+            add_all(uri.substr(query + 1), '&', [&] (std::string_view q) { pdu.template add<Option::UriQuery>(q); });
+    }
+
+    static inline_token token_of(bytes_view bytes)
+    {
+        return { bytes.data() + 4, static_cast<size_t>(bytes[0] & 0x0f) };
+    }
+
+    bool start(request_awaiter& a)
+    {
+        a._result.status = response_status::overloaded;
+        if (_options.confirmable && _retransmissions.size() == _retransmissions.capacity())
+            return false;
+
+        auto now = clock::now();
+        if (!_exchanges.insert(a._to.id, a._token, now + _options.timeout, &a))
+            return false;
+
+        // Tracked before sending, so nothing goes out that can't be
+        // retransmitted. Moving the bytes keeps their storage, which the
+        // view still points at.
+        bytes_view bytes(a._bytes);
+        if (_options.confirmable && !_retransmissions.track(a._to.id, a._message_id, std::move(a._bytes), now)) {
+            _exchanges.erase(a._to.id, a._token);
+            return false;
+        }
+        if (!_endpoint.send(a._to, bytes)) {
+            if (_options.confirmable)
+                _retransmissions.acknowledge(a._to.id, a._message_id);
+            _exchanges.erase(a._to.id, a._token);
+            return false;
+        }
+
+        a._result.status = response_status::timeout;
+        return true;
+    }
+
+    void receive(const peer& from, const pdu_view& message)
+    {
+        static constexpr auto empty_ack = pdu_template(Type::Acknowledgement, Code::Empty);
+        static constexpr auto reset = pdu_template(Type::Reset, Code::Empty);
+        uint8_t buffer[4];
+
+        switch (message.type()) {
+        case Type::Acknowledgement:
+            _retransmissions.acknowledge(from.id, message.message_id());
+            if (message.code() == Code::Empty)
+                return; // A separate response follows
+            break;
+        case Type::Reset:
+            if (auto bytes = _retransmissions.take(from.id, message.message_id()))
+                complete(from.id, token_of(*bytes), response_status::reset, nullptr);
+            return;
+        case Type::Confirmable:
+            // Separate responses are acknowledged, even duplicates of ones
+            // already matched. The client doesn't serve requests.
+            if ((message.code() >> 5) < 2) {
+                _endpoint.send(from, { buffer, reset.stamp(buffer, sizeof(buffer), message.message_id(), {}) });
+                return;
+            }
+            _endpoint.send(from, { buffer, empty_ack.stamp(buffer, sizeof(buffer), message.message_id(), {}) });
+            break;
+        default:
+            break;
+        }
+
+        complete(from.id, message.token(), response_status::ok, &message);
+    }
+
+    void complete(endpoint_id endpoint, const inline_token& token, response_status status,
+                  const pdu_view* message)
+    {
+        auto exchange = _exchanges.take(endpoint, token);
+        if (!exchange)
+            return;
+
+        auto& a = **exchange;
+        if (_options.confirmable && status != response_status::reset)
+            _retransmissions.acknowledge(endpoint, a._message_id);
+
+        a._result.status = status;
+        if (message) {
+            auto bytes = message->bytes();
+            a._result.pdu = lazy_pdu::from(bytes_t(bytes.begin(), bytes.end()));
+        }
+        _ready.push_back(a._handle);
+    }
+
+    udp_endpoint& _endpoint;
+    peer _server;
+    options _options;
+
+    exchange_table<request_awaiter*> _exchanges;
+    retransmission_scheduler _retransmissions;
+    uint16_t _message_id;
+
+    std::vector<std::coroutine_handle<>> _ready;
+    std::vector<std::coroutine_handle<>> _resuming;
+};
+
+}
@@ -0,0 +1,463 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "../modern-coapp.hpp"
+#include "detail/slot_index.hpp"
+#include "transmission.hpp"
+
+namespace coapp {
+
+// Basic congestion control (RFC 7252 section 4.7), optionally with the
+// adaptive RTO of CoCoA (draft-ietf-core-cocoa).
+struct congestion_parameters
+{
+    unsigned nstart { transmission::nstart };             // CONs in flight per peer
+    double probing_rate { transmission::probing_rate };   // NON bytes/second per peer, 0 for no limit
+    double probing_burst { 0 };                           // NON bytes a peer may get at once
+    size_t max_queued { 64 };                             // Messages waiting per peer, at most 65535
+    bool adaptive_rto { false };
+    std::chrono::steady_clock::duration ack_timeout { transmission::ack_timeout };
+};
+
+// Per-peer congestion state, beside the retransmission scheduler. Outbound
+// messages are queued per destination and released by poll() in order:
+// CONs while fewer than NSTART are in flight to their peer, NONs as the
+// peer's PROBING_RATE allows, ACKs and RSTs right away. With adaptive_rto,
+// the ACK_TIMEOUT and back-off handed out with each CON follow the round
+// trips reported to complete().
+//
+// Peer state lives in a table of fixed capacity, about 100 bytes per peer
+// including the index. When it is full, the peer that has been idle the
+// longest, with nothing queued or in flight, is forgotten. Queued messages
+// share a pool of fixed capacity. Nothing is allocated after construction
+// besides the bytes of the messages themselves.
+//
+//     congestion.submit(peer.id, std::move(bytes));
+//     congestion.poll(now, [&] (coapp::endpoint_id id, bytes_t&& bytes, const auto& timing) {
+//         endpoint.send(peers[id], bytes_view(bytes));
+//         if (is_confirmable(bytes))
+//             retransmissions.track(id, mid_of(bytes), std::move(bytes), now,
+//                                   timing.ack_timeout, timing.backoff);
+//     });
+class congestion_controller
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using bytes_t = std::vector<uint8_t>;
+    using parameters = congestion_parameters;
+
+    // Retransmission timing for a CON, see retransmission_scheduler::track()
+    struct timing
+    {
+        clock::duration ack_timeout;
+        double backoff;
+    };
+
+    congestion_controller(size_t peer_capacity, size_t queue_capacity, parameters params = {})
+        : _params(params),
+          _peer_capacity(peer_capacity),
+          _peers(new peer_state[peer_capacity]),
+          _index(peer_capacity),
+          _queue_capacity(queue_capacity),
+          _messages(new message[queue_capacity])
+    {
+        for (size_t i = 0; i < peer_capacity; i++)
+            _peers[i].next = i + 1 < peer_capacity ? i + 1 : npos;
+        for (size_t i = 0; i < queue_capacity; i++)
+            _messages[i].next = i + 1 < queue_capacity ? i + 1 : npos;
+        _free_message = queue_capacity ? 0 : npos;
+        _free_peer = peer_capacity ? 0 : npos;
+
+        // Per-peer counts are 16 bits
+        _params.nstart = std::min<unsigned>(_params.nstart, max_count);
+        _params.max_queued = std::min<size_t>(_params.max_queued, max_count);
+    }
+
+    // Queues an encoded message for `endpoint`. Fails when the queues are
+    // full, or the peer table is and no peer in it is idle.
+    bool submit(endpoint_id endpoint, bytes_t bytes)
+    {
+        if (bytes.size() < 4 || _free_message == npos)
+            return false;
+
+        auto index = acquire(endpoint);
+        if (index == npos)
+            return false;
+
+        auto& p = _peers[index];
+        if (p.queued >= _params.max_queued) {
+            relist(index);
+            return false;
+        }
+
+        const auto m = _free_message;
+        _free_message = _messages[m].next;
+        _messages[m].bytes = std::move(bytes);
+        _messages[m].next = npos;
+
+        if (p.queue_tail == npos)
+            p.queue_head = m;
+        else
+            _messages[p.queue_tail].next = m;
+        p.queue_tail = m;
+        p.queued++;
+        _queued++;
+
+        relist(index);
+        return true;
+    }
+
+    template <typename Pdu>
+    bool submit(endpoint_id endpoint, const Pdu& pdu)
+    {
+        return submit(endpoint, pdu.to_bytes());
+    }
+
+    // Releases every queued message whose peer may receive it by `now`,
+    // calling transmit(endpoint, bytes_t&&, const timing&) for each. Only
+    // peers with queued messages are visited. transmit may submit,
+    // complete and give up, but not poll. Returns how many were released.
+    template <typename Transmit>
+    size_t poll(clock::time_point now, Transmit&& transmit)
+    {
+        size_t released = 0;
+
+        auto index = _backlog.head;
+        while (index != npos) {
+            auto& p = _peers[index];
+            const auto endpoint = p.endpoint;
+            const auto t = timing_of(p, now);
+
+            // Due messages are taken off the queue before calling back,
+            // which may relink the lists or even reuse this peer's state.
+            // Peers with queued messages stay on the backlog meanwhile, so
+            // the next one stays valid.
+            uint32_t due = npos;
+            uint32_t* tail = &due;
+            while (p.queue_head != npos && may_send(p, _messages[p.queue_head].bytes, now)) {
+                const auto m = p.queue_head;
+                p.queue_head = _messages[m].next;
+                p.queued--;
+                _queued--;
+                *tail = m;
+                tail = &_messages[m].next;
+            }
+            *tail = npos;
+            if (p.queue_head == npos)
+                p.queue_tail = npos;
+
+            const auto next = p.next;
+            relist(index);
+            index = next;
+
+            while (due != npos) {
+                const auto m = due;
+                due = _messages[m].next;
+
+                auto out = std::move(_messages[m].bytes);
+                _messages[m].bytes = {};
+                _messages[m].next = _free_message;
+                _free_message = m;
+
+                transmit(endpoint, std::move(out), t);
+                released++;
+            }
+        }
+
+        return released;
+    }
+
+    // A CON released to `endpoint` was answered `rtt` after its first
+    // transmission, after `retransmissions` retransmissions. Frees its
+    // NSTART slot and, with adaptive RTO, updates the estimate: RTTs of
+    // unretransmitted CONs are strong samples, those of CONs retransmitted
+    // once or twice weak ones, later ones are ambiguous and ignored.
+    void complete(endpoint_id endpoint, clock::time_point now, clock::duration rtt, unsigned retransmissions = 0)
+    {
+        auto index = find(endpoint);
+        if (index == npos)
+            return;
+
+        auto& p = _peers[index];
+        if (p.in_flight)
+            p.in_flight--;
+
+        if (_params.adaptive_rto && retransmissions <= 2) {
+            const float r = std::chrono::duration<float>(rtt).count();
+            if (retransmissions == 0)
+                p.rto = 0.5f * p.strong.update(r, 4) + 0.5f * p.rto;
+            else
+                p.rto = 0.25f * p.weak.update(r, 1) + 0.75f * p.rto;
+            p.rto_updated = now;
+        }
+
+        relist(index);
+    }
+
+    // A CON released to `endpoint` timed out after its last retransmission
+    void give_up(endpoint_id endpoint)
+    {
+        auto index = find(endpoint);
+        if (index == npos)
+            return;
+
+        auto& p = _peers[index];
+        if (p.in_flight)
+            p.in_flight--;
+        relist(index);
+    }
+
+    // Timing for the next CON to `endpoint`
+    timing timing_for(endpoint_id endpoint, clock::time_point now)
+    {
+        auto index = find(endpoint);
+        if (index == npos)
+            return { _params.ack_timeout, 2.0 };
+        return timing_of(_peers[index], now);
+    }
+
+    unsigned in_flight(endpoint_id endpoint) const
+    {
+        auto index = find(endpoint);
+        return index == npos ? 0 : _peers[index].in_flight;
+    }
+
+    size_t queued(endpoint_id endpoint) const
+    {
+        auto index = find(endpoint);
+        return index == npos ? 0 : _peers[index].queued;
+    }
+
+    bool known(endpoint_id endpoint) const
+    {
+        return find(endpoint) != npos;
+    }
+
+    size_t peers() const { return _peer_count; }
+    size_t peer_capacity() const { return _peer_capacity; }
+    size_t queued() const { return _queued; }
+    size_t queue_capacity() const { return _queue_capacity; }
+
+private:
+    static constexpr uint32_t npos = detail::slot_index::npos;
+    static constexpr uint16_t max_count = 0xffff;
+
+    // RFC 6298 estimator, times in seconds
+    struct rtt_estimator
+    {
+        float srtt { 0 };
+        float rttvar { 0 };
+
+        float update(float rtt, float k)
+        {
+            if (srtt == 0) {
+                srtt = rtt;
+                rttvar = rtt / 2;
+            } else {
+                rttvar = 0.75f * rttvar + 0.25f * std::fabs(srtt - rtt);
+                srtt = 0.875f * srtt + 0.125f * rtt;
+            }
+            return srtt + k * rttvar;
+        }
+    };
+
+    enum class list_id: uint8_t { none, idle, backlog };
+
+    struct peer_state
+    {
+        endpoint_id endpoint { 0 };
+        clock::time_point rto_updated {};
+        clock::time_point non_schedule {}; // When the next NON is due at PROBING_RATE
+
+        float rto { 0 }; // Overall RTO estimate in seconds
+        rtt_estimator strong;
+        rtt_estimator weak;
+
+        uint32_t queue_head { npos };
+        uint32_t queue_tail { npos };
+        uint16_t queued { 0 };
+        uint16_t in_flight { 0 };
+        list_id list { list_id::none };
+
+        // Idle or backlog list, free list when unused
+        uint32_t prev { npos };
+        uint32_t next { npos };
+    };
+
+    struct message
+    {
+        bytes_t bytes;
+        uint32_t next { npos };
+    };
+
+    struct list
+    {
+        uint32_t head { npos };
+        uint32_t tail { npos };
+    };
+
+    static uint64_t hash_of(endpoint_id endpoint)
+    {
+        uint64_t x = endpoint;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    auto matcher(endpoint_id endpoint) const
+    {
+        return [peers = _peers.get(), endpoint] (uint32_t index) {
+            return peers[index].endpoint == endpoint;
+        };
+    }
+
+    uint32_t find(endpoint_id endpoint) const
+    {
+        return _index.find(hash_of(endpoint), matcher(endpoint));
+    }
+
+    // Finds or creates the state of `endpoint`, forgetting the longest idle
+    // peer when the table is full
+    uint32_t acquire(endpoint_id endpoint)
+    {
+        auto index = find(endpoint);
+        if (index != npos)
+            return index;
+
+        if (_free_peer != npos) {
+            index = _free_peer;
+            _free_peer = _peers[index].next;
+            _peer_count++;
+        } else if (_idle.head != npos) {
+            index = _idle.head;
+            unlink(_idle, index);
+            _index.erase(hash_of(_peers[index].endpoint), matcher(_peers[index].endpoint));
+        } else {
+            return npos;
+        }
+
+        auto& p = _peers[index];
+        p = peer_state {};
+        p.endpoint = endpoint;
+        p.rto = std::chrono::duration<float>(_params.ack_timeout).count();
+        _index.insert(hash_of(endpoint), index, matcher(endpoint));
+        return index;
+    }
+
+    static clock::duration to_duration(double seconds)
+    {
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    bool may_send(peer_state& p, const bytes_t& bytes, clock::time_point now)
+    {
+        switch (static_cast<Type>((bytes[0] >> 4) & 0x03)) {
+        case Type::Confirmable:
+            if (p.in_flight >= _params.nstart)
+                return false;
+            p.in_flight++;
+            return true;
+        case Type::NonConfirmable: {
+            if (!(_params.probing_rate > 0))
+                return true;
+
+            // GCRA: each NON moves the peer's schedule on by its size at
+            // PROBING_RATE, and may be sent up to a burst ahead of it
+            const auto burst = to_duration(_params.probing_burst / _params.probing_rate);
+            if (now + burst < p.non_schedule)
+                return false;
+            p.non_schedule = std::max(p.non_schedule, now) + to_duration(bytes.size() / _params.probing_rate);
+            return true;
+        }
+        default:
+            return true;
+        }
+    }
+
+    // Ages stale estimates and picks the back-off factor, as CoCoA does
+    timing timing_of(peer_state& p, clock::time_point now)
+    {
+        if (!_params.adaptive_rto)
+            return { _params.ack_timeout, 2.0 };
+
+        if (p.rto_updated == clock::time_point {})
+            p.rto_updated = now;
+
+        const float stale = std::chrono::duration<float>(now - p.rto_updated).count();
+        if (p.rto < 1 && stale > 16 * p.rto) {
+            p.rto *= 2;
+            p.rto_updated = now;
+        } else if (p.rto > 3 && stale > 4 * p.rto) {
+            p.rto = 1 + 0.5f * p.rto;
+            p.rto_updated = now;
+        }
+
+        const double backoff = p.rto < 1 ? 3.0 : p.rto > 3 ? 1.5 : 2.0;
+        return { to_duration(p.rto), backoff };
+    }
+
+    // Moves a peer to the list its state belongs on. Idle peers are kept in
+    // the order they became idle, for eviction.
+    void relist(uint32_t index)
+    {
+        auto& p = _peers[index];
+        auto target = p.queued ? list_id::backlog : p.in_flight ? list_id::none : list_id::idle;
+        if (target == p.list)
+            return;
+
+        if (p.list != list_id::none)
+            unlink(p.list == list_id::idle ? _idle : _backlog, index);
+        if (target != list_id::none)
+            link_back(target == list_id::idle ? _idle : _backlog, index);
+        p.list = target;
+    }
+
+    void link_back(list& l, uint32_t index)
+    {
+        auto& p = _peers[index];
+        p.prev = l.tail;
+        p.next = npos;
+        if (l.tail == npos)
+            l.head = index;
+        else
+            _peers[l.tail].next = index;
+        l.tail = index;
+    }
+
+    void unlink(list& l, uint32_t index)
+    {
+        auto& p = _peers[index];
+        if (p.prev == npos)
+            l.head = p.next;
+        else
+            _peers[p.prev].next = p.next;
+        if (p.next == npos)
+            l.tail = p.prev;
+        else
+            _peers[p.next].prev = p.prev;
+        p.prev = p.next = npos;
+    }
+
+    parameters _params;
+
+    size_t _peer_capacity;
+    std::unique_ptr<peer_state[]> _peers;
+    detail::slot_index _index;
+    uint32_t _free_peer { 0 };
+    size_t _peer_count { 0 };
+
+    list _idle;
+    list _backlog;
+
+    size_t _queue_capacity;
+    std::unique_ptr<message[]> _messages;
+    uint32_t _free_message { 0 };
+    size_t _queued { 0 };
+};
+
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#include "../modern-coapp.hpp"
+#include "transmission.hpp"
+
+namespace coapp {
+
+// Message deduplication (RFC 7252 section 4.5) with fixed memory.
+//
+// Messages are keyed by (endpoint, message ID) in an open-addressed table
+// whose size is fixed at construction, probing a short window of slots.
+// Time is split into `buckets` ring slots spanning the lifetime; an entry
+// expires together with every other entry of its bucket, without sweeps.
+// The response sent for a message can be stored alongside it, so that
+// retransmitted CONs are answered by resending those bytes.
+class dedup_cache
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class status {
+        new_message,  // First time seen, now recorded
+        duplicate,    // Seen before, no response stored (yet)
+        duplicate_response, // Seen before, resend `response`
+    };
+
+    struct result
+    {
+        dedup_cache::status status;
+        bytes_view response; // Valid until the entry is overwritten
+    };
+
+    // `capacity` is rounded up to a power of two. Responses larger than
+    // `max_response_size`, which is at most 65534 bytes, are not cached.
+    explicit dedup_cache(size_t capacity,
+                         size_t max_response_size = 1152,
+                         clock::duration lifetime = transmission::exchange_lifetime,
+                         unsigned buckets = 16)
+        : _capacity(round_up(capacity)),
+          _max_response_size(std::min<size_t>(max_response_size, max_cached_size)),
+          _bucket_span(std::max<clock::duration::rep>(1, lifetime.count() / std::max(1u, buckets))),
+          _buckets(std::max(1u, buckets)),
+          _entries(new entry[_capacity]),
+          _responses(new uint8_t[_capacity * _max_response_size])
+    {}
+
+    // Records the message if it is new, otherwise reports it as a duplicate
+    result check(endpoint_id endpoint, uint16_t message_id, clock::time_point now)
+    {
+        const auto epoch = epoch_of(now);
+        const auto start = home(endpoint, message_id);
+
+        size_t free = npos;
+        size_t oldest = start;
+
+        for (size_t i = 0; i < max_probe; i++) {
+            const auto index = (start + i) & (_capacity - 1);
+            auto& e = _entries[index];
+
+            if (e.epoch == 0) {
+                // Never used, nothing was stored past this slot
+                if (free == npos)
+                    free = index;
+                break;
+            }
+
+            if (!valid(e, epoch)) {
+                if (free == npos)
+                    free = index;
+                continue;
+            }
+
+            if (e.endpoint == endpoint && e.message_id == message_id) {
+                if (e.response_size == no_response)
+                    return { status::duplicate, {} };
+                return { status::duplicate_response, { response_of(index), e.response_size } };
+            }
+
+            if (e.epoch < _entries[oldest].epoch)
+                oldest = index;
+        }
+
+        // Evict the oldest entry when the whole window is in use
+        auto& e = _entries[free != npos ? free : oldest];
+        e.endpoint = endpoint;
+        e.message_id = message_id;
+        e.epoch = epoch;
+        e.response_size = no_response;
+
+        return { status::new_message, {} };
+    }
+
+    // Stores the response for a recorded message. Returns false when the
+    // message is no longer recorded or the response is too large.
+    bool store_response(endpoint_id endpoint, uint16_t message_id,
+                        bytes_view response, clock::time_point now)
+    {
+        if (response.size() > _max_response_size)
+            return false;
+
+        auto index = find(endpoint, message_id, epoch_of(now));
+        if (index == npos)
+            return false;
+
+        std::copy(response.begin(), response.end(), response_of(index));
+        _entries[index].response_size = response.size();
+        return true;
+    }
+
+    bool contains(endpoint_id endpoint, uint16_t message_id, clock::time_point now) const
+    {
+        return find(endpoint, message_id, epoch_of(now)) != npos;
+    }
+
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+
+private:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+    static constexpr size_t max_probe = 8;
+    static constexpr uint16_t no_response = 0xffff;
+    static constexpr size_t max_cached_size = no_response - 1; // Sizes are 16 bits
+
+    struct entry
+    {
+        endpoint_id endpoint { 0 };
+        uint32_t epoch { 0 }; // 0 marks a slot that was never used
+        uint16_t message_id { 0 };
+        uint16_t response_size { no_response };
+    };
+
+    static size_t round_up(size_t n)
+    {
+        size_t p = max_probe;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+
+    uint32_t epoch_of(clock::time_point now) const
+    {
+        return 1 + now.time_since_epoch().count() / _bucket_span;
+    }
+
+    // Entries live for the remainder of their bucket plus `buckets` more,
+    // so at least the configured lifetime
+    bool valid(const entry& e, uint32_t epoch) const
+    {
+        return e.epoch != 0 && epoch - e.epoch <= _buckets;
+    }
+
+    size_t home(endpoint_id endpoint, uint16_t message_id) const
+    {
+        uint64_t x = endpoint ^ (uint64_t(message_id) * 0x9e3779b97f4a7c15ull);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return (x ^ (x >> 31)) & (_capacity - 1);
+    }
+
+    size_t find(endpoint_id endpoint, uint16_t message_id, uint32_t epoch) const
+    {
+        const auto start = home(endpoint, message_id);
+        for (size_t i = 0; i < max_probe; i++) {
+            const auto index = (start + i) & (_capacity - 1);
+            const auto& e = _entries[index];
+
+            if (e.epoch == 0)
+                break;
+            if (valid(e, epoch) && e.endpoint == endpoint && e.message_id == message_id)
+                return index;
+        }
+        return npos;
+    }
+
+    uint8_t* response_of(size_t index) const
+    {
+        return _responses.get() + index * _max_response_size;
+    }
+
+    size_t _capacity;
+    size_t _max_response_size;
+    clock::duration::rep _bucket_span;
+    unsigned _buckets;
+
+    std::unique_ptr<entry[]> _entries;
+    std::unique_ptr<uint8_t[]> _responses;
+};
+
+}
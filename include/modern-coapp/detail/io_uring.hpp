@@ -0,0 +1,160 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+namespace coapp::detail {
+
+// Minimal io_uring submission and completion rings on the raw system calls,
+// so the library does not depend on liburing. Only what udp_endpoint needs:
+// queueing SQEs, submitting and waiting with a timeout, reaping CQEs.
+class io_uring_ring
+{
+public:
+    io_uring_ring() = default;
+    io_uring_ring(const io_uring_ring&) = delete;
+    io_uring_ring& operator=(const io_uring_ring&) = delete;
+
+    ~io_uring_ring()
+    {
+        if (_sqes)
+            ::munmap(_sqes, _sqes_size);
+        if (_ring)
+            ::munmap(_ring, _ring_size);
+        if (_fd >= 0)
+            ::close(_fd);
+    }
+
+    // Fails on kernels without io_uring, the single mmap and the
+    // extended enter arguments (5.11), or where it is filtered by seccomp
+    bool init(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        _fd = ::syscall(__NR_io_uring_setup, entries, &params);
+        if (_fd < 0)
+            return false;
+
+        constexpr auto required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required)
+            return false;
+
+        _ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        auto ring = ::mmap(nullptr, _ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED)
+            return false;
+        _ring = static_cast<uint8_t*>(ring);
+
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        auto sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        _sqes = static_cast<io_uring_sqe*>(sqes);
+
+        _sq_head = reinterpret_cast<unsigned*>(_ring + params.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned*>(_ring + params.sq_off.tail);
+        _sq_array = reinterpret_cast<unsigned*>(_ring + params.sq_off.array);
+        _sq_mask = *reinterpret_cast<unsigned*>(_ring + params.sq_off.ring_mask);
+        _sq_entries = params.sq_entries;
+
+        _cq_head = reinterpret_cast<unsigned*>(_ring + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned*>(_ring + params.cq_off.tail);
+        _cqes = reinterpret_cast<io_uring_cqe*>(_ring + params.cq_off.cqes);
+        _cq_mask = *reinterpret_cast<unsigned*>(_ring + params.cq_off.ring_mask);
+
+        _tail = *_sq_tail;
+        return true;
+    }
+
+    // Next free SQE, cleared, or nullptr when the ring is full
+    io_uring_sqe* get_sqe()
+    {
+        auto head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        if (_tail - head >= _sq_entries)
+            return nullptr;
+
+        auto index = _tail & _sq_mask;
+        _sq_array[index] = index;
+        _tail++;
+        _queued++;
+
+        auto sqe = &_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submits queued SQEs and waits for `wait_for` completions at most
+    // `timeout_ms` milliseconds, or indefinitely when negative
+    int submit(unsigned wait_for = 0, int timeout_ms = 0)
+    {
+        __atomic_store_n(_sq_tail, _tail, __ATOMIC_RELEASE);
+
+        unsigned flags = 0;
+        timespec ts { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        io_uring_getevents_arg arg {};
+        arg.sigmask_sz = _NSIG / 8;
+
+        if (wait_for > 0) {
+            flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+            if (timeout_ms >= 0)
+                arg.ts = reinterpret_cast<uintptr_t>(&ts);
+        }
+
+        auto submitted = _queued;
+        int result = ::syscall(__NR_io_uring_enter, _fd, submitted, wait_for, flags,
+                               flags ? &arg : nullptr, flags ? sizeof(arg) : 0);
+        if (result >= 0)
+            _queued -= std::min<unsigned>(_queued, result);
+        return result;
+    }
+
+    // Calls f(const io_uring_cqe&) for every completion and returns the count
+    template <typename F>
+    unsigned reap(F&& f)
+    {
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+        unsigned count = 0;
+        for (; head != tail; head++, count++)
+            f(_cqes[head & _cq_mask]);
+
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    int _fd { -1 };
+
+    uint8_t* _ring { nullptr };
+    size_t _ring_size { 0 };
+    io_uring_sqe* _sqes { nullptr };
+    size_t _sqes_size { 0 };
+
+    unsigned* _sq_head { nullptr };
+    unsigned* _sq_tail { nullptr };
+    unsigned* _sq_array { nullptr };
+    unsigned _sq_mask { 0 };
+    unsigned _sq_entries { 0 };
+    unsigned _tail { 0 };
+    unsigned _queued { 0 };
+
+    unsigned* _cq_head { nullptr };
+    unsigned* _cq_tail { nullptr };
+    io_uring_cqe* _cqes { nullptr };
+    unsigned _cq_mask { 0 };
+};
+
+}
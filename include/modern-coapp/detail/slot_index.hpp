@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+namespace coapp::detail {
+
+// Hash index from keys to slots of a fixed-size pool owned by the caller,
+// which compares keys through the `matches(slot)` callbacks. Linear probing
+// with backward-shift deletion keeps probe sequences short without
+// tombstones. Sized at construction to twice the pool, never allocates.
+class slot_index
+{
+public:
+    static constexpr uint32_t npos = 0xffffffff;
+
+    explicit slot_index(size_t capacity)
+        : _mask(size_for(capacity) - 1),
+          _entries(new entry[_mask + 1])
+    {}
+
+    template <typename Matches>
+    uint32_t find(uint64_t hash, Matches&& matches) const
+    {
+        auto pos = position(hash, matches);
+        return pos == npos ? npos : _entries[pos].slot;
+    }
+
+    // Returns false if a matching key is already present
+    template <typename Matches>
+    bool insert(uint64_t hash, uint32_t slot, Matches&& matches)
+    {
+        auto pos = hash & _mask;
+        for (; _entries[pos].slot != npos; pos = (pos + 1) & _mask) {
+            if (_entries[pos].hash == uint32_t(hash) && matches(_entries[pos].slot))
+                return false;
+        }
+        _entries[pos] = { slot, uint32_t(hash) };
+        return true;
+    }
+
+    // Returns the slot that was removed, or npos
+    template <typename Matches>
+    uint32_t erase(uint64_t hash, Matches&& matches)
+    {
+        auto pos = position(hash, matches);
+        if (pos == npos)
+            return npos;
+
+        auto slot = _entries[pos].slot;
+
+        // Shift later entries back unless their home lies cyclically in
+        // (hole, next]
+        auto hole = pos;
+        for (auto next = (pos + 1) & _mask; _entries[next].slot != npos; next = (next + 1) & _mask) {
+            auto home = _entries[next].hash & _mask;
+            bool stays = hole <= next ? (hole < home && home <= next)
+                                      : (hole < home || home <= next);
+            if (!stays) {
+                _entries[hole] = _entries[next];
+                hole = next;
+            }
+        }
+        _entries[hole] = {};
+
+        return slot;
+    }
+
+private:
+    struct entry
+    {
+        uint32_t slot { npos };
+        uint32_t hash { 0 }; // Low bits of the key hash, also its home
+    };
+
+    static size_t size_for(size_t capacity)
+    {
+        size_t size = 16;
+        while (size < capacity * 2)
+            size <<= 1;
+        return size;
+    }
+
+    template <typename Matches>
+    size_t position(uint64_t hash, Matches& matches) const
+    {
+        for (auto pos = hash & _mask; _entries[pos].slot != npos; pos = (pos + 1) & _mask) {
+            if (_entries[pos].hash == uint32_t(hash) && matches(_entries[pos].slot))
+                return pos;
+        }
+        return npos;
+    }
+
+    size_t _mask;
+    std::unique_ptr<entry[]> _entries;
+};
+
+}
@@ -0,0 +1,509 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <memory>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "../modern-coapp.hpp"
+#include "transmission.hpp"
+
+#if !defined(MODERN_COAPP_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define MODERN_COAPP_HAS_IO_URING 1
+#include "detail/io_uring.hpp"
+#endif
+
+namespace coapp {
+
+namespace detail {
+
+// PDUs that encode into a caller buffer, rather than raw bytes
+template <typename T, typename = void>
+struct has_serialize_into : std::false_type {};
+
+template <typename T>
+struct has_serialize_into<T, std::void_t<
+    decltype(std::declval<const T&>().serialize_into(std::declval<uint8_t*>(), size_t()))>>
+    : std::true_type {};
+
+}
+
+// Stable id of a socket address: IPv4 addresses and ports are packed, IPv6
+// ones are hashed together with their scope
+inline endpoint_id endpoint_id_of(const sockaddr* address, socklen_t length)
+{
+    if (address->sa_family == AF_INET && length >= sizeof(sockaddr_in)) {
+        auto in = reinterpret_cast<const sockaddr_in*>(address);
+        return (uint64_t(1) << 48) | (uint64_t(ntohl(in->sin_addr.s_addr)) << 16) | ntohs(in->sin_port);
+    }
+
+    uint64_t hash = detail::fnv1a_basis;
+    auto bytes = reinterpret_cast<const uint8_t*>(address);
+    if (address->sa_family == AF_INET6 && length >= sizeof(sockaddr_in6)) {
+        auto in6 = reinterpret_cast<const sockaddr_in6*>(address);
+        hash = detail::fnv1a(hash, reinterpret_cast<const char*>(&in6->sin6_addr), sizeof(in6->sin6_addr));
+        hash = detail::fnv1a(hash, reinterpret_cast<const char*>(&in6->sin6_port), sizeof(in6->sin6_port));
+        hash = detail::fnv1a(hash, reinterpret_cast<const char*>(&in6->sin6_scope_id), sizeof(in6->sin6_scope_id));
+    } else {
+        hash = detail::fnv1a(hash, reinterpret_cast<const char*>(bytes), length);
+    }
+    return hash | (uint64_t(1) << 63);
+}
+
+// Remote address of a datagram
+struct peer
+{
+    sockaddr_storage address {};
+    socklen_t length { 0 };
+    endpoint_id id { 0 };
+
+    peer() = default;
+
+    peer(const sockaddr* addr, socklen_t len)
+        : length(len),
+          id(endpoint_id_of(addr, len))
+    {
+        std::memcpy(&address, addr, std::min<size_t>(len, sizeof(address)));
+    }
+
+    const sockaddr* addr() const
+    {
+        return reinterpret_cast<const sockaddr*>(&address);
+    }
+};
+
+// UDP engine that receives datagrams in batches, parses them into pdu_views
+// directly from the receive buffers and hands them to a handler, which can
+// queue replies that are sent in one batch after the handler returns.
+//
+// Uses io_uring with a fixed pool of pre-posted receive buffers where
+// available and otherwise epoll with recvmmsg/sendmmsg. All buffers are
+// allocated at construction. Not thread safe, see the sharded server for
+// multiple cores.
+class udp_endpoint
+{
+public:
+    using byte_t = uint8_t;
+
+    struct options
+    {
+        size_t batch { 32 };          // Datagrams per receive and send batch
+        size_t buffer_size { 1280 };  // Largest datagram, see RFC 7252 section 4.6
+        bool io_uring { true };       // Fall back to epoll when false or unavailable
+        bool reuse_port { false };    // SO_REUSEPORT, for one endpoint per core
+        parse_flags flags { parse_flags::none };
+    };
+
+    explicit udp_endpoint(const sockaddr* bind_address, socklen_t length)
+        : udp_endpoint(bind_address, length, options {})
+    {}
+
+    udp_endpoint(const sockaddr* bind_address, socklen_t length, options opts)
+        : _options(opts),
+          _recv_buffers(new byte_t[opts.batch * opts.buffer_size]),
+          _recv_messages(opts.batch),
+          _recv_iovecs(opts.batch),
+          _recv_peers(opts.batch),
+          _send_buffers(new byte_t[opts.batch * opts.buffer_size]),
+          _send_messages(opts.batch),
+          _send_iovecs(opts.batch),
+          _send_peers(opts.batch)
+    {
+        _fd = ::socket(bind_address->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "socket");
+
+        int enable = 1;
+        if (opts.reuse_port && ::setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+            fail("setsockopt");
+        if (::bind(_fd, bind_address, length) < 0)
+            fail("bind");
+
+        for (size_t i = 0; i < opts.batch; i++) {
+            _recv_iovecs[i] = { _recv_buffers.get() + i * opts.buffer_size, opts.buffer_size };
+            _send_iovecs[i] = { _send_buffers.get() + i * opts.buffer_size, 0 };
+
+            auto& send = _send_messages[i].msg_hdr;
+            send.msg_iov = &_send_iovecs[i];
+            send.msg_iovlen = 1;
+        }
+        reset_receive();
+
+#ifdef MODERN_COAPP_HAS_IO_URING
+        if (opts.io_uring) {
+            _ring.reset(new detail::io_uring_ring);
+            if (_ring->init(next_power_of_two(2 * opts.batch))) {
+                _ready.reserve(opts.batch);
+                _processing.reserve(opts.batch);
+                for (size_t i = 0; i < opts.batch; i++)
+                    post_receive(i);
+                _ring->submit();
+            } else {
+                _ring.reset();
+            }
+        }
+        if (!_ring)
+#endif
+        {
+            _epoll = ::epoll_create1(EPOLL_CLOEXEC);
+            if (_epoll < 0)
+                fail("epoll_create1");
+
+            epoll_event event {};
+            event.events = EPOLLIN;
+            if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &event) < 0)
+                fail("epoll_ctl");
+        }
+    }
+
+    udp_endpoint(const udp_endpoint&) = delete;
+    udp_endpoint& operator=(const udp_endpoint&) = delete;
+
+    ~udp_endpoint()
+    {
+#ifdef MODERN_COAPP_HAS_IO_URING
+        // The kernel writes into the receive buffers until posted receives
+        // are cancelled
+        if (_ring)
+            cancel_receives();
+#endif
+        close();
+    }
+
+    int fd() const
+    {
+        return _fd;
+    }
+
+    bool uses_io_uring() const
+    {
+#ifdef MODERN_COAPP_HAS_IO_URING
+        return _ring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    peer local_address() const
+    {
+        sockaddr_storage address {};
+        socklen_t length = sizeof(address);
+        ::getsockname(_fd, reinterpret_cast<sockaddr*>(&address), &length);
+        return peer(reinterpret_cast<const sockaddr*>(&address), length);
+    }
+
+    // Malformed datagrams, malformed CONs are also rejected with a RST
+    size_t dropped() const
+    {
+        return _dropped;
+    }
+
+    // Waits up to `timeout_ms` (forever when negative) for datagrams and
+    // calls handler(const peer&, const pdu_view&) for each. Views point
+    // into the receive buffers and are only valid during the call. Queued
+    // replies are sent before returning. Returns the number of messages.
+    template <typename Handler>
+    size_t poll(int timeout_ms, Handler&& handler)
+    {
+        size_t handled = 0;
+
+#ifdef MODERN_COAPP_HAS_IO_URING
+        if (_ring) {
+            if (_ready.empty()) {
+                _ring->submit(1, timeout_ms);
+                reap();
+            }
+
+            // Handlers may flush, which collects more receives into _ready
+            _processing.swap(_ready);
+            for (auto [slot, length] : _processing) {
+                handled += dispatch(slot, length, handler);
+                post_receive(slot);
+            }
+            _processing.clear();
+
+            flush();
+            return handled;
+        }
+#endif
+
+        epoll_event event;
+        if (::epoll_wait(_epoll, &event, 1, timeout_ms) <= 0)
+            return 0;
+
+        for (;;) {
+            int count = ::recvmmsg(_fd, _recv_messages.data(), _options.batch, MSG_DONTWAIT, nullptr);
+            if (count <= 0)
+                break;
+
+            for (int i = 0; i < count; i++)
+                handled += dispatch(i, _recv_messages[i].msg_len, handler);
+            reset_receive();
+            flush();
+
+            if (size_t(count) < _options.batch)
+                break;
+        }
+        return handled;
+    }
+
+    // Queues a datagram, sending the queue first when it is full. Fails
+    // when `bytes` exceed the buffer size.
+    bool send(const peer& to, bytes_view bytes)
+    {
+        if (bytes.size() > _options.buffer_size)
+            return false;
+
+        auto buffer = next_send(to);
+        std::memcpy(buffer, bytes.data(), bytes.size());
+        _send_iovecs[_send_count++].iov_len = bytes.size();
+        return true;
+    }
+
+    // Serializes straight into the send buffers
+    template <typename Pdu, typename = std::enable_if_t<detail::has_serialize_into<Pdu>::value>>
+    bool send(const peer& to, const Pdu& pdu)
+    {
+        auto buffer = next_send(to);
+        auto size = pdu.serialize_into(buffer, _options.buffer_size);
+        if (size == 0)
+            return false;
+
+        _send_iovecs[_send_count++].iov_len = size;
+        return true;
+    }
+
+    // Sends all queued datagrams, returns how many left
+    size_t flush()
+    {
+        if (_send_count == 0)
+            return 0;
+
+        size_t sent = 0;
+
+#ifdef MODERN_COAPP_HAS_IO_URING
+        if (_ring) {
+            for (size_t i = 0; i < _send_count; i++) {
+                auto sqe = next_sqe();
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = _fd;
+                sqe->addr = reinterpret_cast<uintptr_t>(&_send_messages[i].msg_hdr);
+                sqe->user_data = send_tag | i;
+            }
+
+            // Buffers are reused right away, so wait for every send
+            _sending = _send_count;
+            while (_sending > 0) {
+                if (_ring->submit(1, -1) < 0 && errno != EINTR && errno != ETIME)
+                    break;
+                sent += reap();
+            }
+            _send_count = 0;
+            return sent;
+        }
+#endif
+
+        while (sent < _send_count) {
+            int count = ::sendmmsg(_fd, _send_messages.data() + sent, _send_count - sent, 0);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                break; // Datagrams are unreliable anyway, drop the rest
+            }
+            sent += count;
+        }
+        _send_count = 0;
+        return sent;
+    }
+
+    void close()
+    {
+        if (_epoll >= 0)
+            ::close(_epoll);
+        if (_fd >= 0)
+            ::close(_fd);
+        _epoll = _fd = -1;
+    }
+
+private:
+    static constexpr uint64_t send_tag = uint64_t(1) << 32;
+    static constexpr uint64_t cancel_tag = uint64_t(1) << 33;
+
+    [[noreturn]] void fail(const char* what)
+    {
+        auto error = errno;
+        close();
+        throw std::system_error(error, std::generic_category(), what);
+    }
+
+    static unsigned next_power_of_two(size_t n)
+    {
+        unsigned size = 1;
+        while (size < n)
+            size <<= 1;
+        return size;
+    }
+
+    void reset_receive()
+    {
+        for (size_t i = 0; i < _options.batch; i++)
+            reset_receive(i);
+    }
+
+    void reset_receive(size_t i)
+    {
+        auto& hdr = _recv_messages[i].msg_hdr;
+        hdr.msg_name = &_recv_peers[i].address;
+        hdr.msg_namelen = sizeof(sockaddr_storage);
+        hdr.msg_iov = &_recv_iovecs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = nullptr;
+        hdr.msg_controllen = 0;
+        hdr.msg_flags = 0;
+    }
+
+    template <typename Handler>
+    size_t dispatch(size_t slot, size_t length, Handler& handler)
+    {
+        auto& from = _recv_peers[slot];
+        from.length = _recv_messages[slot].msg_hdr.msg_namelen;
+        from.id = endpoint_id_of(from.addr(), from.length);
+
+        const auto data = _recv_buffers.get() + slot * _options.buffer_size;
+        if (_recv_messages[slot].msg_hdr.msg_flags & MSG_TRUNC) {
+            _dropped++;
+            return 0;
+        }
+
+        pdu_view view;
+        if (pdu_view::parse(data, length, view, _options.flags) != parse_error::none) {
+            reject(from, data, length);
+            _dropped++;
+            return 0;
+        }
+
+        handler(static_cast<const peer&>(from), static_cast<const pdu_view&>(view));
+        return 1;
+    }
+
+    // RFC 7252 section 4.2, a CON that can't be processed gets a RST
+    void reject(const peer& from, const byte_t* data, size_t length)
+    {
+        if (length < 4 || (data[0] >> 6) != 1 || ((data[0] >> 4) & 0x03) != Type::Confirmable)
+            return;
+
+        const byte_t reset[4] = { byte_t(0x40 | (Type::Reset << 4)), 0, data[2], data[3] };
+        send(from, bytes_view(reset, sizeof(reset)));
+    }
+
+    byte_t* next_send(const peer& to)
+    {
+        if (_send_count == _options.batch)
+            flush();
+
+        auto& slot = _send_peers[_send_count];
+        slot = to;
+
+        auto& hdr = _send_messages[_send_count].msg_hdr;
+        hdr.msg_name = &slot.address;
+        hdr.msg_namelen = slot.length;
+        return _send_buffers.get() + _send_count * _options.buffer_size;
+    }
+
+#ifdef MODERN_COAPP_HAS_IO_URING
+    io_uring_sqe* next_sqe()
+    {
+        auto sqe = _ring->get_sqe();
+        while (!sqe) {
+            _ring->submit();
+            sqe = _ring->get_sqe();
+        }
+        return sqe;
+    }
+
+    void post_receive(size_t slot)
+    {
+        reset_receive(slot);
+
+        auto sqe = next_sqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = _fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(&_recv_messages[slot].msg_hdr);
+        sqe->user_data = slot;
+        _receiving++;
+    }
+
+    void cancel_receives()
+    {
+        _closing = true;
+        for (size_t slot = 0; slot < _options.batch; slot++) {
+            auto sqe = next_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = slot;
+            sqe->user_data = cancel_tag;
+        }
+
+        for (int attempts = 0; _receiving > 0 && attempts < 100; attempts++) {
+            _ring->submit(1, 10);
+            reap();
+        }
+        _ring.reset();
+    }
+
+    // Collects receive completions into _ready, returns completed sends
+    size_t reap()
+    {
+        size_t sent = 0;
+        _ring->reap([&] (const io_uring_cqe& cqe) {
+            if (cqe.user_data == cancel_tag)
+                return;
+            if (cqe.user_data & send_tag) {
+                _sending--;
+                sent += cqe.res >= 0;
+                return;
+            }
+
+            auto slot = uint32_t(cqe.user_data);
+            _receiving--;
+            if (cqe.res >= 0 && !_closing)
+                _ready.emplace_back(slot, size_t(cqe.res));
+            else if (!_closing)
+                post_receive(slot);
+        });
+        return sent;
+    }
+
+    std::unique_ptr<detail::io_uring_ring> _ring;
+    std::vector<std::pair<uint32_t, size_t>> _ready;
+    std::vector<std::pair<uint32_t, size_t>> _processing;
+    size_t _receiving { 0 };
+    size_t _sending { 0 };
+    bool _closing { false };
+#endif
+
+    options _options;
+    int _fd { -1 };
+    int _epoll { -1 };
+
+    std::unique_ptr<byte_t[]> _recv_buffers;
+    std::vector<mmsghdr> _recv_messages;
+    std::vector<iovec> _recv_iovecs;
+    std::vector<peer> _recv_peers;
+
+    std::unique_ptr<byte_t[]> _send_buffers;
+    std::vector<mmsghdr> _send_messages;
+    std::vector<iovec> _send_iovecs;
+    std::vector<peer> _send_peers;
+    size_t _send_count { 0 };
+
+    size_t _dropped { 0 };
+};
+
+}
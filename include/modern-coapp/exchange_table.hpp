@@ -0,0 +1,277 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <random>
+
+#include "../modern-coapp.hpp"
+#include "detail/slot_index.hpp"
+#include "transmission.hpp"
+
+namespace coapp {
+
+// Generates tokens that are unique per generator, and across generators
+// with distinct ids whatever their keys. Each token is the generator id
+// followed by a keyed bijective mix of a counter, so tokens do not repeat
+// before the counter wraps (2^(8 * length - 16) tokens, 2^48 for 8-byte
+// tokens) while the counter part still looks random on the wire.
+class token_generator
+{
+public:
+    token_generator(uint16_t generator_id, uint64_t key)
+        : _id(generator_id), _key(key)
+    {}
+
+    // Generator for the calling thread, with a process-wide unique id
+    static token_generator& this_thread()
+    {
+        static std::atomic<uint16_t> next_id { 0 };
+        thread_local token_generator generator(next_id++, std::random_device{}() | (uint64_t(std::random_device{}()) << 32));
+        return generator;
+    }
+
+    // `length` is 3 to 8, shorter tokens repeat sooner
+    inline_token next(size_t length = inline_token::max_size)
+    {
+        assert(length >= 3 && length <= inline_token::max_size);
+
+        // Generator id in the top 16 bits, unkeyed so that generators with
+        // distinct ids never collide, the permuted counter below it
+        const unsigned bits = length * 8 - 16;
+        const uint64_t mask = (uint64_t(1) << bits) - 1;
+        uint64_t x = (uint64_t(_id) << bits) | permute(_counter++ & mask, bits, mask);
+
+        uint8_t bytes[inline_token::max_size];
+        for (size_t i = 0; i < length; i++)
+            bytes[i] = x >> (8 * i);
+        return { bytes, length };
+    }
+
+private:
+    // Every step is invertible on `bits`-bit values
+    uint64_t permute(uint64_t x, unsigned bits, uint64_t mask) const
+    {
+        x = (x ^ _key) & mask;
+        x = (x * 0xbf58476d1ce4e5b9ull) & mask;
+        x ^= x >> (bits / 2);
+        x = (x * 0x94d049bb133111ebull) & mask;
+        x ^= x >> (bits / 2 - 1);
+        x = (x + (_key >> 17)) & mask;
+        return x;
+    }
+
+    uint16_t _id;
+    uint64_t _key;
+    uint64_t _counter { 0 };
+};
+
+// Outstanding client requests, matched against responses by (endpoint,
+// token). All storage is allocated at construction: insertion, lookup and
+// removal are O(1) and never allocate.
+//
+// Exchanges whose deadline passes are handed to expire(). Deadlines are
+// kept in a ring of `tick`-wide buckets; deadlines further out than the
+// ring wait in their bucket for the following laps.
+template <typename T>
+class exchange_table
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit exchange_table(size_t capacity,
+                            clock::duration tick = std::chrono::milliseconds(100),
+                            size_t ring_size = 1024)
+        : _capacity(capacity),
+          _tick(tick.count() > 0 ? tick.count() : 1),
+          _ring_size(ring_size),
+          _slots(new slot[capacity]),
+          _index(capacity),
+          _ring(new uint32_t[ring_size])
+    {
+        for (size_t i = 0; i < capacity; i++)
+            _slots[i].next = i + 1 < capacity ? i + 1 : npos;
+        std::fill(_ring.get(), _ring.get() + ring_size, npos);
+    }
+
+    // Returns the stored value, or nullptr when the table is full or the
+    // (endpoint, token) pair is already outstanding
+    T* insert(endpoint_id endpoint, const inline_token& token,
+              clock::time_point deadline, T value)
+    {
+        if (_free == npos)
+            return nullptr;
+
+        const auto index = _free;
+        if (!_index.insert(hash_of(endpoint, token), index, matcher(endpoint, token)))
+            return nullptr;
+
+        auto& s = _slots[index];
+        _free = s.next;
+
+        s.endpoint = endpoint;
+        s.token = token;
+        s.deadline = deadline;
+        s.value.emplace(std::move(value));
+
+        link(index, deadline);
+        _size++;
+
+        return &*s.value;
+    }
+
+    T* find(endpoint_id endpoint, const inline_token& token)
+    {
+        auto index = _index.find(hash_of(endpoint, token), matcher(endpoint, token));
+        return index == npos ? nullptr : &*_slots[index].value;
+    }
+
+    // Removes a matched exchange and returns its value
+    std::optional<T> take(endpoint_id endpoint, const inline_token& token)
+    {
+        auto index = _index.erase(hash_of(endpoint, token), matcher(endpoint, token));
+        if (index == npos)
+            return std::nullopt;
+
+        std::optional<T> value = std::move(_slots[index].value);
+        release(index);
+        return value;
+    }
+
+    bool erase(endpoint_id endpoint, const inline_token& token)
+    {
+        auto index = _index.erase(hash_of(endpoint, token), matcher(endpoint, token));
+        if (index == npos)
+            return false;
+
+        release(index);
+        return true;
+    }
+
+    // Removes every exchange whose deadline is at or before `now`, calling
+    // on_timeout(endpoint, token, value) for each. Returns how many expired.
+    template <typename F>
+    size_t expire(clock::time_point now, F&& on_timeout)
+    {
+        const auto now_tick = tick_of(now);
+        if (!_started) {
+            _next_tick = now_tick;
+            _started = true;
+        }
+
+        // The current bucket is only partially due, revisit it next time
+        auto last = now_tick;
+        if (last - _next_tick >= static_cast<int64_t>(_ring_size))
+            _next_tick = last - _ring_size + 1;
+
+        size_t expired = 0;
+        for (auto t = _next_tick; t <= last; t++) {
+            auto index = _ring[t % _ring_size];
+            while (index != npos) {
+                auto& s = _slots[index];
+                auto next = s.timer_next;
+                if (s.deadline <= now) {
+                    on_timeout(s.endpoint, s.token, *s.value);
+                    _index.erase(hash_of(s.endpoint, s.token), matcher(s.endpoint, s.token));
+                    release(index);
+                    expired++;
+                }
+                index = next;
+            }
+        }
+        _next_tick = now_tick;
+
+        return expired;
+    }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    bool empty() const { return _size == 0; }
+
+private:
+    static constexpr uint32_t npos = detail::slot_index::npos;
+
+    struct slot
+    {
+        endpoint_id endpoint { 0 };
+        inline_token token;
+        clock::time_point deadline {};
+        std::optional<T> value;
+
+        uint32_t next { npos }; // Free list
+        uint32_t timer_prev { npos };
+        uint32_t timer_next { npos };
+        uint32_t bucket { npos };
+    };
+
+    static uint64_t hash_of(endpoint_id endpoint, const inline_token& token)
+    {
+        return std::hash<inline_token>()(token) ^ (endpoint * 0x9e3779b97f4a7c15ull);
+    }
+
+    int64_t tick_of(clock::time_point t) const
+    {
+        return t.time_since_epoch().count() / _tick;
+    }
+
+    auto matcher(endpoint_id endpoint, const inline_token& token) const
+    {
+        return [this, endpoint, &token] (uint32_t index) {
+            return _slots[index].endpoint == endpoint && _slots[index].token == token;
+        };
+    }
+
+    void link(uint32_t index, clock::time_point deadline)
+    {
+        auto tick = tick_of(deadline);
+        if (_started && tick < _next_tick)
+            tick = _next_tick;
+
+        auto& s = _slots[index];
+        s.bucket = tick % _ring_size;
+        s.timer_prev = npos;
+        s.timer_next = _ring[s.bucket];
+        if (s.timer_next != npos)
+            _slots[s.timer_next].timer_prev = index;
+        _ring[s.bucket] = index;
+    }
+
+    void unlink(uint32_t index)
+    {
+        auto& s = _slots[index];
+        if (s.timer_prev != npos)
+            _slots[s.timer_prev].timer_next = s.timer_next;
+        else
+            _ring[s.bucket] = s.timer_next;
+        if (s.timer_next != npos)
+            _slots[s.timer_next].timer_prev = s.timer_prev;
+    }
+
+    void release(uint32_t index)
+    {
+        unlink(index);
+
+        auto& s = _slots[index];
+        s.value.reset();
+        s.next = _free;
+        _free = index;
+        _size--;
+    }
+
+    size_t _capacity;
+    clock::duration::rep _tick;
+    size_t _ring_size;
+
+    std::unique_ptr<slot[]> _slots;
+    detail::slot_index _index;
+    std::unique_ptr<uint32_t[]> _ring;
+
+    uint32_t _free { 0 };
+    size_t _size { 0 };
+
+    bool _started { false };
+    int64_t _next_tick { 0 };
+};
+
+}
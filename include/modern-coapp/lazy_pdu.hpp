@@ -0,0 +1,153 @@
+#pragma once
+
+#include <optional>
+
+#include "../modern-coapp.hpp"
+
+namespace coapp {
+
+// PDU that owns its encoded bytes and decodes only the header and token up
+// front. The options and payload are located the first time options(), a
+// typed accessor or payload() is called, so handlers that only look at the
+// code and token, e.g. for ACK/RST handling or response matching, never
+// walk the options. Nothing is copied out of the bytes.
+//
+// Malformed options are reported by the first such access rather than by
+// from(): options() and payload() throw invalid_pdu, error() tells without
+// throwing.
+class lazy_pdu : public option_accessors<lazy_pdu>
+{
+public:
+    using byte_t = uint8_t;
+    using bytes_t = std::vector<byte_t>;
+
+    // Throws invalid_pdu if the header or token is malformed
+    static lazy_pdu from(bytes_t bytes)
+    {
+        auto result = try_from(std::move(bytes));
+        if (!result)
+            throw invalid_pdu(result.error());
+
+        return std::move(*result);
+    }
+
+    static parse_result<lazy_pdu> try_from(bytes_t bytes) noexcept
+    {
+        if (auto error = detail::scan_header(bytes.data(), bytes.size()); error != parse_error::none) {
+            detail::count_parse_failure(error);
+            return error;
+        }
+
+        return lazy_pdu(std::move(bytes));
+    }
+
+    // Holds no PDU, only assignable
+    lazy_pdu() = default;
+
+    lazy_pdu(const lazy_pdu& other)
+        : _bytes(other._bytes)
+    {}
+
+    lazy_pdu& operator=(const lazy_pdu& other)
+    {
+        _bytes = other._bytes;
+        _view.reset();
+        _error = parse_error::none;
+        return *this;
+    }
+
+    // Moving the vector keeps its buffer, so the view stays valid
+    lazy_pdu(lazy_pdu&&) = default;
+    lazy_pdu& operator=(lazy_pdu&&) = default;
+
+    uint8_t version() const
+    {
+        return _bytes[0] >> 6;
+    }
+
+    Type type() const
+    {
+        return static_cast<Type>((_bytes[0] & 0b00110000) >> 4);
+    }
+
+    Code code() const
+    {
+        return static_cast<Code>(_bytes[1]);
+    }
+
+    uint16_t message_id() const
+    {
+        return (_bytes[2] << 8) | (_bytes[3]);
+    }
+
+    bytes_view token() const
+    {
+        return { _bytes.data() + 4, static_cast<size_t>(_bytes[0] & 0b00001111) };
+    }
+
+    // Whether options have been located yet
+    bool decoded() const
+    {
+        return _view.has_value();
+    }
+
+    // Locates the options and payload if they haven't been yet
+    parse_error error() const noexcept
+    {
+        if (!_view && _error == parse_error::none) {
+            pdu_view view;
+            _error = pdu_view::parse(_bytes.data(), _bytes.size(), view);
+            if (_error == parse_error::none)
+                _view = view;
+        }
+        return _error;
+    }
+
+    const pdu_view& view() const
+    {
+        if (auto error = this->error(); error != parse_error::none)
+            throw invalid_pdu(error);
+
+        return *_view;
+    }
+
+    const pdu_view::options_range& options() const
+    {
+        return view().options();
+    }
+
+    std::string_view payload() const
+    {
+        return view().payload();
+    }
+
+    template <typename Pdu = pdu>
+    Pdu to_pdu() const
+    {
+        return view().to_pdu<Pdu>();
+    }
+
+    const bytes_t& bytes() const
+    {
+        return _bytes;
+    }
+
+    // Hands the bytes back, e.g. to reuse the buffer for the next receive
+    bytes_t release() &&
+    {
+        _view.reset();
+        return std::move(_bytes);
+    }
+
+private:
+    explicit lazy_pdu(bytes_t&& bytes) noexcept
+        : _bytes(std::move(bytes))
+    {}
+
+    bytes_t _bytes;
+
+    mutable std::optional<pdu_view> _view;
+    mutable parse_error _error { parse_error::none };
+};
+
+}
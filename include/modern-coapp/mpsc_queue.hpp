@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace coapp {
+
+// Bounded lock-free queue for many producers and a single consumer.
+//
+// Each cell carries a sequence number telling producers whether it is free
+// for their position and the consumer whether it has been published, so
+// producers only contend on the tail counter and the consumer never writes
+// shared state other than the cells it releases. Capacity is rounded up to
+// a power of two.
+template <typename T>
+class mpsc_queue
+{
+public:
+    explicit mpsc_queue(size_t capacity)
+        : _mask(round_up(capacity) - 1),
+          _cells(new cell[_mask + 1])
+    {
+        for (size_t i = 0; i <= _mask; i++)
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    // Any thread. Fails when the queue is full.
+    bool push(T value)
+    {
+        auto pos = _tail.load(std::memory_order_relaxed);
+        cell* c;
+        for (;;) {
+            c = &_cells[pos & _mask];
+            auto sequence = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        c->value = std::move(value);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only
+    bool pop(T& value)
+    {
+        auto& c = _cells[_head & _mask];
+        if (c.sequence.load(std::memory_order_acquire) != _head + 1)
+            return false;
+
+        value = std::move(c.value);
+        c.value = T();
+        c.sequence.store(_head + _mask + 1, std::memory_order_release);
+        _head++;
+        return true;
+    }
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t round_up(size_t n)
+    {
+        size_t size = 2;
+        while (size < n)
+            size <<= 1;
+        return size;
+    }
+
+    const size_t _mask;
+    std::unique_ptr<cell[]> _cells;
+
+    // Producers and the consumer on separate cache lines
+    alignas(64) std::atomic<size_t> _tail { 0 };
+    alignas(64) size_t _head { 0 };
+};
+
+}
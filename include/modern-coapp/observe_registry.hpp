@@ -0,0 +1,282 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <unordered_map>
+
+#include "batch_encoder.hpp"
+#include "detail/slot_index.hpp"
+#include "transmission.hpp"
+
+namespace coapp {
+
+// Observers of resources (RFC 7641), keyed by resource and (endpoint, token).
+//
+// Subscribers of a resource are stored as structure-of-arrays, so fanning
+// out a notification walks dense arrays of endpoints, tokens and sequence
+// numbers. Notifications are encoded once through a batch_encoder and only
+// the header, token and Observe value are patched per subscriber. Resources
+// are identified by the caller, e.g. by uri_path_hash() of the request.
+class observe_registry
+{
+public:
+    using resource_id = uint64_t;
+
+    static constexpr size_t batch_size = 64;
+
+    // One batch of notifications for sendmmsg. Message i is described by
+    // iov(i) and iovcnt(i) and goes to endpoints[i].
+    struct batch
+    {
+        size_t count { 0 };
+        size_t stride { 0 };
+        endpoint_id endpoints[batch_size];
+        batch_encoder::recipient recipients[batch_size];
+        batch_encoder::patch patches[batch_size];
+        iovec iovecs[batch_size * batch_encoder::max_iovecs];
+
+        iovec* iov(size_t i) { return iovecs + i * stride; }
+        const iovec* iov(size_t i) const { return iovecs + i * stride; }
+        size_t iovcnt(size_t i) const { return _iovcnt[i]; }
+
+        // Sets msg_iov and msg_iovlen of `count` msghdr or mmsghdr
+        template <typename MsgHdr>
+        void fill(MsgHdr* messages)
+        {
+            for (size_t i = 0; i < count; i++) {
+                msghdr& hdr = header_of(messages[i]);
+                hdr.msg_iov = iov(i);
+                hdr.msg_iovlen = _iovcnt[i];
+            }
+        }
+
+    private:
+        friend class observe_registry;
+
+        static msghdr& header_of(msghdr& hdr) { return hdr; }
+
+        template <typename MMsgHdr>
+        static auto header_of(MMsgHdr& hdr) -> decltype((hdr.msg_hdr))
+        {
+            return hdr.msg_hdr;
+        }
+
+        uint8_t _iovcnt[batch_size];
+    };
+
+    explicit observe_registry(size_t capacity)
+        : _capacity(capacity),
+          _handles(new handle[capacity]),
+          _index(capacity),
+          _batch(new batch)
+    {
+        for (size_t i = 0; i < capacity; i++)
+            _handles[i].next = i + 1 < capacity ? i + 1 : npos;
+    }
+
+    // Adds an observer, or keeps the existing one on re-registration.
+    // Returns the Observe value for the registration response, or nothing
+    // when the registry is full.
+    std::optional<uint32_t> subscribe(resource_id resource, endpoint_id endpoint, const inline_token& token)
+    {
+        const auto hash = hash_of(resource, endpoint, token);
+        auto existing = _index.find(hash, matcher(resource, endpoint, token));
+        if (existing != npos) {
+            const auto& h = _handles[existing];
+            return h.subscribers->sequences[h.position];
+        }
+
+        if (_free == npos)
+            return std::nullopt;
+
+        const auto id = _free;
+        auto& subscribers = _resources[resource];
+
+        auto& h = _handles[id];
+        _free = h.next;
+        h.resource = resource;
+        h.subscribers = &subscribers;
+        h.position = subscribers.size();
+
+        subscribers.endpoints.push_back(endpoint);
+        subscribers.tokens.push_back(token.word());
+        subscribers.token_sizes.push_back(token.size());
+        subscribers.sequences.push_back(0);
+        subscribers.handles.push_back(id);
+
+        _index.insert(hash, id, matcher(resource, endpoint, token));
+        _size++;
+        return 0;
+    }
+
+    // Removes an observer, e.g. on a GET with Observe = 1 or a RST
+    bool unsubscribe(resource_id resource, endpoint_id endpoint, const inline_token& token)
+    {
+        auto id = _index.erase(hash_of(resource, endpoint, token), matcher(resource, endpoint, token));
+        if (id == npos)
+            return false;
+
+        auto& h = _handles[id];
+        auto& subscribers = *h.subscribers;
+
+        // Swap the last subscriber into the hole
+        const auto last = subscribers.size() - 1;
+        if (h.position != last) {
+            subscribers.endpoints[h.position] = subscribers.endpoints[last];
+            subscribers.tokens[h.position] = subscribers.tokens[last];
+            subscribers.token_sizes[h.position] = subscribers.token_sizes[last];
+            subscribers.sequences[h.position] = subscribers.sequences[last];
+            subscribers.handles[h.position] = subscribers.handles[last];
+            _handles[subscribers.handles[h.position]].position = h.position;
+        }
+        subscribers.pop_back();
+
+        if (subscribers.size() == 0)
+            _resources.erase(h.resource);
+
+        h.subscribers = nullptr;
+        h.next = _free;
+        _free = id;
+        _size--;
+        return true;
+    }
+
+    size_t observers(resource_id resource) const
+    {
+        auto it = _resources.find(resource);
+        return it == _resources.end() ? 0 : it->second.size();
+    }
+
+    std::optional<uint32_t> sequence(resource_id resource, endpoint_id endpoint, const inline_token& token) const
+    {
+        auto id = _index.find(hash_of(resource, endpoint, token), matcher(resource, endpoint, token));
+        if (id == npos)
+            return std::nullopt;
+        return _handles[id].subscribers->sequences[_handles[id].position];
+    }
+
+    // Sends `notification` to every observer of `resource`. Its token and
+    // message ID are replaced per observer, as is its Observe value, which
+    // is added if missing. Message IDs come from next_message_id(endpoint),
+    // which should be the counter used for everything else sent to that
+    // endpoint, so that notifications don't collide with other messages in
+    // deduplication or retransmission. Calls send(batch&) for every
+    // batch_size observers and returns the number of notifications.
+    template <typename Pdu, typename NextMessageId, typename Send>
+    size_t notify(resource_id resource, const Pdu& notification, NextMessageId&& next_message_id, Send&& send)
+    {
+        auto it = _resources.find(resource);
+        if (it == _resources.end())
+            return 0;
+
+        Pdu tmpl = notification;
+        tmpl.template set<Option::Observe>(0);
+        const batch_encoder encoder(tmpl);
+
+        auto& subscribers = it->second;
+        auto& b = *_batch;
+        b.stride = encoder.iovecs_per_message();
+
+        const auto total = subscribers.size();
+        for (size_t first = 0; first < total; first += batch_size) {
+            b.count = std::min(batch_size, total - first);
+
+            for (size_t i = 0; i < b.count; i++) {
+                const auto s = first + i;
+                auto& seq = subscribers.sequences[s];
+                seq = (seq + 1) & 0xffffff;
+
+                auto& r = b.recipients[i];
+                r.message_id = next_message_id(subscribers.endpoints[s]);
+                r.token = bytes_view(reinterpret_cast<const uint8_t*>(&subscribers.tokens[s]),
+                                     subscribers.token_sizes[s]);
+                r.observe = seq;
+
+                b.endpoints[i] = subscribers.endpoints[s];
+                b._iovcnt[i] = encoder.encode(r, b.patches[i], b.iov(i));
+            }
+
+            send(b);
+        }
+        return total;
+    }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+
+private:
+    static constexpr uint32_t npos = detail::slot_index::npos;
+
+    struct subscriber_list
+    {
+        std::vector<endpoint_id> endpoints;
+        std::vector<uint64_t> tokens; // Token bytes, see inline_token::word()
+        std::vector<uint8_t> token_sizes;
+        std::vector<uint32_t> sequences;
+        std::vector<uint32_t> handles;
+
+        size_t size() const { return endpoints.size(); }
+
+        void pop_back()
+        {
+            endpoints.pop_back();
+            tokens.pop_back();
+            token_sizes.pop_back();
+            sequences.pop_back();
+            handles.pop_back();
+        }
+    };
+
+    // Stable identity of an observer for the index
+    struct handle
+    {
+        resource_id resource { 0 };
+        subscriber_list* subscribers { nullptr };
+        size_t position { 0 };
+
+        uint32_t next { npos }; // Free list
+    };
+
+    struct key_matcher
+    {
+        const handle* handles;
+        resource_id resource;
+        endpoint_id endpoint;
+        const inline_token& token;
+
+        bool operator()(uint32_t id) const
+        {
+            const auto& h = handles[id];
+            return h.resource == resource
+                && h.subscribers->endpoints[h.position] == endpoint
+                && h.subscribers->token_sizes[h.position] == token.size()
+                && h.subscribers->tokens[h.position] == token.word();
+        }
+    };
+
+    static uint64_t hash_of(resource_id resource, endpoint_id endpoint, const inline_token& token)
+    {
+        return std::hash<inline_token>()(token)
+            ^ (endpoint * 0x9e3779b97f4a7c15ull)
+            ^ (resource * 0xc2b2ae3d27d4eb4full);
+    }
+
+    key_matcher matcher(resource_id resource, endpoint_id endpoint, const inline_token& token) const
+    {
+        return { _handles.get(), resource, endpoint, token };
+    }
+
+    size_t _capacity;
+    std::unique_ptr<handle[]> _handles;
+    detail::slot_index _index;
+
+    // Node based, so handles may point at the subscribers of a resource
+    std::unordered_map<resource_id, subscriber_list> _resources;
+
+    std::unique_ptr<batch> _batch;
+
+    uint32_t _free { 0 };
+    size_t _size { 0 };
+};
+
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <cstring>
+
+#include "../modern-coapp.hpp"
+
+namespace coapp {
+
+// Edits an encoded PDU in place, e.g. for proxies that rewrite a few
+// options and the message ID before forwarding a request.
+//
+// Every edit moves only the bytes behind the changed range, and changing an
+// option re-encodes just the header of the option after it, whose delta
+// depends on it. The buffer must stay valid while the editor is used and
+// have room for the edited PDU: edits that would not fit into `capacity`
+// fail and leave the PDU as it was.
+class pdu_editor
+{
+public:
+    using byte_t = uint8_t;
+    using bytes_t = std::vector<byte_t>;
+
+    // Throws invalid_pdu if the first `size` bytes aren't a well-formed PDU
+    pdu_editor(byte_t* data, size_t size, size_t capacity)
+        : _data(data), _size(size), _capacity(capacity)
+    {
+        if (auto error = validate_pdu(data, size); error != parse_error::none)
+            throw invalid_pdu(error);
+    }
+
+    byte_t* data() { return _data; }
+    const byte_t* data() const { return _data; }
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+
+    bytes_view bytes() const { return { _data, _size }; }
+
+    // Read access to the edited PDU
+    pdu_view view() const
+    {
+        return pdu_view::from(_data, _size);
+    }
+
+    Type type() const { return static_cast<Type>((_data[0] >> 4) & 0x03); }
+    Code code() const { return static_cast<Code>(_data[1]); }
+    uint16_t message_id() const { return (_data[2] << 8) | _data[3]; }
+    bytes_view token() const { return { _data + 4, token_size() }; }
+
+    void set_type(Type type)
+    {
+        if (type > 3)
+            throw invalid_pdu();
+
+        _data[0] = (_data[0] & 0b11001111) | (type << 4);
+    }
+
+    void set_code(Code code)
+    {
+        _data[1] = code;
+    }
+
+    void set_message_id(uint16_t mid)
+    {
+        _data[2] = mid >> 8;
+        _data[3] = mid;
+    }
+
+    bool set_token(bytes_view token)
+    {
+        if (token.size() > 8)
+            throw invalid_pdu();
+
+        byte_t copy[8];
+        if (aliases(token)) {
+            std::memcpy(copy, token.data(), token.size());
+            token = bytes_view(copy, token.size());
+        }
+
+        auto out = splice(4, token_size(), token.size());
+        if (!out)
+            return false;
+
+        if (token.size())
+            std::memcpy(out, token.data(), token.size());
+        _data[0] = (_data[0] & 0b11110000) | token.size();
+        return true;
+    }
+
+    // Inserts an option after the existing occurrences of `number`
+    bool add_option(uint32_t number, bytes_view value)
+    {
+        return rewrite(find_run(number, false), number, &value);
+    }
+
+    // Replaces every occurrence of `number` with a single option
+    bool set_option(uint32_t number, bytes_view value)
+    {
+        return rewrite(find_run(number, true), number, &value);
+    }
+
+    // Removes every occurrence of `number`, returns how many there were
+    size_t remove_option(uint32_t number)
+    {
+        auto run = find_run(number, true);
+        rewrite(run, number, nullptr);
+        return run.count;
+    }
+
+    template <Option O>
+    bool set(typename option_traits<O>::value_type value)
+    {
+        return edit<O>(value, true);
+    }
+
+    template <Option O>
+    bool add(typename option_traits<O>::value_type value)
+    {
+        return edit<O>(value, false);
+    }
+
+    template <Option O>
+    size_t remove()
+    {
+        return remove_option(O);
+    }
+
+    bytes_view payload() const
+    {
+        auto end = options_end();
+        return end == _size ? bytes_view() : bytes_view(_data + end + 1, _size - end - 1);
+    }
+
+    bool set_payload(bytes_view payload)
+    {
+        bytes_t copy;
+        if (aliases(payload)) {
+            copy.assign(payload.begin(), payload.end());
+            payload = bytes_view(copy);
+        }
+
+        auto end = options_end();
+        auto out = splice(end, _size - end, payload.size() ? 1 + payload.size() : 0);
+        if (!out)
+            return false;
+
+        if (payload.size()) {
+            *out++ = 0xff;
+            std::memcpy(out, payload.data(), payload.size());
+        }
+        return true;
+    }
+
+    bool set_payload(std::string_view payload)
+    {
+        return set_payload(detail::as_bytes_view(payload));
+    }
+
+private:
+    // Options with one number, or the position they would be inserted at
+    struct option_run
+    {
+        size_t begin;          // Header of the first option of the run
+        size_t end;            // Header of the next option, or the end of the options
+        uint32_t prev_number;  // Number of the option before the run
+        size_t count;
+    };
+
+    size_t token_size() const
+    {
+        return _data[0] & 0b00001111;
+    }
+
+    bool at_option(size_t pos) const
+    {
+        return pos < _size && _data[pos] != 0xff;
+    }
+
+    // Decodes the option header at `pos`, returns the position of its value
+    size_t decode_header(size_t pos, uint32_t& delta, uint32_t& length) const
+    {
+        const byte_t* it = _data + pos;
+        detail::decode_option_header_unchecked(it, delta, length);
+        return it - _data;
+    }
+
+    size_t options_end() const
+    {
+        auto pos = 4 + token_size();
+        while (at_option(pos)) {
+            uint32_t delta, length;
+            pos = decode_header(pos, delta, length) + length;
+        }
+        return pos;
+    }
+
+    // With `same`, the run covers the options numbered `number`, otherwise
+    // it is empty and placed behind them
+    option_run find_run(uint32_t number, bool same) const
+    {
+        option_run run { 4 + token_size(), 0, 0, 0 };
+
+        uint32_t current = 0;
+        auto pos = run.begin;
+        while (at_option(pos)) {
+            uint32_t delta, length;
+            auto value = decode_header(pos, delta, length);
+            if (current + delta > number || (same && current + delta == number))
+                break;
+            current += delta;
+            pos = value + length;
+        }
+        run.begin = pos;
+        run.prev_number = current;
+
+        while (same && at_option(pos)) {
+            uint32_t delta, length;
+            auto value = decode_header(pos, delta, length);
+            if (current + delta != number)
+                break;
+            current += delta;
+            pos = value + length;
+            run.count++;
+        }
+        run.end = pos;
+        return run;
+    }
+
+    // Replaces `run` with a single `value` option, or with nothing, and
+    // re-encodes the delta of the option following it
+    bool rewrite(const option_run& run, uint32_t number, const bytes_view* value)
+    {
+        if (!value && !run.count)
+            return true;
+
+        bytes_t copy;
+        bytes_view copied;
+        if (value && aliases(*value)) {
+            copy.assign(value->begin(), value->end());
+            copied = bytes_view(copy);
+            value = &copied;
+        }
+
+        auto last = value ? number : run.prev_number;
+        auto new_size = value ? detail::option_header_size(number - run.prev_number, value->size()) + value->size() : 0;
+
+        // The next option's header is part of the rewritten range
+        size_t old_size = run.end - run.begin;
+        bool has_next = at_option(run.end);
+        uint32_t next_number = 0, next_length = 0;
+        if (has_next) {
+            uint32_t delta;
+            old_size = decode_header(run.end, delta, next_length) - run.begin;
+            next_number = (run.count ? number : run.prev_number) + delta;
+            new_size += detail::option_header_size(next_number - last, next_length);
+        }
+
+        auto out = splice(run.begin, old_size, new_size);
+        if (!out)
+            return false;
+
+        if (value) {
+            out = detail::encode_option_header(out, number - run.prev_number, value->size());
+            if (value->size())
+                std::memcpy(out, value->data(), value->size());
+            out += value->size();
+        }
+        if (has_next)
+            detail::encode_option_header(out, next_number - last, next_length);
+        return true;
+    }
+
+    template <Option O>
+    bool edit(typename option_traits<O>::value_type value, bool replace)
+    {
+        constexpr auto format = option_traits<O>::format;
+
+        if constexpr (format == option_format::empty) {
+            if (!value) {
+                if (replace)
+                    remove_option(O);
+                return true;
+            }
+            bytes_view empty;
+            return rewrite(find_run(O, replace), O, &empty);
+        } else if constexpr (format == option_format::uint) {
+            byte_t buf[4];
+            bytes_view bytes(buf, detail::encode_uint(buf, value) - buf);
+            return rewrite(find_run(O, replace), O, &bytes);
+        } else {
+            auto bytes = detail::as_bytes_view(value);
+            return rewrite(find_run(O, replace), O, &bytes);
+        }
+    }
+
+    // Values may point into the PDU itself, e.g. one option's value set
+    // as another's, and would be moved or overwritten by the splice
+    bool aliases(bytes_view value) const
+    {
+        return value.size() && value.data() >= _data && value.data() < _data + _size;
+    }
+
+    // Replaces `old_size` bytes at `pos` with room for `new_size` bytes and
+    // returns where they start, or nullptr if the result wouldn't fit
+    byte_t* splice(size_t pos, size_t old_size, size_t new_size)
+    {
+        if (_size - old_size + new_size > _capacity)
+            return nullptr;
+
+        auto tail = _size - pos - old_size;
+        if (tail && old_size != new_size)
+            std::memmove(_data + pos + new_size, _data + pos + old_size, tail);
+        _size = _size - old_size + new_size;
+        return _data + pos;
+    }
+
+    byte_t* _data;
+    size_t _size;
+    size_t _capacity;
+};
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "../modern-coapp.hpp"
+
+namespace coapp {
+
+// Fixed-shape PDU whose type, code and options are encoded at compile time,
+// e.g. for empty ACKs, RSTs or a 2.05 Content with a constant
+// Content-Format. Only the message ID, token and payload are written at
+// runtime, so stamping a message is a few byte copies:
+//
+//     static constexpr auto content = pdu_template(Type::Acknowledgement, Code::RESPONSE_CONTENT)
+//         .with<Option::ContentFormat>(50);
+//
+//     auto size = content.stamp(buffer, sizeof(buffer), request, payload);
+//
+// Options must be added in ascending order. Invalid templates fail to
+// compile when declared constexpr and throw otherwise.
+template <size_t Capacity = 32>
+class pdu_template
+{
+public:
+    using byte_t = uint8_t;
+
+    constexpr pdu_template(Type type, Code code)
+        : _type(type), _code(code)
+    {
+        if (type > 3)
+            throw std::invalid_argument("invalid message type");
+    }
+
+    // Copy of the template with one more option
+    template <Option O>
+    constexpr pdu_template with(typename option_traits<O>::value_type value) const
+    {
+        constexpr auto format = option_traits<O>::format;
+
+        byte_t encoded[std::max<size_t>(option_traits<O>::max_length, 4)] {};
+        size_t length = 0;
+        if constexpr (format == option_format::empty) {
+            if (!value)
+                return *this;
+        } else if constexpr (format == option_format::uint) {
+            length = detail::encode_uint(encoded, value) - encoded;
+        } else {
+            if (value.size() > option_traits<O>::max_length)
+                throw std::invalid_argument("option value too long");
+            for (; length < value.size(); length++)
+                encoded[length] = value[length];
+        }
+
+        if (length < option_traits<O>::min_length || length > option_traits<O>::max_length)
+            throw std::invalid_argument("invalid option length");
+        if (O < _last_option)
+            throw std::invalid_argument("template options out of order");
+        if (_code == Code::Empty)
+            throw std::invalid_argument("empty messages carry no options");
+
+        auto result = *this;
+        auto header_size = detail::option_header_size(O - _last_option, length);
+        if (result._size + header_size + length > Capacity)
+            throw std::length_error("template capacity exceeded");
+
+        auto out = detail::encode_option_header(result._options + result._size, O - _last_option, length);
+        for (size_t i = 0; i < length; i++)
+            *out++ = encoded[i];
+
+        result._size += header_size + length;
+        result._last_option = O;
+        return result;
+    }
+
+    constexpr Type type() const { return _type; }
+    constexpr Code code() const { return _code; }
+
+    // Encoded options, without header and token
+    constexpr bytes_view options() const { return { _options, _size }; }
+
+    constexpr size_t encoded_size(size_t token_size, size_t payload_size = 0) const
+    {
+        return 4 + token_size + _size + (payload_size ? 1 + payload_size : 0);
+    }
+
+    // Writes a message into `out`. Returns the number of bytes written, or 0
+    // if `capacity` is too small. Empty messages take no token or payload
+    // (RFC 7252 section 4.1).
+    size_t stamp(byte_t* out, size_t capacity, uint16_t message_id, bytes_view token,
+                 bytes_view payload = {}) const
+    {
+        if (token.size() > 8 || (_code == Code::Empty && (token.size() || payload.size())))
+            throw invalid_pdu();
+
+        auto size = encoded_size(token.size(), payload.size());
+        if (size > capacity)
+            return 0;
+
+        out[0] = (1 << 6) | (_type << 4) | token.size();
+        out[1] = _code;
+        out[2] = message_id >> 8;
+        out[3] = message_id;
+
+        auto it = out + 4;
+        if (token.size())
+            std::memcpy(it, token.data(), token.size());
+        it += token.size();
+
+        std::memcpy(it, _options, _size);
+        it += _size;
+
+        if (payload.size()) {
+            *it++ = 0xff;
+            std::memcpy(it, payload.data(), payload.size());
+        }
+
+        detail::count_encoded(size);
+        return size;
+    }
+
+    size_t stamp(byte_t* out, size_t capacity, uint16_t message_id, bytes_view token,
+                 std::string_view payload) const
+    {
+        return stamp(out, capacity, message_id, token, detail::as_bytes_view(payload));
+    }
+
+    // Response to `request`, echoing its message ID, and its token unless
+    // this is an empty ACK or RST, which has none
+    size_t stamp(byte_t* out, size_t capacity, const pdu_view& request, bytes_view payload = {}) const
+    {
+        return stamp(out, capacity, request.message_id(), token_for(request), payload);
+    }
+
+    size_t stamp(byte_t* out, size_t capacity, const pdu_view& request, std::string_view payload) const
+    {
+        return stamp(out, capacity, request.message_id(), token_for(request), payload);
+    }
+
+private:
+    bytes_view token_for(const pdu_view& request) const
+    {
+        return _code == Code::Empty ? bytes_view() : request.token();
+    }
+
+    Type _type;
+    Code _code;
+
+    byte_t _options[Capacity] {};
+    size_t _size { 0 };
+    uint32_t _last_option { 0 };
+};
+
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <random>
+
+#include "../modern-coapp.hpp"
+#include "detail/slot_index.hpp"
+#include "timer_wheel.hpp"
+#include "transmission.hpp"
+
+namespace coapp {
+
+// Reliable transmission of Confirmable messages (RFC 7252 section 4.2).
+//
+// Tracks outstanding CONs by (endpoint, message ID) and retransmits their
+// already-serialized bytes with exponential back-off until they are
+// acknowledged or MAX_RETRANSMIT is exhausted. Timers live in a
+// hierarchical timing wheel, so tracking, acknowledging and each
+// retransmission are O(1) regardless of how many messages are in flight.
+struct retransmission_parameters
+{
+    std::chrono::steady_clock::duration ack_timeout { transmission::ack_timeout };
+    double ack_random_factor { transmission::ack_random_factor };
+    unsigned max_retransmit { transmission::max_retransmit };
+};
+
+class retransmission_scheduler
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using bytes_t = std::vector<uint8_t>;
+    using parameters = retransmission_parameters;
+
+    explicit retransmission_scheduler(size_t capacity,
+                                      parameters params = {},
+                                      clock::duration tick = std::chrono::milliseconds(1),
+                                      uint32_t seed = std::random_device{}())
+        : _params(params),
+          _tick(tick.count() > 0 ? tick.count() : 1),
+          _capacity(capacity),
+          _slots(new slot[capacity]),
+          _index(capacity),
+          _wheel(capacity),
+          _random(seed)
+    {
+        for (size_t i = 0; i < capacity; i++)
+            _slots[i].next = i + 1 < capacity ? i + 1 : npos;
+    }
+
+    // Starts retransmitting `bytes`, which were just sent for the first
+    // time. Returns false when full or the message is already tracked.
+    bool track(endpoint_id endpoint, uint16_t message_id, bytes_t bytes, clock::time_point now)
+    {
+        return track(endpoint, message_id, std::move(bytes), now, _params.ack_timeout);
+    }
+
+    // Same with a per-message ACK_TIMEOUT and back-off factor, e.g. from a
+    // congestion_controller estimating the round trip to `endpoint`
+    bool track(endpoint_id endpoint, uint16_t message_id, bytes_t bytes, clock::time_point now,
+               clock::duration ack_timeout, double backoff = 2.0)
+    {
+        if (_free == npos)
+            return false;
+
+        const auto index = _free;
+        if (!_index.insert(hash_of(endpoint, message_id), index, matcher(endpoint, message_id)))
+            return false;
+
+        auto& s = _slots[index];
+        _free = s.next;
+
+        s.endpoint = endpoint;
+        s.message_id = message_id;
+        s.bytes = std::move(bytes);
+        s.retransmissions = 0;
+        s.backoff = backoff;
+
+        // Initial timeout is random between ACK_TIMEOUT and
+        // ACK_TIMEOUT * ACK_RANDOM_FACTOR
+        std::uniform_real_distribution<double> factor(1.0, _params.ack_random_factor);
+        s.timeout = std::max<int64_t>(1, ticks(ack_timeout) * factor(_random));
+
+        _wheel.schedule(index, tick_of(now) + s.timeout);
+        _size++;
+        return true;
+    }
+
+    // Stops retransmitting on a matching ACK or RST. Returns false when the
+    // message was not outstanding, e.g. a duplicate ACK.
+    bool acknowledge(endpoint_id endpoint, uint16_t message_id)
+    {
+        auto index = _index.erase(hash_of(endpoint, message_id), matcher(endpoint, message_id));
+        if (index == npos)
+            return false;
+
+        _wheel.cancel(index);
+        release(index);
+        return true;
+    }
+
+    // Same, and hands back the bytes, e.g. to find the token a RST is for
+    std::optional<bytes_t> take(endpoint_id endpoint, uint16_t message_id)
+    {
+        auto index = _index.erase(hash_of(endpoint, message_id), matcher(endpoint, message_id));
+        if (index == npos)
+            return std::nullopt;
+
+        _wheel.cancel(index);
+        std::optional<bytes_t> bytes = std::move(_slots[index].bytes);
+        release(index);
+        return bytes;
+    }
+
+    bool outstanding(endpoint_id endpoint, uint16_t message_id) const
+    {
+        return _index.find(hash_of(endpoint, message_id), matcher(endpoint, message_id)) != npos;
+    }
+
+    // Calls send(endpoint, bytes_view) for every retransmission due by `now`
+    // and give_up(endpoint, message_id, bytes_t&&) for every message whose
+    // last retransmission timed out.
+    template <typename Send, typename GiveUp>
+    size_t poll(clock::time_point now, Send&& send, GiveUp&& give_up)
+    {
+        return _wheel.advance(tick_of(now), [&] (uint32_t index) {
+            auto& s = _slots[index];
+
+            if (s.retransmissions == _params.max_retransmit) {
+                _index.erase(hash_of(s.endpoint, s.message_id), matcher(s.endpoint, s.message_id));
+                auto bytes = std::move(s.bytes);
+                auto endpoint = s.endpoint;
+                auto message_id = s.message_id;
+                release(index);
+                give_up(endpoint, message_id, std::move(bytes));
+                return;
+            }
+
+            s.retransmissions++;
+            s.timeout = std::max<int64_t>(s.timeout + 1, s.timeout * s.backoff);
+            _wheel.schedule(index, _wheel.now() + s.timeout);
+            send(s.endpoint, bytes_view(s.bytes));
+        });
+    }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+
+private:
+    static constexpr uint32_t npos = detail::slot_index::npos;
+
+    struct slot
+    {
+        endpoint_id endpoint { 0 };
+        uint16_t message_id { 0 };
+        unsigned retransmissions { 0 };
+        int64_t timeout { 0 }; // Current timeout in ticks
+        float backoff { 2 };
+        bytes_t bytes;
+
+        uint32_t next { npos }; // Free list
+    };
+
+    static uint64_t hash_of(endpoint_id endpoint, uint16_t message_id)
+    {
+        uint64_t x = endpoint ^ (uint64_t(message_id) << 48) ^ message_id;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    struct key_matcher
+    {
+        const slot* slots;
+        endpoint_id endpoint;
+        uint16_t message_id;
+
+        bool operator()(uint32_t index) const
+        {
+            return slots[index].endpoint == endpoint && slots[index].message_id == message_id;
+        }
+    };
+
+    key_matcher matcher(endpoint_id endpoint, uint16_t message_id) const
+    {
+        return { _slots.get(), endpoint, message_id };
+    }
+
+    int64_t ticks(clock::duration d) const
+    {
+        return d.count() / _tick;
+    }
+
+    // Ticks count from the first time point seen, so the wheel starts at 0
+    uint64_t tick_of(clock::time_point t)
+    {
+        if (!_started) {
+            _origin = t;
+            _started = true;
+        }
+        return t > _origin ? (t - _origin).count() / _tick : 0;
+    }
+
+    void release(uint32_t index)
+    {
+        auto& s = _slots[index];
+        s.bytes = {};
+        s.next = _free;
+        _free = index;
+        _size--;
+    }
+
+    parameters _params;
+    clock::duration::rep _tick;
+
+    size_t _capacity;
+    std::unique_ptr<slot[]> _slots;
+    detail::slot_index _index;
+    timer_wheel _wheel;
+
+    uint32_t _free { 0 };
+    size_t _size { 0 };
+
+    bool _started { false };
+    clock::time_point _origin {};
+
+    std::minstd_rand _random;
+};
+
+}
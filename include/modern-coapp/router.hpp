@@ -0,0 +1,250 @@
+#pragma once
+
+#include <array>
+#include <stdexcept>
+
+#include "../modern-coapp.hpp"
+
+namespace coapp {
+
+struct route
+{
+    Method method;
+    std::string_view path; // e.g. "/sensors/temp"
+};
+
+struct route_match
+{
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    size_t index { npos }; // Index of the matching route
+    bool path_found { false }; // The path exists, for 4.05 Method Not Allowed
+
+    explicit operator bool() const
+    {
+        return index != npos;
+    }
+};
+
+namespace detail {
+
+constexpr uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+constexpr size_t next_power_of_two(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+// Compares the Uri-Path options in `options` with the segments of `path`
+template <typename Options>
+bool uri_path_equals(const Options& options, std::string_view path)
+{
+    if (!path.empty() && path.front() == '/')
+        path.remove_prefix(1);
+
+    auto [first, last] = options.equal_range(Option::UriPath);
+    if (first == last)
+        return path.empty();
+
+    for (; first != last; ++first) {
+        auto value = as_bytes_view(first->second);
+        auto end = path.find('/');
+        auto segment = path.substr(0, end);
+
+        if (segment.size() != value.size()
+            || (value.size() && std::memcmp(segment.data(), value.data(), value.size()) != 0))
+            return false;
+
+        // The path has more segments than the request
+        if (end == std::string_view::npos)
+            return std::next(first) == last;
+        path.remove_prefix(end + 1);
+    }
+    return false;
+}
+
+}
+
+// Resource dispatcher over a route table known at compile time.
+//
+// Paths are placed in a perfect hash table by hash-and-displace: every path
+// hash selects a bucket, and each bucket has a displacement chosen at
+// construction so that no two paths share a slot. Matching a request costs
+// one Uri-Path hash (precomputed by parse_flags::hash_uri_path), two table
+// reads and one comparison of the Uri-Path options with the stored path.
+template <size_t N>
+class static_router
+{
+public:
+    static_assert(N > 0, "a router needs at least one route");
+
+    constexpr explicit static_router(const route (&routes)[N])
+    {
+        // Distinct paths, with the routes for each method
+        for (size_t i = 0; i < N; i++) {
+            const auto& r = routes[i];
+            auto method = static_cast<size_t>(r.method);
+            if (method < 1 || method > methods)
+                throw std::invalid_argument("unsupported route method");
+
+            auto hash = uri_path_hash(r.path);
+            size_t p = 0;
+            while (p < _path_count && _paths[p].hash != hash)
+                p++;
+
+            if (p == _path_count) {
+                _paths[p].hash = hash;
+                _paths[p].path = r.path;
+                _path_count++;
+            } else if (!equal_paths(_paths[p].path, r.path)) {
+                throw std::invalid_argument("route paths with colliding hashes");
+            }
+
+            if (_paths[p].routes[method - 1] != empty)
+                throw std::invalid_argument("duplicate route");
+            _paths[p].routes[method - 1] = i;
+        }
+
+        place();
+    }
+
+    template <typename Pdu>
+    route_match match(const Pdu& request) const
+    {
+        const auto hash = request.uri_path_hash();
+        const auto& p = _slots[slot(hash)];
+        if (p.routes[0] == unused || p.hash != hash
+            || !detail::uri_path_equals(request.options(), p.path))
+            return {};
+
+        route_match result;
+        result.path_found = true;
+
+        auto method = static_cast<size_t>(request.code());
+        if (method >= 1 && method <= methods && p.routes[method - 1] != empty)
+            result.index = p.routes[method - 1];
+
+        return result;
+    }
+
+    constexpr size_t size() const
+    {
+        return N;
+    }
+
+private:
+    static constexpr size_t methods = 4; // GET, POST, PUT, DELETE
+    static constexpr uint16_t empty = 0xffff; // No route for a method
+    static constexpr uint16_t unused = 0xfffe; // Slot holds no path
+
+    static_assert(N < unused, "too many routes");
+
+    static constexpr size_t table_size = detail::next_power_of_two(2 * N);
+    static constexpr size_t bucket_count = detail::next_power_of_two((N + 3) / 4);
+
+    struct path_entry
+    {
+        uint64_t hash { 0 };
+        std::string_view path {};
+        uint16_t routes[methods] { empty, empty, empty, empty };
+    };
+
+    static constexpr bool equal_paths(std::string_view lhs, std::string_view rhs)
+    {
+        if (!lhs.empty() && lhs.front() == '/')
+            lhs.remove_prefix(1);
+        if (!rhs.empty() && rhs.front() == '/')
+            rhs.remove_prefix(1);
+        return lhs == rhs;
+    }
+
+    static constexpr size_t bucket(uint64_t hash)
+    {
+        return detail::mix64(hash) & (bucket_count - 1);
+    }
+
+    static constexpr size_t displaced(uint64_t hash, uint32_t displacement)
+    {
+        return detail::mix64(hash + (displacement + 1) * 0x9e3779b97f4a7c15ull) & (table_size - 1);
+    }
+
+    constexpr size_t slot(uint64_t hash) const
+    {
+        return displaced(hash, _displacements[bucket(hash)]);
+    }
+
+    constexpr void place()
+    {
+        for (auto& s: _slots)
+            s.routes[0] = unused;
+
+        // Largest buckets first, they are the hardest to place
+        size_t sizes[bucket_count] {};
+        for (size_t p = 0; p < _path_count; p++)
+            sizes[bucket(_paths[p].hash)]++;
+
+        size_t order[bucket_count] {};
+        for (size_t b = 0; b < bucket_count; b++) {
+            size_t i = b;
+            while (i > 0 && sizes[order[i - 1]] < sizes[b]) {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = b;
+        }
+
+        for (size_t o = 0; o < bucket_count && sizes[order[o]]; o++) {
+            const auto b = order[o];
+
+            uint32_t displacement = 0;
+            while (!try_place(b, displacement)) {
+                if (++displacement == 1u << 20)
+                    throw std::logic_error("could not build a perfect hash for the routes");
+            }
+            _displacements[b] = displacement;
+        }
+    }
+
+    constexpr bool try_place(size_t b, uint32_t displacement)
+    {
+        size_t taken[N] {};
+        size_t count = 0;
+
+        for (size_t p = 0; p < _path_count; p++) {
+            if (bucket(_paths[p].hash) != b)
+                continue;
+
+            auto s = displaced(_paths[p].hash, displacement);
+            if (_slots[s].routes[0] != unused)
+                return false;
+            for (size_t t = 0; t < count; t++) {
+                if (taken[t] == s)
+                    return false;
+            }
+            taken[count++] = s;
+        }
+
+        count = 0;
+        for (size_t p = 0; p < _path_count; p++) {
+            if (bucket(_paths[p].hash) == b)
+                _slots[taken[count++]] = _paths[p];
+        }
+        return true;
+    }
+
+    path_entry _paths[N] {};
+    size_t _path_count { 0 };
+
+    path_entry _slots[table_size] {};
+    uint32_t _displacements[bucket_count] {};
+};
+
+}
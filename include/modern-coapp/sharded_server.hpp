@@ -0,0 +1,239 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory_resource>
+#include <thread>
+#include <variant>
+
+#include "dedup_cache.hpp"
+#include "endpoint.hpp"
+#include "exchange_table.hpp"
+#include "mpsc_queue.hpp"
+
+namespace coapp {
+
+struct sharded_server_options
+{
+    size_t shards { std::max(1u, std::thread::hardware_concurrency()) };
+    udp_endpoint::options endpoint {};
+
+    size_t dedup_capacity { 4096 };
+    size_t exchange_capacity { 1024 };
+    size_t arena_size { 64 * 1024 };   // Initial per-shard arena, reset every batch
+    size_t inbox_capacity { 1024 };    // Tasks posted from other shards
+
+    int poll_timeout_ms { 10 };        // Upper bound on the latency of posted tasks
+};
+
+// Runs one worker thread per shard, each with its own SO_REUSEPORT socket on
+// the same address, its own dedup cache, exchange table and arena. The
+// kernel spreads datagrams across the sockets by address hash, so a peer
+// sticks to a shard and nothing on the per-message path is shared between
+// threads. Shards reach each other's state only by posting tasks to a
+// lock-free inbox, e.g. for Observe notifications.
+template <typename Exchange = std::monostate>
+class sharded_server
+{
+public:
+    using options = sharded_server_options;
+
+    class shard
+    {
+    public:
+        using task = std::function<void(shard&)>;
+
+        size_t index() const { return _index; }
+        sharded_server& server() { return *_server; }
+
+        udp_endpoint& endpoint() { return _endpoint; }
+        dedup_cache& dedup() { return _dedup; }
+        exchange_table<Exchange>& exchanges() { return _exchanges; }
+
+        // Released after every batch of messages, so only for allocations
+        // that don't outlive the handler, e.g. of a pmr::pdu
+        std::pmr::memory_resource* arena() { return &_arena; }
+
+        // Sends `response` to `request` and stores it for retransmitted
+        // duplicates of the request. Returns false, sending nothing, when
+        // it doesn't fit the endpoint's buffer_size. Responses over the
+        // dedup cache's max_response_size are sent but not stored.
+        template <typename Pdu>
+        bool respond(const peer& to, const pdu_view& request, const Pdu& response)
+        {
+            auto size = response.serialize_into(_scratch.get(), _scratch_size);
+            if (size == 0)
+                return false;
+
+            bytes_view bytes(_scratch.get(), size);
+            _dedup.store_response(to.id, request.message_id(), bytes, _now);
+            return _endpoint.send(to, bytes);
+        }
+
+        dedup_cache::clock::time_point now() const { return _now; }
+
+    private:
+        friend class sharded_server;
+
+        shard(sharded_server& server, size_t index, const sockaddr* address, socklen_t length,
+              const options& opts)
+            : _server(&server),
+              _index(index),
+              _endpoint(address, length, opts.endpoint),
+              _dedup(opts.dedup_capacity),
+              _exchanges(opts.exchange_capacity),
+              _arena_buffer(new std::byte[opts.arena_size]),
+              _arena(_arena_buffer.get(), opts.arena_size),
+              _inbox(opts.inbox_capacity),
+              _scratch(new uint8_t[opts.endpoint.buffer_size]),
+              _scratch_size(opts.endpoint.buffer_size)
+        {}
+
+        template <typename Handler, typename Timeout>
+        void run(Handler& handler, Timeout& on_timeout)
+        {
+            while (_server->_running.load(std::memory_order_acquire)) {
+                _endpoint.poll(_server->_options.poll_timeout_ms,
+                               [&] (const peer& from, const pdu_view& message) {
+                    _now = dedup_cache::clock::now();
+                    if (message.type() == Type::Confirmable || message.type() == Type::NonConfirmable) {
+                        auto seen = _dedup.check(from.id, message.message_id(), _now);
+                        if (seen.status == dedup_cache::status::duplicate_response)
+                            _endpoint.send(from, seen.response);
+                        else if (seen.status == dedup_cache::status::duplicate && message.type() == Type::Confirmable)
+                            acknowledge(from, message.message_id());
+                        if (seen.status != dedup_cache::status::new_message)
+                            return;
+                    }
+                    handler(*this, from, message);
+                });
+
+                _now = dedup_cache::clock::now();
+                _exchanges.expire(_now, [&] (endpoint_id endpoint, const inline_token& token, Exchange& value) {
+                    on_timeout(*this, endpoint, token, value);
+                });
+
+                task t;
+                while (_inbox.pop(t))
+                    t(*this);
+
+                _endpoint.flush();
+                _arena.release();
+            }
+        }
+
+        // Empty ACK for a duplicate CON without a response yet, which is
+        // still being handled or gets a separate response (RFC 7252 4.5)
+        void acknowledge(const peer& to, uint16_t message_id)
+        {
+            const uint8_t ack[4] = { uint8_t(0x40 | (Type::Acknowledgement << 4)), 0,
+                                     uint8_t(message_id >> 8), uint8_t(message_id) };
+            _endpoint.send(to, bytes_view(ack, sizeof(ack)));
+        }
+
+        sharded_server* _server;
+        size_t _index;
+
+        udp_endpoint _endpoint;
+        dedup_cache _dedup;
+        exchange_table<Exchange> _exchanges;
+
+        std::unique_ptr<std::byte[]> _arena_buffer;
+        std::pmr::monotonic_buffer_resource _arena;
+
+        mpsc_queue<task> _inbox;
+
+        // Encoded responses, as large as a received datagram can be
+        std::unique_ptr<uint8_t[]> _scratch;
+        size_t _scratch_size;
+
+        dedup_cache::clock::time_point _now { dedup_cache::clock::now() };
+    };
+
+    using task = typename shard::task;
+
+    // Binds every shard; a zero port is resolved by the first shard and
+    // shared by the others
+    sharded_server(const sockaddr* address, socklen_t length, options opts = {})
+        : _options(opts)
+    {
+        _options.shards = std::max<size_t>(1, _options.shards);
+        _options.endpoint.reuse_port = true;
+
+        _shards.reserve(_options.shards);
+        _shards.emplace_back(new shard(*this, 0, address, length, _options));
+
+        auto bound = _shards[0]->_endpoint.local_address();
+        for (size_t i = 1; i < _options.shards; i++)
+            _shards.emplace_back(new shard(*this, i, bound.addr(), bound.length, _options));
+    }
+
+    sharded_server(const sharded_server&) = delete;
+    sharded_server& operator=(const sharded_server&) = delete;
+
+    ~sharded_server()
+    {
+        stop();
+    }
+
+    size_t shard_count() const { return _shards.size(); }
+    shard& operator[](size_t i) { return *_shards[i]; }
+
+    peer local_address() const
+    {
+        return _shards[0]->_endpoint.local_address();
+    }
+
+    // Starts the workers. handler(shard&, const peer&, const pdu_view&) is
+    // called for every message that isn't a duplicate, on_timeout(shard&,
+    // endpoint_id, const inline_token&, Exchange&) for expired exchanges.
+    // Both are copied into every worker.
+    template <typename Handler, typename Timeout>
+    void start(Handler handler, Timeout on_timeout)
+    {
+        _running.store(true, std::memory_order_release);
+        for (auto& s : _shards) {
+            _threads.emplace_back([this, &s = *s, handler, on_timeout] () mutable {
+                s.run(handler, on_timeout);
+            });
+        }
+    }
+
+    template <typename Handler>
+    void start(Handler handler)
+    {
+        start(std::move(handler), [] (shard&, endpoint_id, const inline_token&, Exchange&) {});
+    }
+
+    void stop()
+    {
+        _running.store(false, std::memory_order_release);
+        for (auto& t : _threads)
+            t.join();
+        _threads.clear();
+    }
+
+    // Runs `t` on shard `target` from any thread. Fails when its inbox is
+    // full.
+    bool post(size_t target, task t)
+    {
+        return _shards[target]->_inbox.push(std::move(t));
+    }
+
+    // Runs `t` on every shard
+    size_t broadcast(const task& t)
+    {
+        size_t posted = 0;
+        for (size_t i = 0; i < _shards.size(); i++)
+            posted += post(i, t);
+        return posted;
+    }
+
+private:
+    options _options;
+    std::vector<std::unique_ptr<shard>> _shards;
+    std::vector<std::thread> _threads;
+    std::atomic<bool> _running { false };
+};
+
+}
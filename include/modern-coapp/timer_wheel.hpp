@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+namespace coapp {
+
+// Hierarchical timing wheel over a fixed set of timer ids [0, capacity).
+//
+// Four levels of 64 slots each cover 2^24 ticks; a timer sits on the level
+// of the highest 6-bit group in which its deadline differs from the current
+// tick, and cascades to lower levels as time reaches that group. Deadlines
+// beyond 2^24 ticks keep cascading on the top level until they are in
+// range. Scheduling and cancelling are O(1) and never allocate.
+class timer_wheel
+{
+public:
+    static constexpr uint32_t npos = 0xffffffff;
+
+    explicit timer_wheel(size_t capacity, uint64_t start_tick = 0)
+        : _nodes(new node[capacity]),
+          _current(start_tick)
+    {
+        std::fill(std::begin(_heads), std::end(_heads), npos);
+    }
+
+    uint64_t now() const
+    {
+        return _current;
+    }
+
+    // (Re)schedules timer `id`. Deadlines that already passed fire on the
+    // next tick.
+    void schedule(uint32_t id, uint64_t deadline)
+    {
+        cancel(id);
+        _nodes[id].deadline = std::max(deadline, _current + 1);
+        place(id);
+    }
+
+    void cancel(uint32_t id)
+    {
+        auto& n = _nodes[id];
+        if (n.bucket == npos)
+            return;
+
+        if (n.prev != npos)
+            _nodes[n.prev].next = n.next;
+        else
+            _heads[n.bucket] = n.next;
+        if (n.next != npos)
+            _nodes[n.next].prev = n.prev;
+
+        if (_heads[n.bucket] == npos)
+            _occupied[n.bucket / slots] &= ~(uint64_t(1) << (n.bucket % slots));
+
+        n.bucket = npos;
+        _count--;
+    }
+
+    bool scheduled(uint32_t id) const
+    {
+        return _nodes[id].bucket != npos;
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    // Advances to `tick`, calling on_expire(id) for every timer due by then.
+    // Timers may be rescheduled from within the callback.
+    template <typename F>
+    size_t advance(uint64_t tick, F&& on_expire)
+    {
+        size_t fired = 0;
+        while (_current < tick) {
+            if (_count == 0) {
+                _current = tick;
+                break;
+            }
+
+            // Nothing due on level 0 before the next cascade
+            if (_occupied[0] == 0) {
+                auto boundary = (_current | (slots - 1)) + 1;
+                if (boundary > tick) {
+                    _current = tick;
+                    break;
+                }
+                _current = boundary - 1;
+            }
+
+            const auto t = ++_current;
+
+            // Higher levels first, they may cascade into this tick's slots
+            for (unsigned level = levels - 1; level > 0; level--) {
+                if ((t & ((uint64_t(1) << (slot_bits * level)) - 1)) == 0)
+                    cascade(level, (t >> (slot_bits * level)) & (slots - 1));
+            }
+
+            const auto bucket = t & (slots - 1);
+            while (_heads[bucket] != npos) {
+                auto id = _heads[bucket];
+                cancel(id);
+                on_expire(id);
+                fired++;
+            }
+        }
+        return fired;
+    }
+
+private:
+    static constexpr unsigned levels = 4;
+    static constexpr unsigned slot_bits = 6;
+    static constexpr unsigned slots = 1 << slot_bits;
+
+    struct node
+    {
+        uint64_t deadline { 0 };
+        uint32_t prev { npos };
+        uint32_t next { npos };
+        uint32_t bucket { npos };
+    };
+
+    void place(uint32_t id)
+    {
+        auto& n = _nodes[id];
+
+        unsigned level = 0;
+        for (auto diff = (n.deadline ^ _current) >> slot_bits; diff; diff >>= slot_bits)
+            level++;
+
+        uint64_t slot;
+        if (level < levels) {
+            slot = (n.deadline >> (slot_bits * level)) & (slots - 1);
+        } else {
+            // Out of range, park in top level slot 0 which cascades when
+            // the wheel wraps. Real top level timers are never in slot 0, it
+            // is always behind the current tick.
+            level = levels - 1;
+            slot = 0;
+        }
+
+        n.bucket = level * slots + slot;
+        n.prev = npos;
+        n.next = _heads[n.bucket];
+        if (n.next != npos)
+            _nodes[n.next].prev = id;
+        _heads[n.bucket] = id;
+
+        _occupied[level] |= uint64_t(1) << slot;
+        _count++;
+    }
+
+    void cascade(unsigned level, uint64_t slot)
+    {
+        const auto bucket = level * slots + slot;
+        auto id = _heads[bucket];
+
+        _heads[bucket] = npos;
+        _occupied[level] &= ~(uint64_t(1) << slot);
+
+        while (id != npos) {
+            auto next = _nodes[id].next;
+            _nodes[id].bucket = npos;
+            _count--;
+            place(id);
+            id = next;
+        }
+    }
+
+    std::unique_ptr<node[]> _nodes;
+    uint32_t _heads[levels * slots];
+    uint64_t _occupied[levels] {};
+
+    uint64_t _current;
+    size_t _count { 0 };
+};
+
+}
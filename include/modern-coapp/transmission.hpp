@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace coapp {
+
+// Identifies a remote endpoint, e.g. a hash of its address and port. The
+// library only compares these, so any stable and unique value will do.
+using endpoint_id = uint64_t;
+
+// Message transmission parameters and derived times, RFC 7252 section 4.8
+namespace transmission {
+
+using namespace std::chrono_literals;
+
+constexpr std::chrono::milliseconds ack_timeout = 2s;
+constexpr double ack_random_factor = 1.5;
+constexpr unsigned max_retransmit = 4;
+constexpr unsigned nstart = 1;
+constexpr std::chrono::seconds default_leisure = 5s;
+constexpr unsigned probing_rate = 1; // bytes/second
+
+constexpr std::chrono::seconds max_latency = 100s;
+constexpr std::chrono::seconds processing_delay = 2s;
+
+constexpr std::chrono::seconds max_transmit_span = 45s;
+constexpr std::chrono::seconds max_transmit_wait = 93s;
+constexpr std::chrono::seconds exchange_lifetime = 247s;
+constexpr std::chrono::seconds non_lifetime = 145s;
+
+}
+
+}
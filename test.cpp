@@ -1,7 +1,27 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
 
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "include/modern-coapp.hpp"
+#include "include/modern-coapp/batch_encoder.hpp"
+#include "include/modern-coapp/blockwise.hpp"
+#include "include/modern-coapp/congestion.hpp"
+#include "include/modern-coapp/router.hpp"
+#include "include/modern-coapp/dedup_cache.hpp"
+#include "include/modern-coapp/endpoint.hpp"
+#include "include/modern-coapp/exchange_table.hpp"
+#include "include/modern-coapp/lazy_pdu.hpp"
+#include "include/modern-coapp/observe_registry.hpp"
+#include "include/modern-coapp/pdu_editor.hpp"
+#include "include/modern-coapp/pdu_template.hpp"
+#include "include/modern-coapp/mpsc_queue.hpp"
+#include "include/modern-coapp/retransmission.hpp"
+#include "include/modern-coapp/sharded_server.hpp"
+#include "include/modern-coapp/timer_wheel.hpp"
 
 TEST_CASE( "Empty PDU should fail to parse", "[parse]" ) {
     REQUIRE_THROWS( coapp::pdu::from({}) );
@@ -332,4 +352,2148 @@ TEST_CASE( "should be able to insert options in any order", "[build]" ) {
     pdu.set_payload({ 0x42, 0x42, 0x42, 0x42 });
 
     REQUIRE (pdu.to_bytes() == target_bytes);
-}
\ No newline at end of file
+}
+namespace {
+
+template <typename... Args>
+auto can_view_from(int) -> decltype(coapp::pdu_view::from(std::declval<Args>()...), std::true_type());
+
+template <typename... Args>
+std::false_type can_view_from(...);
+
+}
+
+// Views of temporaries would dangle, with or without flags
+static_assert(decltype(can_view_from<const std::vector<uint8_t>&>(0))::value);
+static_assert(decltype(can_view_from<const std::vector<uint8_t>&, coapp::parse_flags>(0))::value);
+static_assert(!decltype(can_view_from<std::vector<uint8_t>>(0))::value);
+static_assert(!decltype(can_view_from<std::vector<uint8_t>, coapp::parse_flags>(0))::value);
+
+TEST_CASE( "PDU view should parse without copying", "[view]" ) {
+    std::vector<uint8_t> raw_pdu = {
+        0b01100010u,  // Ver: 1, Type: 2, TKL: 2
+
+        2,   // Code
+
+        1,0, // MID: 0000 0001 0000 0000 => 256
+
+        0xaa, 0xbb, // Token
+
+        0b00010001, // Option delta = 1, Option length = 1
+        0xff,       // Option value = 0xff
+
+        0b11010011,       // Option delta = 13, Option length = 3
+        0xff,             // Option delta - 13 = 255 => Option delta = 268
+        0x01, 0x02, 0x03, // Option value = 0x01 0x02 0x03
+
+        0xff, // Payload separator
+        0x42, 0x42, 0x42, 0x42 // Payload
+    };
+
+    auto view = coapp::pdu_view::from(raw_pdu);
+
+    REQUIRE (view.version() == 1);
+    REQUIRE (view.type() == 2);
+    REQUIRE (view.code() == 2);
+    REQUIRE (view.message_id() == 256);
+    REQUIRE (view.token() == std::vector<uint8_t> { 0xaa, 0xbb });
+    REQUIRE (view.token().data() == raw_pdu.data() + 4);
+
+    auto& options = view.options();
+    REQUIRE (options.size() == 2);
+
+    auto opt_it = options.begin();
+
+    REQUIRE (opt_it->first == 1);
+    REQUIRE (opt_it->second == std::vector<uint8_t> { 0xff });
+    REQUIRE (opt_it->second.data() == raw_pdu.data() + 7);
+
+    opt_it++;
+
+    REQUIRE (opt_it->first == 269);
+    REQUIRE (opt_it->second == std::vector<uint8_t> { 0x01, 0x02, 0x03 });
+
+    opt_it++;
+
+    REQUIRE (opt_it == options.end());
+
+    REQUIRE (view.payload() == "BBBB");
+    REQUIRE (view.payload().data() == reinterpret_cast<const char*>(raw_pdu.data()) + 14);
+
+    auto pdu = view.to_pdu();
+    REQUIRE (pdu.options().size() == 2);
+    REQUIRE (pdu.to_bytes() == raw_pdu);
+}
+
+TEST_CASE( "PDU view should reject malformed PDUs", "[view]" ) {
+    std::vector<uint8_t> too_short = { 0b01000000u, 0, 0 };
+    REQUIRE_THROWS( coapp::pdu_view::from(too_short) );
+
+    std::vector<uint8_t> truncated_token = { 0b01000100u, 0, 0, 0, 0x01 };
+    REQUIRE_THROWS( coapp::pdu_view::from(truncated_token) );
+
+    std::vector<uint8_t> truncated_option = { 0b01000000u, 0, 0, 0, 0b00010010, 0xff };
+    REQUIRE_THROWS( coapp::pdu_view::from(truncated_option) );
+
+    std::vector<uint8_t> truncated_delta = { 0b01000000u, 0, 0, 0, 0b11100000, 0x01 };
+    REQUIRE_THROWS( coapp::pdu_view::from(truncated_delta) );
+}
+
+TEST_CASE( "PDU should serialize into a caller buffer", "[build]" ) {
+    coapp::pdu pdu;
+
+    pdu.set_type(coapp::Type::Confirmable);
+    pdu.set_code(coapp::Code::REQUEST_GET);
+    pdu.set_message_id(0x1234);
+    pdu.set_token({ 0x01, 0x02 });
+    pdu.add_option(coapp::Option::UriPath, { 'a', 'b', 'c' });
+    pdu.add_option(coapp::Option::Size1, std::vector<uint8_t>(300, 0x01));
+    pdu.set_payload("hello");
+
+    auto expected = pdu.to_bytes();
+    REQUIRE (pdu.encoded_size() == expected.size());
+
+    std::vector<uint8_t> buffer(expected.size() + 8, 0);
+    REQUIRE (pdu.serialize_into(buffer.data(), buffer.size()) == expected.size());
+    REQUIRE (std::equal(expected.begin(), expected.end(), buffer.begin()));
+
+    REQUIRE (pdu.serialize_into(buffer.data(), expected.size() - 1) == 0);
+}
+
+TEMPLATE_TEST_CASE( "PDUs should round-trip with any option storage", "[options]",
+                    coapp::pdu, coapp::flat_pdu ) {
+    std::vector<uint8_t> raw_pdu = {
+        0b01100000u,  // Ver: 1, Type: 2, TKL: 0
+
+        2,   // Code
+
+        1,0, // MID: 0000 0001 0000 0000 => 256
+
+        0b00010001, // Option delta = 1, Option length = 1
+        0xff,       // Option value = 0xff
+
+        0b00000001, // Option delta = 0, Option length = 1
+        0xfe,       // Option value = 0xfe
+
+        0b00110011,       // Option delta = 3, Option length = 3
+        0xff, 0xff, 0xff, // Option value = 0xff 0xff 0xff
+
+        0b11100011,       // Option delta = 14, Option length = 3
+        0xff, 0xff,       // Option delta - 269 = 65535 => Option delta = 65804
+        0xff, 0xff, 0xff, // Option value = 0xff 0xff 0xff
+
+        0xff, // Payload separator
+        0x42, 0x42, 0x42, 0x42 // Payload
+    };
+
+    auto pdu = TestType::from(raw_pdu);
+    auto& options = pdu.options();
+
+    REQUIRE (options.size() == 4);
+
+    auto opt_it = options.begin();
+
+    REQUIRE (opt_it->first == 1);
+    REQUIRE (opt_it->second == std::vector<uint8_t> { 0xff });
+
+    opt_it++;
+
+    REQUIRE (opt_it->first == 1);
+    REQUIRE (opt_it->second == std::vector<uint8_t> { 0xfe });
+
+    opt_it++;
+
+    REQUIRE (opt_it->first == 4);
+
+    opt_it++;
+
+    REQUIRE (opt_it->first == 65808);
+
+    REQUIRE (pdu.to_bytes() == raw_pdu);
+
+    TestType built;
+    built.set_type(coapp::Type::Acknowledgement);
+    built.set_code(coapp::Code::REQUEST_POST);
+    built.set_message_id(256);
+    built.add_option(65808, { 0xff, 0xff, 0xff });
+    built.add_option(1, { 0xff });
+    built.add_option(4, { 0xff, 0xff, 0xff });
+    built.add_option(1, { 0xfe });
+    built.set_payload("BBBB");
+
+    REQUIRE (built.to_bytes() == raw_pdu);
+}
+
+TEST_CASE( "Flat options should spill to the heap past their inline capacity", "[options]" ) {
+    coapp::basic_flat_options<2, 4> options;
+
+    uint8_t value[] = { 1, 2, 3 };
+    for (uint32_t n = 10; n > 0; n--)
+        options.emplace(n, value, n % 3 + 1);
+
+    REQUIRE (options.size() == 10);
+    REQUIRE (options.count(5) == 1);
+    REQUIRE (options.find(11) == options.end());
+
+    uint32_t expected = 1;
+    for (const auto& [number, v]: options) {
+        REQUIRE (number == expected);
+        REQUIRE (v.size() == number % 3 + 1);
+        REQUIRE (std::equal(v.begin(), v.end(), value));
+        expected++;
+    }
+
+    auto copy = options;
+    REQUIRE (options.erase(5) == 1);
+    REQUIRE (options.size() == 9);
+    REQUIRE (copy.size() == 10);
+    REQUIRE (copy.find(5)->second.size() == 3);
+
+    auto moved = std::move(copy);
+    REQUIRE (moved.size() == 10);
+    REQUIRE (moved.lower_bound(7)->first == 7);
+}
+
+TEST_CASE( "Flat options iterators should yield values that outlive them", "[options]" ) {
+    using iterator = coapp::flat_options::const_iterator;
+    static_assert(std::is_same_v<iterator::iterator_category, std::bidirectional_iterator_tag>);
+    static_assert(std::is_same_v<iterator::reference, coapp::flat_options::value_type>);
+
+    coapp::flat_options options;
+    uint8_t value[] = { 1, 2 };
+    options.emplace(1, value, 1);
+    options.emplace(2, value, 2);
+
+    // Nothing is stashed in the iterator, so values survive moving it
+    auto it = options.begin();
+    const auto first = *it++;
+    const auto second = *it;
+    REQUIRE (first.first == 1);
+    REQUIRE (first.second.size() == 1);
+    REQUIRE (second.first == 2);
+    REQUIRE (second.second.size() == 2);
+
+    std::vector<coapp::flat_options::value_type> all(options.begin(), options.end());
+    REQUIRE (all.size() == 2);
+    REQUIRE (all[1].first == 2);
+    REQUIRE (std::prev(options.end())->first == 2);
+}
+
+TEST_CASE( "Non-throwing parse should report why parsing failed", "[parse]" ) {
+    using coapp::parse_error;
+
+    auto error_of = [] (std::vector<uint8_t> raw_pdu) {
+        return coapp::pdu_view::try_from(raw_pdu).error();
+    };
+
+    REQUIRE (error_of({ 0b01000000u, 0, 0 }) == parse_error::truncated_header);
+    REQUIRE (error_of({ 0b11000000u, 0, 0, 0 }) == parse_error::bad_version);
+    REQUIRE (error_of({ 0b01001001u, 0, 0, 0 }) == parse_error::invalid_token_length);
+    REQUIRE (error_of({ 0b01000010u, 0, 0, 0, 0x01 }) == parse_error::truncated_token);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0b11110000 }) == parse_error::reserved_nibble);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0b00011111 }) == parse_error::reserved_nibble);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0b00010010, 0x01 }) == parse_error::option_overrun);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0b11010000 }) == parse_error::option_overrun);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0b00001110, 0x01 }) == parse_error::option_overrun);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0xff }) == parse_error::empty_payload);
+    REQUIRE (error_of({ 0b01000000u, 0, 0, 0, 0xff, 0x41 }) == parse_error::none);
+
+    std::vector<uint8_t> raw_pdu = { 0b01000000u, 0, 0, 0, 0xff };
+    auto result = coapp::pdu::try_from(raw_pdu);
+    REQUIRE_FALSE (result);
+    REQUIRE (result.error() == parse_error::empty_payload);
+
+    try {
+        coapp::pdu::from(raw_pdu);
+        FAIL( "empty payload should not parse" );
+    } catch (const coapp::invalid_pdu& e) {
+        REQUIRE (e.reason() == parse_error::empty_payload);
+    }
+
+    raw_pdu.push_back(0x41);
+    result = coapp::pdu::try_from(raw_pdu);
+    REQUIRE (result);
+    REQUIRE (result->payload() == "A");
+}
+
+TEST_CASE( "Standalone validation should agree with parsing", "[parse]" ) {
+    using coapp::parse_error;
+
+    // 0xFF inside option values must not be taken for the payload marker
+    coapp::pdu pdu;
+    pdu.set_code(coapp::Code::REQUEST_POST);
+    pdu.set_token({ 0xff, 0xff });
+    pdu.set<coapp::Option::IfMatch>(std::vector<uint8_t> { 0xff, 0xff, 0xff });
+    pdu.set<coapp::Option::UriPath>(std::string(200, '\xff'));
+    pdu.set_payload(std::string(300, '\xff'));
+
+    auto bytes = pdu.to_bytes();
+    REQUIRE (coapp::validate_pdu(bytes) == parse_error::none);
+
+    auto view = coapp::pdu_view::from(bytes);
+    REQUIRE (view.options().size() == 2);
+    REQUIRE (view.get<coapp::Option::UriPath>()->size() == 200);
+    REQUIRE (view.payload().size() == 300);
+
+    bytes.resize(bytes.size() - 302);
+    REQUIRE (coapp::validate_pdu(bytes) == parse_error::option_overrun);
+
+    static constexpr uint8_t empty_payload[] = { 0b01000000u, 0, 0, 0, 0xff };
+    static_assert(coapp::validate_pdu(empty_payload, sizeof(empty_payload)) == parse_error::empty_payload);
+}
+
+namespace {
+
+// Parses `bytes` from an exactly sized heap copy, so that reading past the
+// end is caught by sanitizers, and checks everything stays in bounds.
+void check_parse_in_bounds(const uint8_t* bytes, size_t size)
+{
+    std::unique_ptr<uint8_t[]> copy(new uint8_t[size ? size : 1]);
+    std::copy(bytes, bytes + size, copy.get());
+
+    const auto begin = copy.get();
+    const auto end = begin + size;
+
+    auto view = coapp::pdu_view::try_from(begin, size);
+    REQUIRE (coapp::validate_pdu(begin, size) == view.error());
+    if (!view)
+        return;
+
+    for (const auto& [number, value]: view->options()) {
+        REQUIRE (value.begin() >= begin);
+        REQUIRE (value.end() <= end);
+    }
+
+    auto payload = view->payload();
+    REQUIRE (reinterpret_cast<const uint8_t*>(payload.data() + payload.size()) == end);
+
+    auto encoded = view->to_pdu<coapp::flat_pdu>().to_bytes();
+    REQUIRE (encoded.size() == size);
+    REQUIRE (std::equal(encoded.begin(), encoded.end(), begin));
+}
+
+}
+
+TEST_CASE( "Option header decoder should never read past the buffer", "[fuzz]" ) {
+    // Every single option header byte, followed by every length of tail
+    for (unsigned header = 0; header < 0x100; header++) {
+        for (size_t tail = 0; tail <= 5; tail++) {
+            std::vector<uint8_t> raw_pdu = { 0b01000000u, 0, 0, 0, static_cast<uint8_t>(header) };
+            raw_pdu.insert(raw_pdu.end(), tail, 0x01);
+            check_parse_in_bounds(raw_pdu.data(), raw_pdu.size());
+        }
+    }
+
+    // xorshift, so failures reproduce
+    uint32_t state = 0x12345678;
+    auto next = [&] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+
+    std::vector<uint8_t> seed_pdu = {
+        0x62, 0x44, 0x12, 0x34, 0x00, 0x00, 0xb3, 'a', 'b', 'c',
+        0x0d, 0x01, '/', '/', '4', '9', '2', '4', '0', '3', '-', '-', '0', '9',
+        0xe1, 0x00, 0x10, '*', 0x31, 0x02, 0xff, 'd', 'a', 't', 'a'
+    };
+
+    for (int round = 0; round < 20000; round++) {
+        auto raw_pdu = seed_pdu;
+
+        auto mutations = 1 + next() % 4;
+        for (uint32_t m = 0; m < mutations; m++) {
+            auto pos = next() % raw_pdu.size();
+            switch (next() % 3) {
+            case 0: raw_pdu[pos] = next(); break;
+            case 1: raw_pdu[pos] ^= 1 << (next() % 8); break;
+            case 2: raw_pdu.resize(std::max<size_t>(pos, 4)); break;
+            }
+        }
+        raw_pdu[0] = (raw_pdu[0] & 0b00111111) | 0b01000000; // Keep version 1
+
+        check_parse_in_bounds(raw_pdu.data(), raw_pdu.size());
+    }
+
+    // Every prefix of a valid PDU
+    for (size_t size = 0; size <= seed_pdu.size(); size++)
+        check_parse_in_bounds(seed_pdu.data(), size);
+}
+
+TEST_CASE( "Batch decode should parse every datagram", "[view]" ) {
+    std::vector<std::vector<uint8_t>> datagrams = {
+        { 0b01000000u, 1, 0, 1, 0xb1, 'a' },        // CON GET /a
+        { 0b01000000u, 1, 0 },                      // Truncated header
+        { 0b01010001u, 1, 0, 3, 0x7f, 0xff, 'x' },  // NON GET with token and payload
+        { 0b01000000u, 1, 0, 4, 0xf0 },             // Reserved nibble
+    };
+
+    std::vector<coapp::bytes_view> batch(datagrams.begin(), datagrams.end());
+    coapp::pdu_view views[4];
+    coapp::parse_error errors[4];
+
+    REQUIRE (coapp::decode_batch(batch.data(), batch.size(), views, errors) == 2);
+
+    REQUIRE (errors[0] == coapp::parse_error::none);
+    REQUIRE (errors[1] == coapp::parse_error::truncated_header);
+    REQUIRE (errors[2] == coapp::parse_error::none);
+    REQUIRE (errors[3] == coapp::parse_error::reserved_nibble);
+
+    REQUIRE (views[0].message_id() == 1);
+    REQUIRE (views[0].options().begin()->first == coapp::Option::UriPath);
+    REQUIRE (views[2].type() == coapp::Type::NonConfirmable);
+    REQUIRE (views[2].token() == std::vector<uint8_t> { 0x7f });
+    REQUIRE (views[2].payload() == "x");
+}
+
+namespace {
+
+std::vector<uint8_t> gather(const iovec* iov, size_t count)
+{
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < count; i++) {
+        auto data = static_cast<const uint8_t*>(iov[i].iov_base);
+        bytes.insert(bytes.end(), data, data + iov[i].iov_len);
+    }
+    return bytes;
+}
+
+}
+
+TEST_CASE( "Batch encoder should patch message ID, token and Observe", "[batch]" ) {
+    auto make_notification = [] (bool etag, uint16_t mid, std::vector<uint8_t> token, uint32_t observe) {
+        coapp::pdu pdu;
+        pdu.set_type(coapp::Type::NonConfirmable);
+        pdu.set_code(coapp::Code::RESPONSE_CONTENT);
+        pdu.set_message_id(mid);
+        pdu.set_token(std::move(token));
+        if (etag)
+            pdu.add_option(coapp::Option::ETag, { 0x01, 0x02 });
+        std::vector<uint8_t> observe_value;
+        for (auto v = observe; v; v >>= 8)
+            observe_value.insert(observe_value.begin(), v & 0xff);
+        pdu.add_option(coapp::Option::Observe, observe_value);
+        pdu.add_option(coapp::Option::ContentFormat, { 50 });
+        pdu.add_option(coapp::Option::MaxAge, { 30 });
+        pdu.set_payload("{\"temperature\":21.5}");
+        return pdu;
+    };
+
+    for (bool etag: { false, true }) {
+        coapp::batch_encoder encoder(make_notification(etag, 0, {}, 0));
+        REQUIRE (encoder.has_observe());
+        REQUIRE (encoder.iovecs_per_message() == (etag ? 4 : 2));
+
+        std::vector<coapp::batch_encoder::recipient> recipients = {
+            { 0x0102, {}, 0 },
+            { 0xfffe, { nullptr, 0 }, 300 },
+            { 7, { reinterpret_cast<const uint8_t*>("abcdefgh"), 8 }, 0x123456 },
+        };
+
+        std::vector<coapp::batch_encoder::patch> patches(recipients.size());
+        std::vector<iovec> iovecs(recipients.size() * encoder.iovecs_per_message());
+        std::vector<mmsghdr> messages(recipients.size());
+        encoder.encode(recipients.data(), recipients.size(), patches.data(), iovecs.data(), messages.data());
+
+        for (size_t i = 0; i < recipients.size(); i++) {
+            const auto& r = recipients[i];
+            auto expected = make_notification(etag, r.message_id,
+                                              { r.token.begin(), r.token.end() }, r.observe).to_bytes();
+
+            const auto& hdr = messages[i].msg_hdr;
+            REQUIRE (gather(hdr.msg_iov, hdr.msg_iovlen) == expected);
+            REQUIRE (encoder.message_size(r.token.size(), r.observe) == expected.size());
+        }
+
+        // Observe values wrap at 24 bits in both the size and the encoding
+        for (uint32_t observe : { 0xffffffu, 0x1000000u, 0x1000001u }) {
+            coapp::batch_encoder::patch patch;
+            iovec iov[coapp::batch_encoder::max_iovecs];
+            auto count = encoder.encode({ 1, {}, observe }, patch, iov);
+            auto encoded = gather(iov, count);
+            REQUIRE (encoder.message_size(0, observe) == encoded.size());
+            REQUIRE (encoded == make_notification(etag, 1, {}, observe & 0xffffff).to_bytes());
+        }
+    }
+}
+
+TEST_CASE( "Batch encoder should handle templates without Observe", "[batch]" ) {
+    coapp::pdu pdu;
+    pdu.set_type(coapp::Type::Confirmable);
+    pdu.set_code(coapp::Code::REQUEST_GET);
+    pdu.add_option(coapp::Option::UriPath, { 'a' });
+
+    coapp::batch_encoder encoder(pdu);
+    REQUIRE_FALSE (encoder.has_observe());
+
+    coapp::batch_encoder::patch patch;
+    iovec iov[coapp::batch_encoder::max_iovecs];
+    auto count = encoder.encode({ 42, {}, 99 }, patch, iov);
+
+    pdu.set_message_id(42);
+    REQUIRE (gather(iov, count) == pdu.to_bytes());
+}
+
+TEST_CASE( "PDU templates should stamp fixed-shape messages", "[template]" ) {
+    static constexpr uint8_t etag[] = { 'v', '1' };
+    static constexpr auto content = coapp::pdu_template(coapp::Type::Acknowledgement, coapp::Code::RESPONSE_CONTENT)
+        .with<coapp::Option::ETag>({ etag, sizeof(etag) })
+        .with<coapp::Option::ContentFormat>(50)
+        .with<coapp::Option::MaxAge>(3600);
+    static_assert(content.options().size() == 8);
+
+    coapp::pdu expected;
+    expected.set_type(coapp::Type::Acknowledgement);
+    expected.set_code(coapp::Code::RESPONSE_CONTENT);
+    expected.set_message_id(0xbeef);
+    expected.set_token({ 1, 2, 3 });
+    expected.set<coapp::Option::ETag>({ etag, sizeof(etag) });
+    expected.set<coapp::Option::ContentFormat>(50);
+    expected.set<coapp::Option::MaxAge>(3600);
+    expected.set_payload("{}");
+
+    uint8_t token[] = { 1, 2, 3 };
+    uint8_t buffer[64];
+    auto size = content.stamp(buffer, sizeof(buffer), 0xbeef, { token, sizeof(token) }, "{}");
+    REQUIRE (size == content.encoded_size(3, 2));
+    REQUIRE (coapp::bytes_view(buffer, size) == expected.to_bytes());
+
+    auto request_bytes = expected.to_bytes();
+    auto request = coapp::pdu_view::from(request_bytes);
+    REQUIRE (content.stamp(buffer, sizeof(buffer), request, "{}") == size);
+    REQUIRE (coapp::bytes_view(buffer, size) == expected.to_bytes());
+    REQUIRE (content.stamp(buffer, size - 1, request, "{}") == 0);
+
+    // Empty ACK without options or payload
+    static constexpr auto ack = coapp::pdu_template(coapp::Type::Acknowledgement, coapp::Code::Empty);
+    REQUIRE (ack.stamp(buffer, sizeof(buffer), 0x1234, {}) == 4);
+    REQUIRE (buffer[0] == 0x60);
+    REQUIRE (buffer[1] == 0);
+    REQUIRE (buffer[2] == 0x12);
+    REQUIRE (buffer[3] == 0x34);
+
+    // Empty messages never take the request's token (RFC 7252 section 4.1)
+    uint8_t long_token[] = { 9, 8, 7, 6 };
+    expected.set_token({ long_token, sizeof(long_token) });
+    auto tokened_bytes = expected.to_bytes();
+    auto tokened = coapp::pdu_view::from(tokened_bytes);
+    REQUIRE (ack.stamp(buffer, sizeof(buffer), tokened) == 4);
+    REQUIRE (buffer[0] == 0x60);
+    REQUIRE (buffer[2] == 0xbe);
+    REQUIRE (buffer[3] == 0xef);
+    REQUIRE (ack.encoded_size(0) == 4);
+    REQUIRE_THROWS_AS (ack.stamp(buffer, sizeof(buffer), tokened, "x"), coapp::invalid_pdu);
+    REQUIRE_THROWS_AS (ack.stamp(buffer, sizeof(buffer), 1, { token, sizeof(token) }), coapp::invalid_pdu);
+    REQUIRE_THROWS_AS (ack.with<coapp::Option::MaxAge>(1), std::invalid_argument);
+
+    static constexpr uint8_t long_etag[9] = {};
+    REQUIRE_THROWS_AS (content.with<coapp::Option::ETag>({ etag, sizeof(etag) }), std::invalid_argument);
+    REQUIRE_THROWS_AS (content.with<coapp::Option::IfNoneMatch>(true), std::invalid_argument);
+    REQUIRE_THROWS_AS ((coapp::pdu_template(coapp::Type::Acknowledgement, coapp::Code::RESPONSE_CONTENT)
+                        .with<coapp::Option::ETag>({ long_etag, sizeof(long_etag) })), std::invalid_argument);
+    REQUIRE_THROWS_AS ((coapp::pdu_template<4>(coapp::Type::Confirmable, coapp::Code::REQUEST_GET)
+                        .with<coapp::Option::UriHost>(std::string_view("example.com"))), std::length_error);
+}
+
+TEST_CASE( "PDU editor should rewrite a forwarded request in place", "[editor]" ) {
+    coapp::pdu request;
+    request.set_code(coapp::Code::REQUEST_GET);
+    request.set_message_id(0x1111);
+    request.set_token({ 1, 2 });
+    request.set<coapp::Option::UriHost>("proxy.local");
+    request.add<coapp::Option::UriPath>("sensors");
+    request.add<coapp::Option::UriPath>("temp");
+    request.set<coapp::Option::Accept>(50);
+
+    uint8_t buffer[256];
+    auto bytes = request.to_bytes();
+    std::copy(bytes.begin(), bytes.end(), buffer);
+
+    coapp::pdu_editor editor(buffer, bytes.size(), sizeof(buffer));
+    editor.set_message_id(0x2222);
+    REQUIRE (editor.set<coapp::Option::UriHost>("backend.example.com"));
+    REQUIRE (editor.set<coapp::Option::UriPort>(5684));
+    REQUIRE (editor.set_token({ buffer + 4, 0 }));
+    REQUIRE (editor.remove<coapp::Option::Accept>() == 1);
+    REQUIRE (editor.remove<coapp::Option::Accept>() == 0);
+
+    request.set_message_id(0x2222);
+    request.set<coapp::Option::UriHost>("backend.example.com");
+    request.set<coapp::Option::UriPort>(5684);
+    request.set_token({});
+    request.remove<coapp::Option::Accept>();
+    REQUIRE (editor.bytes() == request.to_bytes());
+
+    auto view = editor.view();
+    REQUIRE (view.get<coapp::Option::UriHost>() == "backend.example.com");
+    REQUIRE (view.get_all<coapp::Option::UriPath>().size() == 2);
+
+    // Edits that don't fit leave the PDU untouched
+    coapp::pdu_editor tight(buffer, editor.size(), editor.size() + 2);
+    REQUIRE_FALSE (tight.set_payload("too long"));
+    REQUIRE (tight.bytes() == request.to_bytes());
+    REQUIRE (tight.set<coapp::Option::UriHost>("backend.example.co"));
+    REQUIRE (tight.set_payload("A"));
+    REQUIRE (tight.payload() == coapp::bytes_view(reinterpret_cast<const uint8_t*>("A"), 1));
+
+    uint8_t invalid[] = { 0b01000000u, 0, 0, 0, 0xff };
+    REQUIRE_THROWS_AS (coapp::pdu_editor(invalid, sizeof(invalid), sizeof(invalid)), coapp::invalid_pdu);
+}
+
+TEST_CASE( "PDU editor should take values from the PDU it edits", "[editor]" ) {
+    coapp::pdu request;
+    request.set_token({ 1, 2, 3, 4 });
+    request.set<coapp::Option::UriHost>("proxy.example.com");
+    request.add<coapp::Option::UriPath>("sensors");
+    request.set_payload("hello world");
+
+    uint8_t buffer[256];
+    auto bytes = request.to_bytes();
+    std::copy(bytes.begin(), bytes.end(), buffer);
+    coapp::pdu_editor editor(buffer, bytes.size(), sizeof(buffer));
+
+    // Each value lies in the range its own edit moves
+    auto host = *editor.view().get<coapp::Option::UriHost>();
+    REQUIRE (editor.add_option(uint32_t(coapp::Option::UriHost), coapp::detail::as_bytes_view(host)));
+    REQUIRE (editor.set_token({ editor.payload().data() + 2, 3 }));
+    REQUIRE (editor.set_payload({ editor.payload().data() + 6, 5 }));
+
+    request.add<coapp::Option::UriHost>("proxy.example.com");
+    request.set_token({ 'l', 'l', 'o' });
+    request.set_payload("world");
+    REQUIRE (editor.bytes() == request.to_bytes());
+}
+
+TEST_CASE( "PDU editor should match re-encoding after random edits", "[editor]" ) {
+    // Option numbers around the 13 and 269 delta boundaries
+    const uint32_t numbers[] = { 1, 3, 4, 11, 12, 14, 15, 28, 60, 280, 300, 2000 };
+
+    std::mt19937 random(42);
+    for (int round = 0; round < 200; round++) {
+        std::multimap<uint32_t, std::vector<uint8_t>> options;
+        std::vector<uint8_t> token;
+        std::vector<uint8_t> payload;
+
+        auto encode = [&] {
+            coapp::pdu pdu;
+            pdu.set_token(token);
+            for (const auto& [number, value]: options)
+                pdu.add_option(number, value);
+            pdu.set_payload(std::string(payload.begin(), payload.end()));
+            return pdu.to_bytes();
+        };
+
+        uint8_t buffer[8192];
+        auto initial = encode();
+        std::copy(initial.begin(), initial.end(), buffer);
+        coapp::pdu_editor editor(buffer, initial.size(), sizeof(buffer));
+
+        for (int edit = 0; edit < 20; edit++) {
+            auto number = numbers[random() % std::size(numbers)];
+            std::vector<uint8_t> value(random() % 3 ? random() % 8 : random() % 300);
+            for (auto& byte: value)
+                byte = random();
+
+            switch (random() % 5) {
+            case 0:
+                REQUIRE (editor.add_option(number, value));
+                options.emplace(number, value);
+                break;
+            case 1:
+                REQUIRE (editor.set_option(number, value));
+                options.erase(number);
+                options.emplace(number, value);
+                break;
+            case 2:
+                REQUIRE (editor.remove_option(number) == options.erase(number));
+                break;
+            case 3:
+                value.resize(value.size() % 9);
+                REQUIRE (editor.set_token(value));
+                token = value;
+                break;
+            default:
+                REQUIRE (editor.set_payload(value));
+                payload = value;
+                break;
+            }
+
+            REQUIRE (editor.bytes() == encode());
+        }
+    }
+}
+
+TEST_CASE( "Lazy PDUs should locate options on first access", "[lazy]" ) {
+    coapp::pdu response;
+    response.set_type(coapp::Type::Acknowledgement);
+    response.set_code(coapp::Code::RESPONSE_CONTENT);
+    response.set_message_id(0x4321);
+    response.set_token({ 7, 8, 9 });
+    response.set<coapp::Option::ContentFormat>(50);
+    response.set<coapp::Option::MaxAge>(60);
+    response.set_payload("{}");
+
+    auto pdu = coapp::lazy_pdu::from(response.to_bytes());
+    REQUIRE (pdu.type() == coapp::Type::Acknowledgement);
+    REQUIRE (pdu.code() == coapp::Code::RESPONSE_CONTENT);
+    REQUIRE (pdu.message_id() == 0x4321);
+    REQUIRE (pdu.token() == coapp::bytes_view(response.token().data(), 3));
+    REQUIRE_FALSE (pdu.decoded());
+
+    REQUIRE (pdu.get<coapp::Option::MaxAge>() == 60u);
+    REQUIRE (pdu.decoded());
+    REQUIRE (pdu.options().size() == 2);
+    REQUIRE (pdu.payload() == "{}");
+
+    auto moved = std::move(pdu);
+    REQUIRE (moved.decoded());
+    REQUIRE (moved.get<coapp::Option::ContentFormat>() == 50u);
+
+    auto copy = moved;
+    REQUIRE_FALSE (copy.decoded());
+    REQUIRE (copy.to_pdu<coapp::flat_pdu>().to_bytes() == response.to_bytes());
+
+    // Only the header is checked up front
+    auto bytes = response.to_bytes();
+    bytes.resize(bytes.size() - 4);
+    auto truncated = coapp::lazy_pdu::from(bytes);
+    REQUIRE (truncated.code() == coapp::Code::RESPONSE_CONTENT);
+    REQUIRE (truncated.error() == coapp::parse_error::option_overrun);
+    REQUIRE_THROWS_AS (truncated.options(), coapp::invalid_pdu);
+
+    REQUIRE (coapp::lazy_pdu::try_from({ 0b01000100u, 0, 0, 0, 1 }).error() == coapp::parse_error::truncated_token);
+    REQUIRE_THROWS_AS (coapp::lazy_pdu::from({ 0b01000000u, 0 }), coapp::invalid_pdu);
+}
+
+TEST_CASE( "Rvalue PDUs should encode into their own buffers", "[build]" ) {
+    coapp::pdu pdu;
+    pdu.set_code(coapp::Code::REQUEST_PUT);
+    pdu.set_token({ 1, 2, 3, 4 });
+    pdu.emplace_option(coapp::Option::UriPath, reinterpret_cast<const uint8_t*>("abc"), 3);
+
+    std::vector<uint8_t> body(200, 0x42);
+    body.reserve(512);
+    auto body_data = body.data();
+    pdu.add_option(coapp::Option::IfMatch, { 0x01 });
+    pdu.add_option(coapp::Option::ETag, std::move(body));
+    pdu.set<coapp::Option::ContentFormat>(42);
+    pdu.set_payload("payload");
+
+    auto expected = pdu.to_bytes();
+    REQUIRE (coapp::pdu::from(expected.data(), expected.size()).to_bytes() == expected);
+    REQUIRE (coapp::pdu::try_from(expected.data(), 3).error() == coapp::parse_error::truncated_header);
+
+    auto copy = pdu;
+    auto bytes = std::move(pdu).to_bytes();
+    REQUIRE (bytes == expected);
+    REQUIRE (bytes.data() == body_data);
+
+    // Without a large enough buffer, a new one is allocated
+    copy.remove<coapp::Option::ETag>();
+    copy.add_option(coapp::Option::ETag, { 0x05 });
+    auto copied = copy;
+    REQUIRE (std::move(copy).to_bytes() == copied.to_bytes());
+}
+
+TEST_CASE( "PMR PDUs should allocate from their memory resource", "[pmr]" ) {
+    std::vector<uint8_t> raw_pdu = {
+        0b01000010u, 1, 0x12, 0x34, // Ver: 1, Type: 0, TKL: 2, GET, MID: 0x1234
+        0xaa, 0xbb,                 // Token
+        0xb5, 's', 'e', 'n', 's', 'e',
+        0x04, 't', 'e', 'm', 'p',
+        0xff,
+        'a', 'l', 'l', 'o', 'c', 'a', 't', 'e', 'd', ' ', 'f', 'r', 'o', 'm', ' ',
+        't', 'h', 'e', ' ', 'a', 'r', 'e', 'n', 'a'
+    };
+
+    // Any allocation outside the buffer would throw
+    std::byte buffer[2048];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+    auto pdu = coapp::pmr::pdu::from(raw_pdu, &arena);
+
+    REQUIRE (pdu.options().get_allocator().resource() == &arena);
+    REQUIRE (pdu.options().begin()->second.get_allocator().resource() == &arena);
+    REQUIRE (pdu.options().size() == 2);
+    REQUIRE (pdu.payload() == "allocated from the arena");
+    REQUIRE (pdu.to_bytes() == raw_pdu);
+
+    coapp::pmr::pdu built(&arena);
+    built.set_message_id(0x1234);
+    built.add_option(coapp::Option::UriPath, { 'a' });
+    REQUIRE (built.options().begin()->second.get_allocator().resource() == &arena);
+}
+
+TEST_CASE( "Tokens should be stored inline", "[token]" ) {
+    coapp::inline_token token = { 0x01, 0x02, 0x03 };
+
+    REQUIRE (token.size() == 3);
+    REQUIRE (token == std::vector<uint8_t> { 0x01, 0x02, 0x03 });
+    REQUIRE (token != std::vector<uint8_t> { 0x01, 0x02 });
+    REQUIRE (token == coapp::inline_token { 0x01, 0x02, 0x03 });
+    REQUIRE (token != coapp::inline_token { 0x01, 0x02, 0x03, 0x00 });
+    REQUIRE (coapp::inline_token {} != coapp::inline_token { 0x00 });
+
+    std::hash<coapp::inline_token> hash;
+    REQUIRE (hash(token) == hash(coapp::inline_token { 0x01, 0x02, 0x03 }));
+    REQUIRE (hash(coapp::inline_token {}) != hash(coapp::inline_token { 0x00 }));
+
+    REQUIRE_THROWS ( coapp::inline_token { 1, 2, 3, 4, 5, 6, 7, 8, 9 } );
+
+    coapp::pdu pdu;
+    pdu.set_token(std::vector<uint8_t> { 0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef });
+    REQUIRE (pdu.token().size() == 8);
+    REQUIRE_THROWS ( pdu.set_token(std::vector<uint8_t>(9)) );
+    static_assert(std::is_same_v<coapp::pdu::token_t, coapp::inline_token>);
+}
+
+TEST_CASE( "Small option values should be stored inline", "[options]" ) {
+    using small_pdu = coapp::basic_pdu<std::multimap<uint32_t, coapp::option_value>>;
+
+    std::vector<uint8_t> long_segment(40, 'x');
+
+    small_pdu pdu;
+    pdu.add_option(coapp::Option::ContentFormat, { 50 });
+    pdu.add_option(coapp::Option::UriPath, long_segment);
+
+    auto parsed = small_pdu::from(pdu.to_bytes());
+    auto opt_it = parsed.options().begin();
+
+    REQUIRE (opt_it->first == coapp::Option::UriPath);
+    REQUIRE (opt_it->second == long_segment);
+    REQUIRE_FALSE (opt_it->second.is_inline());
+
+    opt_it++;
+
+    REQUIRE (opt_it->first == coapp::Option::ContentFormat);
+    REQUIRE (opt_it->second == std::vector<uint8_t> { 50 });
+    REQUIRE (opt_it->second.is_inline());
+
+    coapp::flat_pdu flat;
+    flat.add_option(coapp::Option::UriPath, long_segment);
+    flat.add_option(coapp::Option::MaxAge, { 60 });
+    REQUIRE (flat.options().size() == 2);
+}
+
+TEST_CASE( "Borrowed PDUs should reference the source payload", "[view]" ) {
+    std::vector<uint8_t> raw_pdu = {
+        0b01000000u, 0x45, 0, 1,  // 2.05 Content
+        0xc1, 0x00,               // Content-Format: text/plain
+        0xff, 'h', 'e', 'l', 'l', 'o'
+    };
+
+    auto pdu = coapp::borrowed_pdu::try_from(raw_pdu).value();
+    REQUIRE (pdu.payload() == "hello");
+    REQUIRE (pdu.payload().data() == reinterpret_cast<const char*>(raw_pdu.data()) + 7);
+    REQUIRE (pdu.to_bytes() == raw_pdu);
+}
+
+TEMPLATE_TEST_CASE( "Typed option accessors should decode values", "[options]",
+                    coapp::pdu, coapp::flat_pdu, coapp::pmr::pdu ) {
+    using coapp::Option;
+
+    TestType pdu;
+    pdu.template set<Option::ContentFormat>(50);
+    pdu.template set<Option::MaxAge>(0x12345678);
+    pdu.template set<Option::Observe>(0);
+    pdu.template add<Option::UriPath>("sensors");
+    pdu.template add<Option::UriPath>("temp");
+    pdu.template set<Option::IfNoneMatch>(true);
+    pdu.add_option(Option::Accept, { 1, 2, 3 }); // Too long for Accept
+
+    REQUIRE (pdu.template get<Option::ContentFormat>() == 50u);
+    REQUIRE (pdu.template get<Option::MaxAge>() == 0x12345678u);
+    REQUIRE (pdu.template get<Option::Observe>() == 0u);
+    REQUIRE (pdu.template has<Option::IfNoneMatch>());
+    REQUIRE_FALSE (pdu.template get<Option::Size1>());
+    REQUIRE_FALSE (pdu.template get<Option::Accept>());
+
+    auto path = pdu.template get_all<Option::UriPath>();
+    REQUIRE (path.size() == 2);
+    REQUIRE (std::vector<std::string_view>(path.begin(), path.end())
+             == std::vector<std::string_view> { "sensors", "temp" });
+
+    pdu.template set<Option::ContentFormat>(0);
+    REQUIRE (pdu.options().count(Option::ContentFormat) == 1);
+    REQUIRE (pdu.template get<Option::ContentFormat>() == 0u);
+
+    pdu.template remove<Option::UriPath>();
+    REQUIRE (pdu.template get_all<Option::UriPath>().empty());
+
+    std::vector<uint8_t> bytes = pdu.to_bytes();
+    coapp::pdu_view view = coapp::pdu_view::from(bytes);
+    REQUIRE (view.get<Option::MaxAge>() == 0x12345678u);
+    REQUIRE (view.get<Option::ContentFormat>() == 0u);
+    REQUIRE (view.has<Option::IfNoneMatch>());
+    REQUIRE_FALSE (view.has<Option::UriPath>());
+
+    static_assert(coapp::option_traits<Option::UriPath>::repeatable);
+    static_assert(coapp::option_traits<Option::UriHost>::critical);
+    static_assert(!coapp::option_traits<Option::MaxAge>::critical);
+    static_assert(coapp::option_traits<Option::Block2>::format == coapp::option_format::uint);
+}
+
+TEST_CASE( "Uri-Path hash should match the joined path", "[routing]" ) {
+    using coapp::Option;
+
+    static_assert(coapp::uri_path_hash("/sensors/temp") == coapp::uri_path_hash("sensors/temp"));
+    static_assert(coapp::uri_path_hash("/") == coapp::uri_path_hash(""));
+    static_assert(coapp::uri_path_hash("/a/b") != coapp::uri_path_hash("/ab"));
+    static_assert(coapp::uri_path_hash("/a/") != coapp::uri_path_hash("/a"));
+
+    coapp::pdu pdu;
+    pdu.set<Option::UriHost>("example.com");
+    pdu.add<Option::UriPath>("sensors");
+    pdu.add<Option::UriPath>("temp");
+    pdu.add<Option::UriQuery>("unit=c");
+    pdu.add<Option::UriQuery>("precise");
+
+    REQUIRE (pdu.uri_path_hash() == coapp::uri_path_hash("/sensors/temp"));
+    REQUIRE (pdu.uri_query_hash() == coapp::uri_query_hash("?unit=c&precise"));
+    REQUIRE (coapp::pdu().uri_path_hash() == coapp::uri_path_hash("/"));
+
+    auto bytes = pdu.to_bytes();
+    auto flags = coapp::parse_flags::hash_uri_path | coapp::parse_flags::hash_uri_query;
+
+    auto view = coapp::pdu_view::from(bytes, flags);
+    REQUIRE (view.uri_path_hash() == coapp::uri_path_hash("/sensors/temp"));
+    REQUIRE (view.uri_query_hash() == coapp::uri_query_hash("unit=c&precise"));
+
+    auto lazy = coapp::pdu_view::from(bytes);
+    REQUIRE (lazy.uri_path_hash() == view.uri_path_hash());
+    REQUIRE (lazy.uri_query_hash() == view.uri_query_hash());
+}
+
+namespace {
+
+constexpr coapp::route test_routes[] = {
+    { coapp::Method::GET,    "/" },
+    { coapp::Method::GET,    "/sensors/temp" },
+    { coapp::Method::PUT,    "/sensors/temp" },
+    { coapp::Method::GET,    "/sensors/humidity" },
+    { coapp::Method::POST,   "/actuators/led" },
+    { coapp::Method::DELETE, "/actuators/led/" },
+    { coapp::Method::GET,    "/.well-known/core" },
+};
+
+constexpr coapp::static_router test_router(test_routes);
+
+// 200 generated routes, "/r/000" to "/r/199"
+struct generated_paths
+{
+    char paths[200][7] {};
+
+    constexpr generated_paths()
+    {
+        for (int i = 0; i < 200; i++) {
+            const char path[7] = { '/', 'r', '/', char('0' + i / 100), char('0' + i / 10 % 10), char('0' + i % 10), 0 };
+            for (int c = 0; c < 7; c++)
+                paths[i][c] = path[c];
+        }
+    }
+};
+
+constexpr generated_paths many_paths;
+
+struct generated_routes
+{
+    coapp::route routes[200] {};
+
+    constexpr generated_routes()
+    {
+        for (int i = 0; i < 200; i++)
+            routes[i] = { coapp::Method::GET, { many_paths.paths[i], 6 } };
+    }
+};
+
+constexpr generated_routes many_routes;
+
+template <typename Pdu = coapp::pdu>
+Pdu make_request(coapp::Code method, std::vector<std::string_view> segments)
+{
+    Pdu pdu;
+    pdu.set_code(method);
+    for (auto segment: segments)
+        pdu.template add<coapp::Option::UriPath>(segment);
+    return pdu;
+}
+
+}
+
+TEST_CASE( "Static router should match routes by method and path", "[routing]" ) {
+    using coapp::Code;
+
+    REQUIRE (test_router.match(make_request(Code::REQUEST_GET, {})).index == 0);
+    REQUIRE (test_router.match(make_request(Code::REQUEST_GET, { "sensors", "temp" })).index == 1);
+    REQUIRE (test_router.match(make_request(Code::REQUEST_PUT, { "sensors", "temp" })).index == 2);
+    REQUIRE (test_router.match(make_request(Code::REQUEST_GET, { "sensors", "humidity" })).index == 3);
+    REQUIRE (test_router.match(make_request(Code::REQUEST_POST, { "actuators", "led" })).index == 4);
+    REQUIRE (test_router.match(make_request(Code::REQUEST_DELETE, { "actuators", "led", "" })).index == 5);
+    REQUIRE (test_router.match(make_request(Code::REQUEST_GET, { ".well-known", "core" })).index == 6);
+
+    auto not_allowed = test_router.match(make_request(Code::REQUEST_DELETE, { "sensors", "temp" }));
+    REQUIRE_FALSE (not_allowed);
+    REQUIRE (not_allowed.path_found);
+
+    auto not_found = test_router.match(make_request(Code::REQUEST_GET, { "sensors" }));
+    REQUIRE_FALSE (not_found);
+    REQUIRE_FALSE (not_found.path_found);
+
+    REQUIRE_FALSE (test_router.match(make_request(Code::REQUEST_GET, { "sensors", "temp", "x" })));
+    REQUIRE (test_router.match(make_request(Code::REQUEST_GET, { "actuators", "led", "" })).path_found);
+    REQUIRE_FALSE (test_router.match(make_request(Code::RESPONSE_CONTENT, { "sensors", "temp" })));
+
+    // Straight from the wire, with the hash computed during parsing
+    auto bytes = make_request(Code::REQUEST_PUT, { "sensors", "temp" }).to_bytes();
+    auto view = coapp::pdu_view::from(bytes, coapp::parse_flags::hash_uri_path);
+    REQUIRE (test_router.match(view).index == 2);
+}
+
+TEST_CASE( "Static router should build a perfect hash for many routes", "[routing]" ) {
+    static constexpr coapp::static_router router(many_routes.routes);
+    static_assert(router.size() == 200);
+
+    for (int i = 0; i < 200; i++) {
+        std::string_view segment(many_paths.paths[i] + 3, 3);
+        REQUIRE (router.match(make_request<coapp::flat_pdu>(coapp::Code::REQUEST_GET, { "r", segment })).index == size_t(i));
+    }
+    REQUIRE_FALSE (router.match(make_request(coapp::Code::REQUEST_GET, { "r", "200" })));
+}
+
+TEST_CASE( "Dedup cache should detect duplicates until they expire", "[dedup]" ) {
+    using namespace std::chrono_literals;
+    using status = coapp::dedup_cache::status;
+
+    coapp::dedup_cache cache(64, 32, 160s, 16);
+    coapp::dedup_cache::clock::time_point now {};
+
+    REQUIRE (cache.check(1, 0x1234, now).status == status::new_message);
+    REQUIRE (cache.check(1, 0x1234, now).status == status::duplicate);
+    REQUIRE (cache.check(2, 0x1234, now).status == status::new_message);
+    REQUIRE (cache.check(1, 0x1235, now).status == status::new_message);
+
+    std::vector<uint8_t> response = { 0x60, 0x45, 0x12, 0x34 };
+    REQUIRE (cache.store_response(1, 0x1234, response, now + 1s));
+    REQUIRE_FALSE (cache.store_response(1, 0x9999, response, now + 1s));
+    REQUIRE_FALSE (cache.store_response(1, 0x1234, std::vector<uint8_t>(33), now + 1s));
+
+    auto duplicate = cache.check(1, 0x1234, now + 100s);
+    REQUIRE (duplicate.status == status::duplicate_response);
+    REQUIRE (duplicate.response == response);
+
+    // Still recorded for the whole lifetime, gone one bucket after it
+    REQUIRE (cache.contains(1, 0x1234, now + 160s));
+    REQUIRE_FALSE (cache.contains(1, 0x1234, now + 170s));
+    REQUIRE (cache.check(1, 0x1234, now + 170s).status == status::new_message);
+}
+
+TEST_CASE( "Dedup cache should stay within its fixed capacity", "[dedup]" ) {
+    using status = coapp::dedup_cache::status;
+
+    coapp::dedup_cache cache(16, 0);
+    coapp::dedup_cache::clock::time_point now {};
+    REQUIRE (cache.capacity() == 16);
+
+    // Older entries are evicted when the table is full
+    for (uint16_t mid = 0; mid < 1000; mid++)
+        REQUIRE (cache.check(7, mid, now).status == status::new_message);
+
+    size_t recorded = 0;
+    for (uint16_t mid = 0; mid < 1000; mid++)
+        recorded += cache.contains(7, mid, now);
+    REQUIRE (recorded <= 16);
+    REQUIRE (cache.contains(7, 999, now));
+}
+
+TEST_CASE( "Dedup cache should clamp the response size to 16 bits", "[dedup]" ) {
+    using status = coapp::dedup_cache::status;
+
+    coapp::dedup_cache cache(8, 100000);
+    coapp::dedup_cache::clock::time_point now {};
+    const std::vector<uint8_t> large(0xffff, 0x42);
+
+    REQUIRE (cache.check(1, 1, now).status == status::new_message);
+    REQUIRE_FALSE (cache.store_response(1, 1, coapp::bytes_view(large.data(), large.size()), now));
+    REQUIRE (cache.check(1, 1, now).status == status::duplicate);
+
+    REQUIRE (cache.store_response(1, 1, coapp::bytes_view(large.data(), large.size() - 1), now));
+    auto seen = cache.check(1, 1, now);
+    REQUIRE (seen.status == status::duplicate_response);
+    REQUIRE (seen.response.size() == 0xfffe);
+}
+
+TEST_CASE( "Dedup cache should take at least one bucket", "[dedup]" ) {
+    using namespace std::chrono_literals;
+    using status = coapp::dedup_cache::status;
+
+    coapp::dedup_cache cache(8, 32, 10s, 0);
+    coapp::dedup_cache::clock::time_point now {};
+
+    REQUIRE (cache.check(1, 1, now).status == status::new_message);
+    REQUIRE (cache.check(1, 1, now + 5s).status == status::duplicate);
+    REQUIRE_FALSE (cache.contains(1, 1, now + 30s));
+}
+
+TEST_CASE( "Token generator should not repeat tokens", "[exchange]" ) {
+    coapp::token_generator a(1, 0x0123456789abcdefull);
+    coapp::token_generator b(2, 0x0123456789abcdefull);
+
+    std::unordered_set<coapp::inline_token> seen;
+    for (int i = 0; i < 50000; i++) {
+        REQUIRE (seen.insert(a.next()).second);
+        REQUIRE (seen.insert(b.next()).second);
+    }
+
+    coapp::token_generator short_tokens(3, 42);
+    std::unordered_set<coapp::inline_token> seen_short;
+    for (int i = 0; i < 256; i++) {
+        auto token = short_tokens.next(3);
+        REQUIRE (token.size() == 3);
+        REQUIRE (seen_short.insert(token).second);
+    }
+
+    REQUIRE (coapp::token_generator::this_thread().next() != coapp::token_generator::this_thread().next());
+}
+
+TEST_CASE( "Token generators with distinct ids should never collide", "[exchange]" ) {
+    // Keys differ too, as for the per-thread generators
+    coapp::token_generator a(1, 0x0123456789abcdefull);
+    coapp::token_generator b(2, 0xfedcba9876543210ull);
+
+    for (size_t length : { 3, 8 }) {
+        std::unordered_set<coapp::inline_token> from_a;
+        for (int i = 0; i < 256; i++)
+            from_a.insert(a.next(length));
+        for (int i = 0; i < 256; i++)
+            REQUIRE_FALSE (from_a.count(b.next(length)));
+    }
+}
+
+TEST_CASE( "Exchange table should match responses by endpoint and token", "[exchange]" ) {
+    using namespace std::chrono_literals;
+
+    coapp::exchange_table<int> table(1000);
+    coapp::exchange_table<int>::clock::time_point now {};
+    coapp::token_generator tokens(0, 7);
+
+    std::vector<coapp::inline_token> issued;
+    for (int i = 0; i < 1000; i++) {
+        issued.push_back(tokens.next(4));
+        REQUIRE (table.insert(i % 3, issued.back(), now + 10s, i) != nullptr);
+    }
+
+    REQUIRE (table.size() == 1000);
+    REQUIRE (table.insert(0, tokens.next(), now + 10s, -1) == nullptr); // Full
+    REQUIRE (table.find(1, issued[0]) == nullptr); // Wrong endpoint
+
+    for (int i = 0; i < 1000; i += 2) {
+        auto value = table.take(i % 3, issued[i]);
+        REQUIRE (value == i);
+    }
+    REQUIRE (table.size() == 500);
+
+    for (int i = 1; i < 1000; i += 2)
+        REQUIRE (*table.find(i % 3, issued[i]) == i);
+
+    REQUIRE (table.insert(1, issued[1], now + 10s, 0) == nullptr); // Outstanding
+    REQUIRE (table.erase(1, issued[1]));
+    REQUIRE_FALSE (table.erase(1, issued[1]));
+}
+
+TEST_CASE( "Exchange table should expire exchanges past their deadline", "[exchange]" ) {
+    using namespace std::chrono_literals;
+
+    coapp::exchange_table<std::string> table(16, 100ms, 8);
+    coapp::exchange_table<std::string>::clock::time_point now {};
+    table.expire(now, [] (auto, auto, auto&) {});
+
+    table.insert(1, { 0x01 }, now + 250ms, "soon");
+    table.insert(1, { 0x02 }, now + 5s, "later"); // Past the ring, waits laps
+    table.insert(1, { 0x03 }, now + 260ms, "answered");
+    REQUIRE (table.take(1, { 0x03 }) == std::string("answered"));
+
+    std::vector<std::string> expired;
+    auto collect = [&] (coapp::endpoint_id, const coapp::inline_token&, std::string& value) {
+        expired.push_back(value);
+    };
+
+    REQUIRE (table.expire(now + 200ms, collect) == 0);
+    REQUIRE (table.expire(now + 250ms, collect) == 1);
+    REQUIRE (expired == std::vector<std::string> { "soon" });
+
+    for (auto t = 300ms; t < 5s; t += 300ms)
+        REQUIRE (table.expire(now + t, collect) == 0);
+
+    REQUIRE (table.expire(now + 5s, collect) == 1);
+    REQUIRE (expired.back() == "later");
+    REQUIRE (table.empty());
+}
+
+TEST_CASE( "Timer wheel should fire timers at their deadline", "[timer]" ) {
+    coapp::timer_wheel wheel(8, 1000);
+
+    std::vector<std::pair<uint32_t, uint64_t>> fired;
+    auto record = [&] (uint32_t id) { fired.emplace_back(id, wheel.now()); };
+
+    wheel.schedule(0, 1005);
+    wheel.schedule(1, 1000 + 64 * 3 + 7);    // Level 1
+    wheel.schedule(2, 1000 + 64 * 64 * 5);   // Level 2
+    wheel.schedule(3, 1000 + (1ull << 26));  // Beyond the wheel
+    wheel.schedule(4, 1010);
+    wheel.schedule(5, 500);                  // Already due
+    wheel.cancel(4);
+
+    REQUIRE (wheel.size() == 5);
+    REQUIRE_FALSE (wheel.scheduled(4));
+
+    wheel.advance(1001, record);
+    REQUIRE (fired == std::vector<std::pair<uint32_t, uint64_t>> { { 5, 1001 } });
+
+    wheel.advance(1000 + 64 * 64 * 5, record);
+    REQUIRE (fired.size() == 4);
+    REQUIRE (fired[1] == std::make_pair(0u, uint64_t(1005)));
+    REQUIRE (fired[2] == std::make_pair(1u, uint64_t(1000 + 64 * 3 + 7)));
+    REQUIRE (fired[3] == std::make_pair(2u, uint64_t(1000 + 64 * 64 * 5)));
+
+    wheel.advance(1000 + (1ull << 26), record);
+    REQUIRE (fired.size() == 5);
+    REQUIRE (fired[4] == std::make_pair(3u, uint64_t(1000 + (1ull << 26))));
+    REQUIRE (wheel.size() == 0);
+}
+
+TEST_CASE( "CONs should be retransmitted with exponential back-off", "[retransmission]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::retransmission_scheduler::clock;
+
+    coapp::retransmission_scheduler scheduler(4);
+    clock::time_point start = clock::time_point {} + 1h;
+
+    REQUIRE (scheduler.track(1, 100, { 0x40, 0x01, 0x00, 0x64 }, start));
+    REQUIRE (scheduler.track(1, 101, { 0x40, 0x01, 0x00, 0x65 }, start));
+    REQUIRE_FALSE (scheduler.track(1, 100, {}, start));
+
+    std::vector<clock::duration> sent;
+    std::vector<uint16_t> given_up;
+    auto send = [&] (coapp::endpoint_id, coapp::bytes_view bytes) {
+        REQUIRE (bytes.size() == 4);
+        sent.push_back(clock::duration {});
+    };
+    auto give_up = [&] (coapp::endpoint_id, uint16_t mid, std::vector<uint8_t>&& bytes) {
+        REQUIRE (bytes.size() == 4);
+        given_up.push_back(mid);
+    };
+
+    REQUIRE (scheduler.acknowledge(1, 101));
+    REQUIRE_FALSE (scheduler.acknowledge(1, 101));
+
+    // The first retransmission is between 2 and 3 seconds
+    scheduler.poll(start + 1999ms, send, give_up);
+    REQUIRE (sent.empty());
+
+    std::vector<clock::duration> at;
+    for (auto t = 0ms; t <= 100s; t += 1ms) {
+        auto before = sent.size();
+        scheduler.poll(start + t, send, give_up);
+        if (sent.size() != before)
+            at.push_back(t);
+    }
+
+    REQUIRE (at.size() == 4);
+    REQUIRE (at[0] >= 2s);
+    REQUIRE (at[0] <= 3s);
+    REQUIRE (at[1] - at[0] == 2 * at[0]);
+    REQUIRE (at[2] - at[1] == 4 * at[0]);
+    REQUIRE (at[3] - at[2] == 8 * at[0]);
+    REQUIRE (given_up == std::vector<uint16_t> { 100 });
+    REQUIRE (scheduler.size() == 0);
+}
+
+TEST_CASE( "Retransmission scheduler should handle many messages in flight", "[retransmission]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::retransmission_scheduler::clock;
+
+    const size_t count = 100000;
+    coapp::retransmission_scheduler scheduler(count);
+    clock::time_point start {};
+
+    for (size_t i = 0; i < count; i++)
+        REQUIRE (scheduler.track(i >> 16, i & 0xffff, { 0x40 }, start));
+
+    for (size_t i = 0; i < count; i += 2)
+        REQUIRE (scheduler.acknowledge(i >> 16, i & 0xffff));
+
+    size_t sent = 0;
+    scheduler.poll(start + 3s, [&] (auto, auto) { sent++; }, [] (auto, auto, auto&&) {});
+    REQUIRE (sent == count / 2);
+    REQUIRE (scheduler.outstanding(0, 1));
+    REQUIRE_FALSE (scheduler.outstanding(0, 2));
+}
+
+TEST_CASE( "Retransmission scheduler should use per-message timing", "[retransmission]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::retransmission_scheduler::clock;
+
+    coapp::retransmission_parameters params;
+    params.ack_random_factor = 1.0;
+    params.max_retransmit = 2;
+    coapp::retransmission_scheduler scheduler(1, params);
+    clock::time_point start {};
+
+    REQUIRE (scheduler.track(1, 1, { 0x40 }, start, 100ms, 1.5));
+
+    std::vector<clock::duration> at;
+    for (auto t = 0ms; t <= 1s; t += 1ms)
+        scheduler.poll(start + t, [&] (auto, auto) { at.push_back(t); }, [] (auto, auto, auto&&) {});
+    REQUIRE (at == std::vector<clock::duration> { 100ms, 250ms });
+}
+
+namespace {
+
+std::vector<uint8_t> message_of(coapp::Type type, uint16_t mid, size_t payload = 0)
+{
+    coapp::pdu pdu;
+    pdu.set_type(type);
+    pdu.set_code(coapp::Code::REQUEST_GET);
+    pdu.set_message_id(mid);
+    pdu.set_payload(std::string(payload, 'x'));
+    return pdu.to_bytes();
+}
+
+uint16_t message_id_of(const std::vector<uint8_t>& bytes)
+{
+    return (bytes[2] << 8) | bytes[3];
+}
+
+}
+
+TEST_CASE( "Congestion controller should keep NSTART CONs in flight per peer", "[congestion]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::congestion_controller::clock;
+
+    coapp::congestion_controller congestion(16, 16);
+    clock::time_point now {};
+
+    for (uint16_t mid = 1; mid <= 3; mid++)
+        REQUIRE (congestion.submit(1, message_of(coapp::Type::Confirmable, mid)));
+    REQUIRE (congestion.submit(2, message_of(coapp::Type::Confirmable, 10)));
+    REQUIRE (congestion.submit(1, message_of(coapp::Type::Acknowledgement, 20)));
+    REQUIRE (congestion.queued() == 5);
+
+    std::vector<std::pair<coapp::endpoint_id, uint16_t>> sent;
+    auto transmit = [&] (coapp::endpoint_id endpoint, std::vector<uint8_t>&& bytes, const auto& timing) {
+        REQUIRE (timing.ack_timeout == coapp::transmission::ack_timeout);
+        REQUIRE (timing.backoff == 2.0);
+        sent.emplace_back(endpoint, message_id_of(bytes));
+    };
+
+    REQUIRE (congestion.poll(now, transmit) == 2);
+    REQUIRE (sent == std::vector<std::pair<coapp::endpoint_id, uint16_t>> { { 1, 1 }, { 2, 10 } });
+    REQUIRE (congestion.in_flight(1) == 1);
+    REQUIRE (congestion.poll(now, transmit) == 0);
+
+    // The ACK stays behind the CONs queued before it
+    sent.clear();
+    congestion.complete(1, now, 100ms);
+    REQUIRE (congestion.poll(now, transmit) == 1);
+    congestion.give_up(1);
+    REQUIRE (congestion.poll(now, transmit) == 2);
+    REQUIRE (sent == std::vector<std::pair<coapp::endpoint_id, uint16_t>> { { 1, 2 }, { 1, 3 }, { 1, 20 } });
+    REQUIRE (congestion.queued() == 0);
+    REQUIRE (congestion.queued(1) == 0);
+}
+
+TEST_CASE( "Congestion controller should pace NONs at PROBING_RATE", "[congestion]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::congestion_controller::clock;
+
+    coapp::congestion_parameters params;
+    params.probing_rate = 100;
+    coapp::congestion_controller congestion(4, 16, params);
+    clock::time_point start = clock::time_point {} + 1h;
+
+    const auto size = message_of(coapp::Type::NonConfirmable, 0, 45).size();
+    REQUIRE (size == 50);
+    for (uint16_t mid = 0; mid < 3; mid++)
+        REQUIRE (congestion.submit(7, message_of(coapp::Type::NonConfirmable, mid, 45)));
+
+    size_t sent = 0;
+    auto transmit = [&] (auto, auto&&, const auto&) { sent++; };
+
+    // 50 bytes at 100 bytes/second are one NON every half second
+    REQUIRE (congestion.poll(start, transmit) == 1);
+    REQUIRE (congestion.poll(start + 499ms, transmit) == 0);
+    REQUIRE (congestion.poll(start + 500ms, transmit) == 1);
+    REQUIRE (congestion.poll(start + 999ms, transmit) == 0);
+    REQUIRE (congestion.poll(start + 1s, transmit) == 1);
+    REQUIRE (sent == 3);
+
+    // Unused credit doesn't accumulate past the burst
+    for (uint16_t mid = 0; mid < 2; mid++)
+        REQUIRE (congestion.submit(7, message_of(coapp::Type::NonConfirmable, mid, 45)));
+    REQUIRE (congestion.poll(start + 1h, transmit) == 1);
+}
+
+TEST_CASE( "Congestion controller should adapt the RTO to measured round trips", "[congestion]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::congestion_controller::clock;
+
+    coapp::congestion_parameters params;
+    params.adaptive_rto = true;
+    coapp::congestion_controller congestion(4, 4, params);
+    clock::time_point now = clock::time_point {} + 1h;
+
+    auto rto = [&] { return std::chrono::duration<double>(congestion.timing_for(1, now).ack_timeout).count(); };
+
+    REQUIRE (congestion.submit(1, message_of(coapp::Type::Confirmable, 1)));
+    REQUIRE (rto() == Approx(2.0));
+    REQUIRE (congestion.timing_for(1, now).backoff == 2.0);
+
+    // Strong samples pull the RTO towards SRTT + 4 * RTTVAR
+    congestion.complete(1, now, 100ms);
+    REQUIRE (rto() == Approx(0.5 * 0.3 + 0.5 * 2.0));
+    for (int i = 0; i < 20; i++)
+        congestion.complete(1, now, 100ms);
+    REQUIRE (rto() < 1.0);
+    REQUIRE (rto() > 0.1);
+    REQUIRE (congestion.timing_for(1, now).backoff == 3.0);
+
+    // Weak samples count less, ambiguous ones not at all
+    const auto before = rto();
+    congestion.complete(1, now, 4s, 3);
+    REQUIRE (rto() == Approx(before));
+    congestion.complete(1, now, 4s, 1);
+    REQUIRE (rto() == Approx(0.25 * (4.0 + 2.0) + 0.75 * before));
+
+    // Estimates age when there are no new samples
+    congestion.complete(1, now, 10s, 1);
+    congestion.complete(1, now, 10s, 1);
+    const auto high = rto();
+    REQUIRE (high > 3.0);
+    REQUIRE (congestion.timing_for(1, now).backoff == 1.5);
+    now += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(4.1 * high));
+    REQUIRE (rto() == Approx(1.0 + 0.5 * high).epsilon(0.001));
+}
+
+TEST_CASE( "Congestion controller should stay within its peer and queue capacity", "[congestion]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::congestion_controller::clock;
+
+    coapp::congestion_parameters params;
+    params.max_queued = 2;
+    coapp::congestion_controller congestion(2, 3, params);
+    clock::time_point now {};
+    auto transmit = [] (auto, auto&&, const auto&) {};
+
+    REQUIRE (congestion.submit(1, message_of(coapp::Type::Confirmable, 1)));
+    REQUIRE (congestion.submit(1, message_of(coapp::Type::Confirmable, 2)));
+    REQUIRE_FALSE (congestion.submit(1, message_of(coapp::Type::Confirmable, 3))); // Peer queue full
+    REQUIRE (congestion.submit(2, message_of(coapp::Type::Confirmable, 4)));
+    REQUIRE_FALSE (congestion.submit(2, message_of(coapp::Type::Confirmable, 5))); // Pool full
+    REQUIRE_FALSE (congestion.submit(3, message_of(coapp::Type::Confirmable, 6))); // No idle peer
+    REQUIRE (congestion.peers() == 2);
+
+    REQUIRE (congestion.poll(now, transmit) == 2);
+    REQUIRE_FALSE (congestion.submit(3, message_of(coapp::Type::Confirmable, 6))); // Both in flight
+
+    // Peer 2 went idle first, so it is forgotten first
+    congestion.complete(2, now, 10ms);
+    congestion.complete(1, now, 10ms);
+    REQUIRE (congestion.poll(now, transmit) == 1);
+    congestion.complete(1, now, 10ms);
+
+    REQUIRE (congestion.submit(3, message_of(coapp::Type::Confirmable, 7)));
+    REQUIRE (congestion.known(1));
+    REQUIRE_FALSE (congestion.known(2));
+    REQUIRE (congestion.peers() == 2);
+    REQUIRE (congestion.poll(now, transmit) == 1);
+
+    // Many peers through a small table
+    coapp::congestion_controller large(1000, 1000);
+    for (coapp::endpoint_id id = 0; id < 100000; id++) {
+        REQUIRE (large.submit(id, message_of(coapp::Type::Confirmable, id)));
+        REQUIRE (large.poll(now, transmit) == 1);
+        large.complete(id, now, 10ms);
+    }
+    REQUIRE (large.peers() == 1000);
+    REQUIRE (large.known(99999));
+    REQUIRE_FALSE (large.known(98999));
+}
+
+TEST_CASE( "Congestion controller should allow calls back into it while releasing", "[congestion]" ) {
+    using namespace std::chrono_literals;
+    using clock = coapp::congestion_controller::clock;
+
+    coapp::congestion_parameters params;
+    params.probing_rate = 0; // No limit
+    params.max_queued = 100000;
+    coapp::congestion_controller congestion(2, 8, params);
+    clock::time_point now {};
+
+    REQUIRE (congestion.submit(1, message_of(coapp::Type::Confirmable, 1)));
+    REQUIRE (congestion.submit(2, message_of(coapp::Type::Confirmable, 2)));
+    for (uint16_t mid = 3; mid < 6; mid++)
+        REQUIRE (congestion.submit(2, message_of(coapp::Type::NonConfirmable, mid)));
+
+    // A send path that answers right away, which idles peer 1 and lets
+    // peer 3 evict it in the middle of the walk
+    std::vector<uint16_t> sent;
+    auto transmit = [&] (coapp::endpoint_id endpoint, std::vector<uint8_t>&& bytes, const auto&) {
+        sent.push_back(message_id_of(bytes));
+        congestion.complete(endpoint, now, 10ms);
+        if (endpoint == 1)
+            REQUIRE (congestion.submit(3, message_of(coapp::Type::Confirmable, 6)));
+    };
+    REQUIRE (congestion.poll(now, transmit) == 6); // Peer 3 joined the backlog behind peer 2
+    REQUIRE (sent == std::vector<uint16_t> { 1, 2, 3, 4, 5, 6 });
+    REQUIRE_FALSE (congestion.known(1));
+    REQUIRE (congestion.queued() == 0);
+    REQUIRE (congestion.poll(now, transmit) == 0);
+
+    // Queue depth is capped to what the per-peer count holds
+    coapp::congestion_controller deep(1, 70000, params);
+    size_t accepted = 0;
+    while (deep.submit(1, message_of(coapp::Type::Confirmable, 0)))
+        accepted++;
+    REQUIRE (accepted == 0xffff);
+    REQUIRE (deep.queued(1) == 0xffff);
+}
+
+TEST_CASE( "Block options should be encoded and decoded", "[block]" ) {
+    constexpr coapp::block_option block { 5, true, 2 };
+
+    static_assert(block.size() == 64);
+    static_assert(block.offset() == 320);
+    static_assert(block.encode() == 0x5a);
+    static_assert(coapp::block_option::decode(0x5a)->num == 5);
+    static_assert(!coapp::block_option::decode(0x07));
+    static_assert(!coapp::block_option::decode(0x1000000));
+    static_assert(coapp::block_option::szx_for(1024) == 6);
+    static_assert(coapp::block_option::szx_for(1023) == 5);
+    static_assert(coapp::block_option::szx_for(1) == 0);
+    static_assert(block.resized(0).num == 20);
+    static_assert(block.resized(4).num == 5);
+
+    coapp::pdu request;
+    request.set<coapp::Option::Block2>(block.encode());
+    auto decoded = coapp::get_block<coapp::Option::Block2>(request);
+    REQUIRE (decoded);
+    REQUIRE (decoded->num == 5);
+    REQUIRE (decoded->more);
+    REQUIRE (decoded->szx == 2);
+    REQUIRE_FALSE (coapp::get_block<coapp::Option::Block1>(request));
+}
+
+TEST_CASE( "Block sender should serve blocks in place and negotiate their size", "[block]" ) {
+    std::vector<uint8_t> body(2500);
+    for (size_t i = 0; i < body.size(); i++)
+        body[i] = uint8_t(i * 7);
+
+    coapp::block_sender sender(coapp::bytes_view(body), 6);
+    REQUIRE (sender.block_count() == 3);
+
+    // Blocks of our size reference the body directly
+    coapp::borrowed_pdu response;
+    REQUIRE (sender.respond(coapp::pdu(), response, nullptr));
+    REQUIRE (response.get<coapp::Option::Block2>() == coapp::block_option { 0, true, 6 }.encode());
+    REQUIRE (response.get<coapp::Option::Size2>() == 2500u);
+    REQUIRE (response.payload().size() == 1024);
+    REQUIRE (reinterpret_cast<const uint8_t*>(response.payload().data()) == body.data());
+
+    coapp::pdu request;
+    request.set<coapp::Option::Block2>(coapp::block_option { 2, false, 6 }.encode());
+    REQUIRE (sender.respond(request, response, nullptr));
+    REQUIRE (response.get<coapp::Option::Block2>() == coapp::block_option { 2, false, 6 }.encode());
+    REQUIRE (response.payload().size() == 2500 - 2048);
+
+    // A client asking for smaller blocks gets them
+    request.set<coapp::Option::Block2>(coapp::block_option { 3, false, 4 }.encode());
+    REQUIRE (sender.respond(request, response, nullptr));
+    REQUIRE (response.get<coapp::Option::Block2>() == coapp::block_option { 3, true, 4 }.encode());
+    REQUIRE (response.payload().size() == 256);
+    REQUIRE (reinterpret_cast<const uint8_t*>(response.payload().data()) == body.data() + 768);
+
+    // A smaller server size converts the block number
+    coapp::block_sender small(coapp::bytes_view(body), 4);
+    REQUIRE (small.block({ 1, false, 6 })->num == 4);
+
+    request.set<coapp::Option::Block2>(coapp::block_option { 3, false, 6 }.encode());
+    REQUIRE_FALSE (sender.respond(request, response, nullptr));
+}
+
+TEST_CASE( "Block sender should read file backed bodies with pread", "[block]" ) {
+    FILE* file = std::tmpfile();
+    REQUIRE (file);
+
+    std::string body(1500, '\0');
+    for (size_t i = 0; i < body.size(); i++)
+        body[i] = char('a' + i % 26);
+    REQUIRE (std::fwrite(body.data(), 1, body.size(), file) == body.size());
+    std::fflush(file);
+
+    coapp::block_sender sender(fileno(file), body.size(), 6);
+    std::vector<uint8_t> scratch(1024);
+
+    coapp::pdu request;
+    request.set<coapp::Option::Block2>(coapp::block_option { 1, false, 6 }.encode());
+
+    coapp::pdu response;
+    REQUIRE (sender.respond(request, response, scratch.data()));
+    REQUIRE (response.payload() == body.substr(1024));
+    REQUIRE_FALSE (response.has<coapp::Option::Size2>());
+
+    std::fclose(file);
+}
+
+TEST_CASE( "Block receiver should stream blocks to its sink", "[block]" ) {
+    std::vector<uint8_t> body(1000);
+    for (size_t i = 0; i < body.size(); i++)
+        body[i] = uint8_t(i * 13);
+
+    auto upload = [&] (coapp::block_option block) {
+        auto offset = std::min(block.offset(), body.size());
+        auto length = std::min(block.size(), body.size() - offset);
+
+        coapp::pdu request;
+        request.set_code(coapp::Code::REQUEST_PUT);
+        request.set<coapp::Option::Block1>(block.encode());
+        if (block.num == 0)
+            request.set<coapp::Option::Size1>(uint32_t(body.size()));
+        request.set_payload(std::string(reinterpret_cast<const char*>(body.data()) + offset, length));
+        return request;
+    };
+
+    std::vector<uint8_t> received;
+    coapp::block_receiver receiver([&] (size_t offset, coapp::bytes_view data) {
+        REQUIRE (offset == received.size());
+        received.insert(received.end(), data.begin(), data.end());
+        return true;
+    }, 4);
+
+    using status = decltype(receiver)::status;
+
+    REQUIRE (receiver.receive(upload({ 0, true, 5 })) == status::next);
+    REQUIRE (receiver.received() == 512);
+
+    // We prefer 256 byte blocks, the client continues with those
+    auto ack = receiver.acknowledgement();
+    REQUIRE (ack.num == 0);
+    REQUIRE (ack.szx == 4);
+    REQUIRE (ack.more);
+
+    REQUIRE (receiver.receive(upload({ 0, true, 5 })) == status::duplicate);
+    REQUIRE (receiver.receive(upload({ 2, true, 4 })) == status::next);
+    REQUIRE (receiver.receive(upload({ 13, true, 2 })) == status::incomplete);
+    REQUIRE (receiver.receive(coapp::block_option { 3, true, 4 }, std::string(100, 'x')) == status::invalid);
+    REQUIRE (receiver.receive(upload({ 3, false, 4 })) == status::complete);
+    REQUIRE (receiver.receive(upload({ 3, false, 4 })) == status::duplicate);
+
+    REQUIRE (receiver.complete());
+    REQUIRE (received == body);
+
+    // Size1 is checked before any block is delivered
+    coapp::block_receiver limited([] (size_t, coapp::bytes_view) { return false; }, 6, 999);
+    REQUIRE (limited.receive(upload({ 0, true, 5 })) == decltype(limited)::status::too_large);
+    REQUIRE (limited.received() == 0);
+}
+
+TEST_CASE( "Block receiver should take requests without Block1 as a whole body", "[block]" ) {
+    std::string received;
+    coapp::block_receiver receiver([&] (size_t offset, coapp::bytes_view data) {
+        REQUIRE (offset == 0);
+        received.assign(data.begin(), data.end());
+        return true;
+    });
+    using status = decltype(receiver)::status;
+
+    // Larger than any block, which only Block1 payloads are held to
+    coapp::pdu request;
+    request.set_code(coapp::Code::REQUEST_PUT);
+    request.set_payload(std::string(1500, 'x'));
+
+    REQUIRE (receiver.receive(request) == status::complete);
+    REQUIRE (receiver.complete());
+    REQUIRE (receiver.received() == 1500);
+    REQUIRE (received == std::string(1500, 'x'));
+    REQUIRE (receiver.receive(request) == status::duplicate);
+
+    coapp::block_receiver limited([] (size_t, coapp::bytes_view) { return true; }, 6, 1000);
+    REQUIRE (limited.receive(request) == decltype(limited)::status::too_large);
+    REQUIRE (limited.received() == 0);
+}
+
+TEST_CASE( "Observe registry should fan out patched notifications", "[observe]" ) {
+    coapp::observe_registry registry(8);
+    std::unordered_map<coapp::endpoint_id, uint16_t> message_ids; // Shared with other messages
+    auto next_message_id = [&] (coapp::endpoint_id endpoint) { return message_ids[endpoint]++; };
+
+    const auto temperature = coapp::uri_path_hash("sensors/temperature");
+    const auto humidity = coapp::uri_path_hash("sensors/humidity");
+
+    REQUIRE (registry.subscribe(temperature, 1, { 0x01 }) == 0u);
+    REQUIRE (registry.subscribe(temperature, 2, { 0x02, 0x02 }) == 0u);
+    REQUIRE (registry.subscribe(temperature, 3, { 0x03, 0x03, 0x03 }) == 0u);
+    REQUIRE (registry.subscribe(humidity, 1, { 0x01 }) == 0u);
+    REQUIRE (registry.size() == 4);
+    REQUIRE (registry.observers(temperature) == 3);
+
+    REQUIRE (registry.unsubscribe(temperature, 1, { 0x01 }));
+    REQUIRE_FALSE (registry.unsubscribe(temperature, 1, { 0x01 }));
+    REQUIRE (registry.observers(temperature) == 2);
+
+    coapp::pdu notification;
+    notification.set_type(coapp::Type::NonConfirmable);
+    notification.set_code(coapp::Code::RESPONSE_CONTENT);
+    notification.set<coapp::Option::ETag>(coapp::bytes_view(std::vector<uint8_t> { 0xab }));
+    notification.set<coapp::Option::ContentFormat>(0);
+    notification.set_payload("21.5");
+
+    for (int round = 1; round <= 2; round++) {
+        std::vector<coapp::pdu> sent;
+        std::vector<coapp::endpoint_id> destinations;
+
+        auto count = registry.notify(temperature, notification, next_message_id, [&] (auto& batch) {
+            std::vector<msghdr> messages(batch.count);
+            batch.fill(messages.data());
+            for (size_t i = 0; i < batch.count; i++) {
+                sent.push_back(coapp::pdu::from(gather(messages[i].msg_iov, messages[i].msg_iovlen)));
+                destinations.push_back(batch.endpoints[i]);
+            }
+        });
+
+        REQUIRE (count == 2);
+        REQUIRE (sent.size() == 2);
+        for (size_t i = 0; i < sent.size(); i++) {
+            auto endpoint = destinations[i];
+            REQUIRE (sent[i].token().size() == endpoint);
+            REQUIRE (sent[i].token()[0] == endpoint);
+            REQUIRE (sent[i].type() == coapp::Type::NonConfirmable);
+            REQUIRE (sent[i].get<coapp::Option::Observe>() == uint32_t(round));
+            REQUIRE (sent[i].get<coapp::Option::ETag>());
+            REQUIRE (sent[i].get<coapp::Option::ContentFormat>() == 0u);
+            REQUIRE (sent[i].payload() == "21.5");
+            REQUIRE (sent[i].message_id() == round - 1);
+        }
+    }
+    REQUIRE (message_ids[2] == 2);
+    REQUIRE (message_ids[3] == 2);
+    REQUIRE (message_ids.count(1) == 0);
+
+    REQUIRE (registry.sequence(temperature, 3, { 0x03, 0x03, 0x03 }) == 2u);
+    REQUIRE (registry.sequence(humidity, 1, { 0x01 }) == 0u);
+
+    // Re-registration keeps the observer and its sequence
+    REQUIRE (registry.subscribe(temperature, 2, { 0x02, 0x02 }) == 2u);
+    REQUIRE (registry.observers(temperature) == 2);
+}
+
+TEST_CASE( "Observe registry should notify many observers in batches", "[observe]" ) {
+    const size_t count = 50000;
+    coapp::observe_registry registry(count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t token[4] = { uint8_t(i >> 24), uint8_t(i >> 16), uint8_t(i >> 8), uint8_t(i) };
+        REQUIRE (registry.subscribe(7, i % 100, coapp::inline_token(token, 4)));
+    }
+    REQUIRE_FALSE (registry.subscribe(8, 0, { 0x01 }));
+
+    for (uint32_t i = 0; i < count; i += 3) {
+        uint8_t token[4] = { uint8_t(i >> 24), uint8_t(i >> 16), uint8_t(i >> 8), uint8_t(i) };
+        REQUIRE (registry.unsubscribe(7, i % 100, coapp::inline_token(token, 4)));
+    }
+
+    coapp::pdu notification;
+    notification.set_code(coapp::Code::RESPONSE_CONTENT);
+    notification.set_payload("on");
+
+    std::unordered_set<uint32_t> tokens;
+    size_t batches = 0;
+    uint16_t message_id = 0;
+    auto next_message_id = [&] (coapp::endpoint_id) { return message_id++; };
+    registry.notify(7, notification, next_message_id, [&] (const coapp::observe_registry::batch& batch) {
+        batches++;
+        for (size_t i = 0; i < batch.count; i++) {
+            auto& token = batch.recipients[i].token;
+            tokens.insert(uint32_t(token.data()[0]) << 24 | token.data()[1] << 16 | token.data()[2] << 8 | token.data()[3]);
+        }
+    });
+
+    REQUIRE (tokens.size() == registry.size());
+    REQUIRE (batches == (registry.size() + 63) / 64);
+    REQUIRE (tokens.count(1));
+    REQUIRE_FALSE (tokens.count(3));
+}
+
+namespace {
+
+sockaddr_in loopback_address()
+{
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+}
+
+TEST_CASE( "UDP endpoints should exchange PDUs over loopback", "[endpoint]" ) {
+    const bool io_uring = GENERATE(false, true);
+
+    coapp::udp_endpoint::options options;
+    options.io_uring = io_uring;
+    options.batch = 8;
+
+    auto address = loopback_address();
+    coapp::udp_endpoint server(reinterpret_cast<sockaddr*>(&address), sizeof(address), options);
+    coapp::udp_endpoint client(reinterpret_cast<sockaddr*>(&address), sizeof(address), options);
+    if (io_uring && !server.uses_io_uring())
+        WARN ("io_uring unavailable, testing the epoll fallback twice");
+
+    const auto server_address = server.local_address();
+
+    // A burst larger than one batch
+    for (uint16_t mid = 0; mid < 20; mid++) {
+        coapp::pdu request;
+        request.set_code(coapp::Code::REQUEST_GET);
+        request.set_message_id(mid);
+        request.set_token({ uint8_t(mid) });
+        request.set<coapp::Option::UriPath>("hello");
+        REQUIRE (client.send(server_address, request));
+    }
+    REQUIRE (client.flush() == 20 % options.batch); // The rest went out as the queue filled
+
+    size_t requests = 0;
+    while (requests < 20) {
+        requests += server.poll(1000, [&] (const coapp::peer& from, const coapp::pdu_view& request) {
+            REQUIRE (request.code() == coapp::Code::REQUEST_GET);
+            REQUIRE (request.uri_path_hash() == coapp::uri_path_hash("hello"));
+
+            coapp::pdu response;
+            response.set_type(coapp::Type::Acknowledgement);
+            response.set_code(coapp::Code::RESPONSE_CONTENT);
+            response.set_message_id(request.message_id());
+            response.set_token(coapp::inline_token(request.token()));
+            response.set_payload("world");
+            REQUIRE (server.send(from, response));
+        });
+    }
+
+    std::vector<bool> answered(20);
+    size_t responses = 0;
+    while (responses < 20) {
+        responses += client.poll(1000, [&] (const coapp::peer& from, const coapp::pdu_view& response) {
+            REQUIRE (from.id == server_address.id);
+            REQUIRE (response.payload() == "world");
+            REQUIRE (response.token().size() == 1);
+            REQUIRE (response.token().data()[0] == response.message_id());
+            answered[response.message_id()] = true;
+        });
+    }
+    REQUIRE (std::count(answered.begin(), answered.end(), true) == 20);
+
+    // Malformed CONs are rejected with a RST
+    const uint8_t malformed[] = { 0x41, 0x01, 0x12, 0x34 };
+    REQUIRE (client.send(server_address, coapp::bytes_view(malformed, sizeof(malformed))));
+    client.flush();
+
+    while (server.dropped() == 0)
+        REQUIRE (server.poll(1000, [] (auto&, auto&) { FAIL ("malformed PDU dispatched"); }) == 0);
+
+    bool reset = false;
+    while (!reset) {
+        client.poll(1000, [&] (const coapp::peer&, const coapp::pdu_view& message) {
+            REQUIRE (message.type() == coapp::Type::Reset);
+            REQUIRE (message.message_id() == 0x1234);
+            reset = true;
+        });
+    }
+
+    // Encoded bytes go out as they are, temporaries too
+    coapp::pdu ping;
+    ping.set_type(coapp::Type::NonConfirmable);
+    ping.set_code(coapp::Code::REQUEST_GET);
+    ping.set_message_id(0x4321);
+    const std::vector<uint8_t> encoded = ping.to_bytes();
+    REQUIRE (client.send(server_address, encoded));
+    REQUIRE (client.send(server_address, ping.to_bytes()));
+    client.flush();
+
+    size_t pings = 0;
+    while (pings < 2) {
+        pings += server.poll(1000, [&] (const coapp::peer&, const coapp::pdu_view& message) {
+            REQUIRE (message.message_id() == 0x4321);
+        });
+    }
+}
+
+TEST_CASE( "Endpoint ids should identify addresses", "[endpoint]" ) {
+    auto a = loopback_address();
+    a.sin_port = htons(5683);
+    auto b = a;
+    b.sin_port = htons(5684);
+
+    auto id_of = [] (const sockaddr_in& address) {
+        return coapp::endpoint_id_of(reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    };
+    REQUIRE (id_of(a) == id_of(a));
+    REQUIRE (id_of(a) != id_of(b));
+
+    sockaddr_in6 v6 {};
+    v6.sin6_family = AF_INET6;
+    v6.sin6_addr = in6addr_loopback;
+    v6.sin6_port = htons(5683);
+    auto v6_id = coapp::endpoint_id_of(reinterpret_cast<const sockaddr*>(&v6), sizeof(v6));
+    REQUIRE (v6_id != id_of(a));
+}
+
+TEST_CASE( "MPSC queue should pass values from many producers", "[mpsc]" ) {
+    coapp::mpsc_queue<uint64_t> queue(1000);
+    REQUIRE (queue.capacity() == 1024);
+
+    const uint64_t per_thread = 100000;
+    std::vector<std::thread> producers;
+    for (uint64_t p = 0; p < 4; p++) {
+        producers.emplace_back([&, p] {
+            for (uint64_t i = 1; i <= per_thread; i++) {
+                while (!queue.push(p << 32 | i))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    uint64_t last[4] = {};
+    uint64_t received = 0;
+    while (received < 4 * per_thread) {
+        uint64_t value;
+        if (!queue.pop(value))
+            continue;
+
+        // Values of each producer arrive in order
+        auto p = value >> 32;
+        REQUIRE (p < 4);
+        REQUIRE ((value & 0xffffffff) == last[p] + 1);
+        last[p]++;
+        received++;
+    }
+
+    for (auto& t : producers)
+        t.join();
+
+    uint64_t value;
+    REQUIRE_FALSE (queue.pop(value));
+}
+
+TEST_CASE( "Sharded server should serve requests on every shard", "[sharded]" ) {
+    coapp::sharded_server_options options;
+    options.shards = 3;
+    options.endpoint.batch = 8;
+    options.poll_timeout_ms = 1;
+
+    auto address = loopback_address();
+    coapp::sharded_server<> server(reinterpret_cast<sockaddr*>(&address), sizeof(address), options);
+    REQUIRE (server.shard_count() == 3);
+
+    std::atomic<size_t> handled { 0 };
+    std::atomic<size_t> forwarded { 0 };
+
+    server.start([&] (auto& shard, const coapp::peer& from, const coapp::pdu_view& request) {
+        handled++;
+
+        coapp::pmr::pdu response(shard.arena());
+        response.set_type(coapp::Type::Acknowledgement);
+        response.set_code(coapp::Code::RESPONSE_CONTENT);
+        response.set_message_id(request.message_id());
+        response.set_payload("ok");
+        shard.respond(from, request, response);
+
+        // Cross-shard work goes through the target's inbox
+        auto next = (shard.index() + 1) % shard.server().shard_count();
+        shard.server().post(next, [&] (auto&) { forwarded++; });
+    });
+
+    const auto server_address = server.local_address();
+
+    // Several clients, so the kernel has addresses to spread over the shards
+    std::vector<std::unique_ptr<coapp::udp_endpoint>> clients;
+    for (int i = 0; i < 8; i++)
+        clients.emplace_back(new coapp::udp_endpoint(reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+
+    auto request = [] (uint16_t mid) {
+        coapp::pdu request;
+        request.set_code(coapp::Code::REQUEST_GET);
+        request.set_message_id(mid);
+        return request;
+    };
+
+    for (auto& client : clients) {
+        for (uint16_t mid = 0; mid < 4; mid++)
+            client->send(server_address, request(mid));
+        client->flush();
+    }
+
+    auto receive_all = [&] (size_t expected) {
+        size_t responses = 0;
+        for (auto& client : clients) {
+            size_t received = 0;
+            while (received < expected) {
+                received += client->poll(2000, [&] (const coapp::peer&, const coapp::pdu_view& response) {
+                    REQUIRE (response.payload() == "ok");
+                });
+            }
+            responses += received;
+        }
+        return responses;
+    };
+
+    REQUIRE (receive_all(4) == 32);
+
+    // Retransmitted requests are answered from the dedup cache
+    for (auto& client : clients) {
+        client->send(server_address, request(0));
+        client->flush();
+    }
+    REQUIRE (receive_all(1) == 8);
+
+    for (int i = 0; i < 2000 && forwarded < 32; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    server.stop();
+    REQUIRE (handled == 32);
+    REQUIRE (forwarded == 32);
+}
+
+TEST_CASE( "Sharded server should acknowledge duplicate CONs not answered yet", "[sharded]" ) {
+    coapp::sharded_server_options options;
+    options.shards = 1;
+    options.poll_timeout_ms = 1;
+
+    auto address = loopback_address();
+    coapp::sharded_server<> server(reinterpret_cast<sockaddr*>(&address), sizeof(address), options);
+
+    // Answers later, e.g. with a separate response, so nothing is cached
+    std::atomic<size_t> handled { 0 };
+    server.start([&] (auto&, const coapp::peer&, const coapp::pdu_view&) { handled++; });
+
+    coapp::udp_endpoint client(reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    coapp::pdu request;
+    request.set_type(coapp::Type::Confirmable);
+    request.set_code(coapp::Code::REQUEST_GET);
+    request.set_message_id(0x1234);
+
+    client.send(server.local_address(), request);
+    client.flush();
+    for (int i = 0; i < 2000 && handled == 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE (handled == 1);
+
+    // The retransmission stops with an empty ACK, without reaching the handler
+    client.send(server.local_address(), request);
+    client.flush();
+
+    bool acknowledged = false;
+    for (int i = 0; i < 10 && !acknowledged; i++) {
+        client.poll(200, [&] (const coapp::peer&, const coapp::pdu_view& message) {
+            REQUIRE (message.type() == coapp::Type::Acknowledgement);
+            REQUIRE (message.code() == coapp::Code::Empty);
+            REQUIRE (message.message_id() == 0x1234);
+            acknowledged = true;
+        });
+    }
+
+    server.stop();
+    REQUIRE (acknowledged);
+    REQUIRE (handled == 1);
+}
+
+TEST_CASE( "Sharded server should size responses from the endpoint buffer", "[sharded]" ) {
+    coapp::sharded_server_options options;
+    options.shards = 1;
+    options.poll_timeout_ms = 1;
+    options.endpoint.buffer_size = 2048;
+
+    auto address = loopback_address();
+    coapp::sharded_server<> server(reinterpret_cast<sockaddr*>(&address), sizeof(address), options);
+
+    std::atomic<size_t> sent { 0 };
+    std::atomic<size_t> rejected { 0 };
+    server.start([&] (auto& shard, const coapp::peer& from, const coapp::pdu_view& request) {
+        coapp::pdu response;
+        response.set_type(coapp::Type::NonConfirmable);
+        response.set_code(coapp::Code::RESPONSE_CONTENT);
+        response.set_message_id(request.message_id());
+
+        // Beyond buffer_size nothing is sent
+        response.set_payload(std::string(2048, 'x'));
+        if (!shard.respond(from, request, response))
+            rejected++;
+
+        response.set_payload(std::string(1500, 'x'));
+        if (shard.respond(from, request, response))
+            sent++;
+    });
+
+    coapp::udp_endpoint client(reinterpret_cast<sockaddr*>(&address), sizeof(address), options.endpoint);
+    coapp::pdu request;
+    request.set_type(coapp::Type::NonConfirmable);
+    request.set_code(coapp::Code::REQUEST_GET);
+    request.set_message_id(1);
+    client.send(server.local_address(), request);
+    client.flush();
+
+    size_t payload = 0;
+    for (int i = 0; i < 10 && payload == 0; i++) {
+        client.poll(200, [&] (const coapp::peer&, const coapp::pdu_view& message) {
+            payload = message.payload().size();
+        });
+    }
+
+    server.stop();
+    REQUIRE (rejected == 1);
+    REQUIRE (sent == 1);
+    REQUIRE (payload == 1500);
+}
+
+TEST_CASE( "Stats should count parsing and encoding", "[stats]" ) {
+    const auto before = coapp::thread_stats();
+
+    coapp::pdu request;
+    request.set_code(coapp::Code::REQUEST_GET);
+    request.set<coapp::Option::UriPath>("a");
+    request.add<coapp::Option::UriPath>("b");
+    request.add<coapp::Option::UriPath>("c");
+    request.set_payload("hello");
+
+    auto bytes = request.to_bytes();
+    auto parsed = coapp::pdu::from(bytes);
+
+    const std::vector<uint8_t> truncated { 0x40 };
+    REQUIRE_FALSE (coapp::pdu_view::try_from(truncated));
+
+    const auto& after = coapp::thread_stats();
+    if constexpr (!coapp::stats_enabled) {
+        // Compiled out, nothing is counted
+        REQUIRE (after.parsed == 0);
+        REQUIRE (after.encoded == 0);
+        REQUIRE (after.allocations == 0);
+        return;
+    }
+
+    REQUIRE (after.parsed - before.parsed == 1);
+    REQUIRE (after.bytes_in - before.bytes_in == bytes.size());
+    REQUIRE (after.encoded - before.encoded == 1);
+    REQUIRE (after.bytes_out - before.bytes_out == bytes.size());
+    REQUIRE (after.options[3] - before.options[3] == 1); // 3 options fall into le=4
+    REQUIRE (after.parse_failures[size_t(coapp::parse_error::truncated_header)]
+             - before.parse_failures[size_t(coapp::parse_error::truncated_header)] == 1);
+    REQUIRE (after.allocations > before.allocations);
+
+    coapp::pdu_stats total;
+    total += after;
+    total += after;
+    REQUIRE (total.parsed == 2 * after.parsed);
+
+    auto text = total.to_prometheus();
+    REQUIRE (text.find("coapp_pdus_parsed_total " + std::to_string(total.parsed) + "\n") != std::string::npos);
+    REQUIRE (text.find("coapp_parse_failures_total{reason=\"truncated_header\"}") != std::string::npos);
+    REQUIRE (text.find("coapp_options_bucket{le=\"+Inf\"} " + std::to_string(total.parsed) + "\n") != std::string::npos);
+}
@@ -0,0 +1,260 @@
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "include/modern-coapp/client.hpp"
+
+namespace {
+
+sockaddr_in loopback_address()
+{
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+// Endpoint answering on its own thread with `handler`, which returns
+// whether to reply with the PDU it filled in
+class test_server
+{
+public:
+    using handler_t = std::function<bool (const coapp::pdu_view&, coapp::pdu&)>;
+
+    explicit test_server(handler_t handler)
+        : _address(loopback_address()),
+          _endpoint(reinterpret_cast<sockaddr*>(&_address), sizeof(_address)),
+          _handler(std::move(handler)),
+          _thread([this] { run(); })
+    {}
+
+    ~test_server()
+    {
+        _stop = true;
+        _thread.join();
+    }
+
+    coapp::peer address() const
+    {
+        return _endpoint.local_address();
+    }
+
+    size_t requests() const
+    {
+        return _requests;
+    }
+
+private:
+    void run()
+    {
+        while (!_stop) {
+            _endpoint.poll(10, [&] (const coapp::peer& from, const coapp::pdu_view& request) {
+                _requests++;
+                coapp::pdu response;
+                response.set_message_id(request.message_id());
+                response.set_token(coapp::inline_token(request.token()));
+                if (_handler(request, response))
+                    _endpoint.send(from, response);
+            });
+        }
+    }
+
+    sockaddr_in _address;
+    coapp::udp_endpoint _endpoint;
+    handler_t _handler;
+    std::atomic<bool> _stop { false };
+    std::atomic<size_t> _requests { 0 };
+    std::thread _thread;
+};
+
+// Piggybacks the URI path and query, joined, as the payload
+bool echo(const coapp::pdu_view& request, coapp::pdu& response)
+{
+    std::string uri;
+    for (const auto& [number, value] : request.options()) {
+        std::string text(value.begin(), value.end());
+        if (number == coapp::Option::UriPath)
+            uri += "/" + text;
+        else if (number == coapp::Option::UriQuery)
+            uri += (uri.find('?') == uri.npos ? "?" : "&") + text;
+    }
+    uri += std::string(request.payload());
+
+    response.set_type(coapp::Type::Acknowledgement);
+    response.set_code(coapp::Code::RESPONSE_CONTENT);
+    response.set_payload(uri);
+    return true;
+}
+
+struct local_endpoint
+{
+    sockaddr_in address { loopback_address() };
+    coapp::udp_endpoint endpoint { reinterpret_cast<sockaddr*>(&address), sizeof(address) };
+};
+
+}
+
+TEST_CASE( "Coroutine clients should await responses", "[client]" ) {
+    test_server server(echo);
+    local_endpoint local;
+    coapp::client client(local.endpoint, server.address());
+
+    std::vector<std::string> payloads;
+    auto fetch = [&] (std::string_view uri) -> coapp::task<int> {
+        auto response = co_await client.get(uri);
+        REQUIRE (response);
+        REQUIRE (response.pdu.code() == coapp::Code::RESPONSE_CONTENT);
+        payloads.emplace_back(response.pdu.payload());
+        co_return payloads.size();
+    };
+
+    auto sequence = [&] () -> coapp::task<> {
+        // co_await can't go into REQUIRE, which expands its argument twice
+        auto first = co_await fetch("/sensors/temp");
+        auto second = co_await fetch("a/b?unit=C&fmt=1");
+        REQUIRE (first == 1);
+        REQUIRE (second == 2);
+
+        auto response = co_await client.post("/log", "!");
+        REQUIRE (response);
+        payloads.emplace_back(response.pdu.payload());
+    };
+
+    coapp::spawn(sequence());
+    REQUIRE (client.outstanding() == 1);
+    client.run();
+
+    REQUIRE (payloads == std::vector<std::string> { "/sensors/temp", "/a/b?unit=C&fmt=1", "/log!" });
+    REQUIRE (coapp::frame_pool::this_thread().in_use() == 0);
+}
+
+TEST_CASE( "Coroutine clients should keep trailing empty path segments", "[client]" ) {
+    test_server server([] (const coapp::pdu_view& request, coapp::pdu& response) {
+        size_t paths = 0;
+        for (const auto& option : request.options())
+            paths += option.first == coapp::Option::UriPath;
+        echo(request, response);
+        response.set_payload(std::to_string(paths) + " " + std::string(response.payload()));
+        return true;
+    });
+    local_endpoint local;
+    coapp::client client(local.endpoint, server.address());
+
+    std::vector<std::string> payloads;
+    auto fetch = [&] (std::string_view uri) -> coapp::task<> {
+        auto response = co_await client.get(uri);
+        REQUIRE (response);
+        payloads.emplace_back(response.pdu.payload());
+    };
+    auto sequence = [&] () -> coapp::task<> {
+        co_await fetch("/a/");
+        co_await fetch("/a//b");
+        co_await fetch("/");
+        co_await fetch("/?x=1");
+    };
+    coapp::spawn(sequence());
+    client.run();
+
+    REQUIRE (payloads == std::vector<std::string> { "2 /a/", "3 /a//b", "0 ", "0 ?x=1" });
+}
+
+TEST_CASE( "Coroutine clients should run many requests concurrently", "[client]" ) {
+    test_server server(echo);
+    local_endpoint local;
+    coapp::client::options options;
+    options.capacity = 256;
+    coapp::client client(local.endpoint, server.address(), options);
+
+    size_t ok = 0, overloaded = 0;
+    auto fetch = [&] (int i) -> coapp::task<> {
+        auto response = co_await client.get("/item/" + std::to_string(i));
+        if (response.status == coapp::response_status::overloaded) {
+            overloaded++;
+            co_return;
+        }
+        REQUIRE (response.status == coapp::response_status::ok);
+        REQUIRE (response.pdu.payload() == "/item/" + std::to_string(i));
+        ok++;
+    };
+
+    for (int i = 0; i < 300; i++)
+        coapp::spawn(fetch(i));
+    REQUIRE (client.outstanding() == 256);
+    REQUIRE (overloaded == 300 - 256); // Finished right away, without suspending
+
+    client.run();
+    REQUIRE (ok == 256);
+
+    // Frames were reused rather than allocated per request
+    auto& pool = coapp::frame_pool::this_thread();
+    REQUIRE (pool.in_use() == 0);
+    auto reserved = pool.reserved();
+    for (int i = 0; i < 200; i++)
+        coapp::spawn(fetch(i));
+    client.run();
+    REQUIRE (ok == 456);
+    REQUIRE (pool.reserved() == reserved);
+}
+
+TEST_CASE( "Coroutine clients should time out, retransmit and handle resets", "[client]" ) {
+    std::atomic<size_t> dropped { 0 };
+    test_server server([&] (const coapp::pdu_view& request, coapp::pdu& response) {
+        auto path = request.get<coapp::Option::UriPath>();
+        if (path == "silent")
+            return false;
+        if (path == "reset") {
+            response.set_type(coapp::Type::Reset);
+            return true;
+        }
+        if (path == "lossy" && dropped++ == 0)
+            return false;
+        return echo(request, response);
+    });
+
+    local_endpoint local;
+    coapp::client::options options;
+    options.timeout = std::chrono::milliseconds(300);
+    options.retransmission.ack_timeout = std::chrono::milliseconds(50);
+    options.retransmission.ack_random_factor = 1.0;
+    options.retransmission.max_retransmit = 1;
+    coapp::client client(local.endpoint, server.address(), options);
+
+    std::vector<coapp::response_status> statuses(3);
+    auto fetch = [&] (std::string_view uri, coapp::response_status& status) -> coapp::task<> {
+        status = (co_await client.get(uri)).status;
+    };
+    coapp::spawn(fetch("silent", statuses[0]));
+    coapp::spawn(fetch("reset", statuses[1]));
+    coapp::spawn(fetch("lossy", statuses[2]));
+    client.run(5);
+
+    REQUIRE (statuses[0] == coapp::response_status::timeout);
+    REQUIRE (statuses[1] == coapp::response_status::reset);
+    REQUIRE (statuses[2] == coapp::response_status::ok);
+    REQUIRE (dropped == 2); // The retransmission was answered
+
+    // Two tries each for silent and lossy
+    REQUIRE (server.requests() == 5);
+}
+
+TEST_CASE( "Tasks should propagate exceptions to their awaiter", "[client]" ) {
+    auto thrower = [] () -> coapp::task<int> {
+        throw std::runtime_error("boom");
+        co_return 0;
+    };
+
+    bool caught = false;
+    auto outer = [&] () -> coapp::task<> {
+        try {
+            co_await thrower();
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+    };
+    coapp::spawn(outer());
+    REQUIRE (caught);
+    REQUIRE (coapp::frame_pool::this_thread().in_use() == 0);
+}
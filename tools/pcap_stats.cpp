@@ -0,0 +1,531 @@
+// Offline statistics over captured CoAP traffic.
+//
+//     pcap_stats [--port N] [--threads N] capture.pcap [more.pcapng ...]
+//
+// Maps each pcap or pcapng file, indexes its packet records in one
+// sequential pass and then decodes the UDP payloads on every core with
+// pdu_view, which neither copies nor allocates. Per-thread counts are
+// added up at the end: message types and codes, option number frequencies,
+// payload sizes and why malformed messages failed to parse.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../include/modern-coapp.hpp"
+
+namespace {
+
+// Read-only mapping of a whole file
+class mapped_file
+{
+public:
+    explicit mapped_file(const char* path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            auto error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+
+        _size = st.st_size;
+        if (_size) {
+            void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                auto error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), path);
+            }
+            _data = static_cast<const uint8_t*>(data);
+            ::madvise(data, _size, MADV_WILLNEED);
+        }
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+        if (_data)
+            ::munmap(const_cast<uint8_t*>(_data), _size);
+    }
+
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const uint8_t* _data { nullptr };
+    size_t _size { 0 };
+};
+
+// Captured packet, pointing into a mapped file
+struct record
+{
+    const uint8_t* data;
+    uint32_t length;
+    uint16_t link_type;
+};
+
+uint16_t read16(const uint8_t* p, bool swap)
+{
+    uint16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+uint32_t read32(const uint8_t* p, bool swap)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+uint16_t read16_be(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// https://www.tcpdump.org/manpages/pcap-savefile.5.txt
+void index_pcap(const uint8_t* data, size_t size, std::vector<record>& records)
+{
+    if (size < 24)
+        throw std::runtime_error("truncated pcap header");
+
+    // Microsecond or nanosecond timestamps, in either byte order
+    auto magic = read32(data, false);
+    bool swap = magic != 0xa1b2c3d4 && magic != 0xa1b23c4d;
+    if (swap && magic != 0xd4c3b2a1 && magic != 0x4d3cb2a1)
+        throw std::runtime_error("not a pcap or pcapng file");
+    auto link_type = static_cast<uint16_t>(read32(data + 20, swap));
+
+    size_t pos = 24;
+    while (size - pos >= 16) {
+        auto captured = read32(data + pos + 8, swap);
+        pos += 16;
+        if (captured > size - pos)
+            break; // Capture cut off mid-record
+        records.push_back({ data + pos, captured, link_type });
+        pos += captured;
+    }
+}
+
+// https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-02.html
+void index_pcapng(const uint8_t* data, size_t size, std::vector<record>& records)
+{
+    bool swap = false;
+    std::vector<uint16_t> interfaces;
+
+    size_t pos = 0;
+    while (size - pos >= 12) {
+        auto block = data + pos;
+        auto type = read32(block, swap);
+
+        if (type == 0x0a0d0d0a) {
+            // Section header, the byte order magic tells the endianness of the section
+            swap = read32(block + 8, false) != 0x1a2b3c4d;
+            type = read32(block, swap);
+            interfaces.clear();
+        }
+
+        auto length = read32(block + 4, swap);
+        if (length < 12 || length % 4 || length > size - pos)
+            break;
+
+        auto body = length - 12;
+        switch (type) {
+        case 1: // Interface description
+            if (body >= 8)
+                interfaces.push_back(read16(block + 8, swap));
+            break;
+        case 6: // Enhanced packet
+            if (body >= 20) {
+                auto interface = read32(block + 8, swap);
+                auto captured = std::min(read32(block + 20, swap), body - 20);
+                if (interface < interfaces.size())
+                    records.push_back({ block + 28, captured, interfaces[interface] });
+            }
+            break;
+        case 3: // Simple packet, always from the first interface
+            if (body >= 4 && !interfaces.empty()) {
+                auto captured = std::min(read32(block + 8, swap), body - 4);
+                records.push_back({ block + 12, captured, interfaces[0] });
+            }
+            break;
+        default:
+            break;
+        }
+        pos += length;
+    }
+}
+
+void index_capture(const mapped_file& file, std::vector<record>& records)
+{
+    if (file.size() >= 4 && read32(file.data(), false) == 0x0a0d0d0a)
+        index_pcapng(file.data(), file.size(), records);
+    else if (file.size() >= 4)
+        index_pcap(file.data(), file.size(), records);
+    else
+        throw std::runtime_error("not a pcap or pcapng file");
+}
+
+enum class packet_kind { coap, other, fragment, truncated, unknown_link };
+
+// Finds the UDP payload of a captured frame
+packet_kind udp_payload(const record& r, uint16_t port, const uint8_t*& payload, size_t& size)
+{
+    const uint8_t* p = r.data;
+    size_t left = r.length;
+
+    auto skip = [&] (size_t n) {
+        if (n > left)
+            return false;
+        p += n;
+        left -= n;
+        return true;
+    };
+
+    // Link layer, down to an IP header
+    uint16_t ethertype = 0;
+    switch (r.link_type) {
+    case 0:   // BSD loopback, family in host order of the capturing machine
+    case 101: // Raw IP
+    case 228: // Raw IPv4
+    case 229: // Raw IPv6
+        if (!skip(r.link_type == 0 ? 4 : 0) || left < 1)
+            return packet_kind::truncated;
+        ethertype = (p[0] >> 4) == 6 ? 0x86dd : 0x0800;
+        break;
+    case 1: // Ethernet, possibly VLAN tagged
+        if (!skip(12) || left < 2)
+            return packet_kind::truncated;
+        ethertype = read16_be(p);
+        while (ethertype == 0x8100 || ethertype == 0x88a8) {
+            if (!skip(4) || left < 2)
+                return packet_kind::truncated;
+            ethertype = read16_be(p);
+        }
+        skip(2);
+        break;
+    case 113: // Linux cooked capture
+        if (left < 16)
+            return packet_kind::truncated;
+        ethertype = read16_be(p + 14);
+        skip(16);
+        break;
+    case 276: // Linux cooked capture v2
+        if (left < 20)
+            return packet_kind::truncated;
+        ethertype = read16_be(p);
+        skip(20);
+        break;
+    default:
+        return packet_kind::unknown_link;
+    }
+
+    // Network layer
+    if (ethertype == 0x0800) {
+        if (left < 20)
+            return packet_kind::truncated;
+        size_t header = (p[0] & 0x0f) * 4;
+        auto fragment = read16_be(p + 6);
+        if (p[9] != 17)
+            return packet_kind::other;
+        if (fragment & 0x3fff)
+            return packet_kind::fragment; // More fragments or a non-zero offset
+        if (header < 20 || !skip(header))
+            return packet_kind::truncated;
+    } else if (ethertype == 0x86dd) {
+        if (left < 40)
+            return packet_kind::truncated;
+        auto next = p[6];
+        skip(40);
+        // Hop-by-hop, routing and destination options headers
+        while (next == 0 || next == 43 || next == 60) {
+            if (left < 2)
+                return packet_kind::truncated;
+            auto length = (p[1] + 1) * 8;
+            next = p[0];
+            if (!skip(length))
+                return packet_kind::truncated;
+        }
+        if (next == 44)
+            return packet_kind::fragment;
+        if (next != 17)
+            return packet_kind::other;
+    } else {
+        return packet_kind::other;
+    }
+
+    // Transport layer
+    if (left < 8)
+        return packet_kind::truncated;
+    if (port && read16_be(p) != port && read16_be(p + 2) != port)
+        return packet_kind::other;
+
+    size_t length = read16_be(p + 4);
+    if (length < 8)
+        return packet_kind::other;
+    skip(8);
+    if (length - 8 > left)
+        return packet_kind::truncated; // Cut off by the snapshot length
+    payload = p;
+    size = length - 8;
+    return packet_kind::coap;
+}
+
+struct trace_stats
+{
+    static constexpr size_t parse_errors = static_cast<size_t>(coapp::parse_error::empty_payload) + 1;
+
+    // Upper bounds of the payload size buckets, plus a last open one
+    static constexpr size_t payload_buckets[] = { 0, 16, 64, 256, 1024 };
+    static constexpr size_t payload_histogram = std::size(payload_buckets) + 1;
+
+    uint64_t records { 0 };
+    uint64_t other { 0 };
+    uint64_t fragments { 0 };
+    uint64_t truncated { 0 };
+    uint64_t unknown_link { 0 };
+
+    uint64_t messages { 0 };
+    uint64_t errors[parse_errors] {};
+    uint64_t types[4] {};
+    uint64_t codes[256] {};
+    std::unordered_map<uint32_t, uint64_t> options;
+    uint64_t payloads[payload_histogram] {};
+    uint64_t payload_bytes { 0 };
+
+    void add(const coapp::pdu_view& view)
+    {
+        types[view.type()]++;
+        codes[view.code()]++;
+        for (const auto& option: view.options())
+            options[option.first]++;
+
+        auto size = view.payload().size();
+        size_t bucket = 0;
+        while (bucket < std::size(payload_buckets) && size > payload_buckets[bucket])
+            bucket++;
+        payloads[bucket]++;
+        payload_bytes += size;
+    }
+
+    trace_stats& operator+=(const trace_stats& o)
+    {
+        records += o.records;
+        other += o.other;
+        fragments += o.fragments;
+        truncated += o.truncated;
+        unknown_link += o.unknown_link;
+        messages += o.messages;
+        for (size_t i = 0; i < parse_errors; i++)
+            errors[i] += o.errors[i];
+        for (size_t i = 0; i < 4; i++)
+            types[i] += o.types[i];
+        for (size_t i = 0; i < 256; i++)
+            codes[i] += o.codes[i];
+        for (const auto& [number, count]: o.options)
+            options[number] += count;
+        for (size_t i = 0; i < payload_histogram; i++)
+            payloads[i] += o.payloads[i];
+        payload_bytes += o.payload_bytes;
+        return *this;
+    }
+};
+
+void decode(const record* first, const record* last, uint16_t port, trace_stats& stats)
+{
+    for (auto r = first; r != last; ++r) {
+        stats.records++;
+
+        const uint8_t* payload = nullptr;
+        size_t size = 0;
+        switch (udp_payload(*r, port, payload, size)) {
+        case packet_kind::coap:
+            break;
+        case packet_kind::other:
+            stats.other++;
+            continue;
+        case packet_kind::fragment:
+            stats.fragments++;
+            continue;
+        case packet_kind::truncated:
+            stats.truncated++;
+            continue;
+        case packet_kind::unknown_link:
+            stats.unknown_link++;
+            continue;
+        }
+
+        stats.messages++;
+        auto view = coapp::pdu_view::try_from(payload, size);
+        if (view)
+            stats.add(*view);
+        else
+            stats.errors[static_cast<size_t>(view.error())]++;
+    }
+}
+
+const char* option_name(uint32_t number)
+{
+    switch (number) {
+    case coapp::Option::IfMatch: return "If-Match";
+    case coapp::Option::UriHost: return "Uri-Host";
+    case coapp::Option::ETag: return "ETag";
+    case coapp::Option::IfNoneMatch: return "If-None-Match";
+    case coapp::Option::Observe: return "Observe";
+    case coapp::Option::UriPort: return "Uri-Port";
+    case coapp::Option::LocationPath: return "Location-Path";
+    case coapp::Option::UriPath: return "Uri-Path";
+    case coapp::Option::ContentFormat: return "Content-Format";
+    case coapp::Option::MaxAge: return "Max-Age";
+    case coapp::Option::UriQuery: return "Uri-Query";
+    case coapp::Option::Accept: return "Accept";
+    case coapp::Option::LocationQuery: return "Location-Query";
+    case coapp::Option::Block2: return "Block2";
+    case coapp::Option::Block1: return "Block1";
+    case coapp::Option::Size2: return "Size2";
+    case 35: return "Proxy-Uri";
+    case 39: return "Proxy-Scheme";
+    case coapp::Option::Size1: return "Size1";
+    default: return "";
+    }
+}
+
+void print(const trace_stats& stats)
+{
+    auto percent = [] (uint64_t n, uint64_t total) {
+        return total ? 100.0 * n / total : 0.0;
+    };
+    auto count = [] (uint64_t n) {
+        return static_cast<unsigned long long>(n);
+    };
+
+    std::printf("records          %12llu\n", count(stats.records));
+    std::printf("  UDP on port    %12llu\n", count(stats.messages));
+    std::printf("  other traffic  %12llu\n", count(stats.other));
+    std::printf("  IP fragments   %12llu\n", count(stats.fragments));
+    std::printf("  truncated      %12llu\n", count(stats.truncated));
+    std::printf("  unknown link   %12llu\n", count(stats.unknown_link));
+
+    uint64_t malformed = 0;
+    for (size_t i = 1; i < trace_stats::parse_errors; i++)
+        malformed += stats.errors[i];
+    std::printf("\nmalformed        %12llu  %6.2f%%\n", count(malformed), percent(malformed, stats.messages));
+    for (size_t i = 1; i < trace_stats::parse_errors; i++) {
+        if (stats.errors[i])
+            std::printf("  %-26s %12llu\n", coapp::to_string(static_cast<coapp::parse_error>(i)), count(stats.errors[i]));
+    }
+
+    const char* types[] = { "CON", "NON", "ACK", "RST" };
+    std::printf("\ntypes\n");
+    for (size_t i = 0; i < 4; i++)
+        std::printf("  %-14s %12llu\n", types[i], count(stats.types[i]));
+
+    std::printf("\ncodes\n");
+    for (size_t i = 0; i < 256; i++) {
+        if (stats.codes[i])
+            std::printf("  %zu.%02zu           %12llu\n", i >> 5, i & 0x1f, count(stats.codes[i]));
+    }
+
+    std::vector<std::pair<uint32_t, uint64_t>> options(stats.options.begin(), stats.options.end());
+    std::sort(options.begin(), options.end());
+    std::printf("\noptions\n");
+    for (const auto& [number, n]: options)
+        std::printf("  %5u %-16s %12llu\n", number, option_name(number), count(n));
+
+    std::printf("\npayload sizes\n");
+    for (size_t i = 0; i < trace_stats::payload_histogram; i++) {
+        if (i < std::size(trace_stats::payload_buckets))
+            std::printf("  <= %-11zu %12llu\n", trace_stats::payload_buckets[i], count(stats.payloads[i]));
+        else
+            std::printf("  >  %-11zu %12llu\n", trace_stats::payload_buckets[i - 1], count(stats.payloads[i]));
+    }
+    std::printf("  bytes          %12llu\n", count(stats.payload_bytes));
+}
+
+int usage(const char* name)
+{
+    std::fprintf(stderr, "usage: %s [--port N] [--threads N] capture.pcap|capture.pcapng ...\n"
+                         "  --port N     only UDP to or from port N, 0 for any (default 5683)\n"
+                         "  --threads N  decoding threads (default: all cores)\n", name);
+    return 2;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    uint16_t port = 5683;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<const char*> paths;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "--port" || arg == "--threads") && i + 1 < argc) {
+            auto value = std::strtoul(argv[++i], nullptr, 10);
+            if (arg == "--port")
+                port = value;
+            else
+                threads = std::max(1ul, value);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return usage(argv[0]);
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty())
+        return usage(argv[0]);
+
+    try {
+        std::vector<std::unique_ptr<mapped_file>> files;
+        std::vector<record> records;
+        for (auto path: paths) {
+            files.emplace_back(new mapped_file(path));
+            index_capture(*files.back(), records);
+        }
+
+        // Contiguous chunks, so each thread streams through its own part of the mapping
+        threads = std::min(threads, std::max<size_t>(1, records.size()));
+        std::vector<trace_stats> stats(threads);
+        std::vector<std::thread> workers;
+        auto chunk = (records.size() + threads - 1) / threads;
+        for (size_t t = 0; t < threads; t++) {
+            auto first = std::min(records.size(), t * chunk);
+            auto last = std::min(records.size(), first + chunk);
+            workers.emplace_back([&, first, last, t] {
+                decode(records.data() + first, records.data() + last, port, stats[t]);
+            });
+        }
+        for (auto& w: workers)
+            w.join();
+
+        for (size_t t = 1; t < threads; t++)
+            stats[0] += stats[t];
+        print(stats[0]);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}